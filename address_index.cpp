@@ -0,0 +1,150 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "address_index.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+namespace am {
+
+AddressIndex::AddressIndex(uint32_t page_shift)
+  : page_shift_(page_shift)
+{
+    assert(page_shift_ < kAddressBits);
+
+    // Levels are counted up from the page shift, so the top level may decode
+    // fewer than kLevelBits bits.
+    top_shift_ = TopShift(page_shift_);
+    root_ = NewNode();
+}
+
+AddressIndex::~AddressIndex() {
+    FreeNode(root_, top_shift_);
+}
+
+uintptr_t* AddressIndex::NewNode() {
+    num_nodes_++;
+    uintptr_t* node = new uintptr_t[kLevelMask + 1];
+    std::fill(node, node + kLevelMask + 1, 0);
+    return node;
+}
+
+void AddressIndex::FreeNode(uintptr_t* node, uint32_t shift) {
+    if (shift != page_shift_) {
+        for (size_t i = 0; i <= kLevelMask; i++) {
+            uintptr_t slot = node[i];
+            if (slot && !(slot & kTerminal))
+                FreeNode(reinterpret_cast<uintptr_t*>(slot), shift - kLevelBits);
+        }
+    }
+    delete[] node;
+    num_nodes_--;
+}
+
+void AddressIndex::Add(uint32_t index, uint64_t start, uint64_t end) {
+    end = std::min(end, uint64_t(1) << kAddressBits);
+    if (start < end)
+        Update(root_, top_shift_, 0, start, end, index, false);
+}
+
+void AddressIndex::Remove(uint32_t index, uint64_t start, uint64_t end) {
+    end = std::min(end, uint64_t(1) << kAddressBits);
+    if (start < end)
+        Update(root_, top_shift_, 0, start, end, index, true);
+}
+
+void AddressIndex::Clear() {
+    FreeNode(root_, top_shift_);
+    root_ = NewNode();
+}
+
+// |base| is the first address covered by |node|, and each of its slots covers
+// 1 << |shift| bytes.
+void AddressIndex::Update(uintptr_t* node, uint32_t shift, uint64_t base, uint64_t start,
+                          uint64_t end, uint32_t index, bool remove)
+{
+    uint64_t span = uint64_t(1) << shift;
+    uint64_t node_end = base + (span << kLevelBits);
+    uint64_t first = (std::max(start, base) - base) >> shift;
+    uint64_t last = (std::min(end, node_end) - 1 - base) >> shift;
+    uintptr_t value = (uintptr_t(index + 1) << 1) | kTerminal;
+
+    for (uint64_t i = first; i <= last; i++) {
+        uintptr_t& slot = node[i];
+        uint64_t slot_start = base + (i << shift);
+        uint64_t slot_end = slot_start + span;
+        bool covered = start <= slot_start && end >= slot_end;
+
+        if (remove) {
+            if (slot == value) {
+                if (covered || shift == page_shift_) {
+                    slot = 0;
+                    continue;
+                }
+                // Part of the span stays mapped, so split it.
+                uintptr_t* child = NewNode();
+                std::fill(child, child + kLevelMask + 1, value);
+                slot = reinterpret_cast<uintptr_t>(child);
+            }
+            if (slot && !(slot & kTerminal)) {
+                auto child = reinterpret_cast<uintptr_t*>(slot);
+                Update(child, shift - kLevelBits, slot_start, start, end, index, remove);
+                if (std::all_of(child, child + kLevelMask + 1,
+                                [](uintptr_t entry) -> bool { return !entry; }))
+                {
+                    FreeNode(child, shift - kLevelBits);
+                    slot = 0;
+                }
+            }
+            continue;
+        }
+
+        // A range that covers the whole slot replaces whatever was there. The
+        // bottom level has page granularity, so partial pages count too.
+        if (covered || shift == page_shift_) {
+            if (slot && !(slot & kTerminal))
+                FreeNode(reinterpret_cast<uintptr_t*>(slot), shift - kLevelBits);
+            slot = value;
+            continue;
+        }
+
+        if (!slot || (slot & kTerminal)) {
+            uintptr_t* child = NewNode();
+            if (slot)
+                std::fill(child, child + kLevelMask + 1, slot);
+            slot = reinterpret_cast<uintptr_t>(child);
+        }
+        Update(reinterpret_cast<uintptr_t*>(slot), shift - kLevelBits, slot_start, start, end,
+               index, remove);
+    }
+}
+
+} // namespace am
@@ -0,0 +1,132 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace am {
+
+// A radix tree over the 48-bit user address space, shaped like a page table:
+// each level decodes 9 bits of the page number. A slot either points to the
+// next level, or holds a range index for its entire span, so large ranges
+// only need nodes along their edges. Lookups, including "nothing registered
+// here", are at most one load per level.
+//
+// Where ranges overlap, the most recently added one wins.
+class AddressIndex final {
+  public:
+    static constexpr uint32_t kNone = 0;
+    static constexpr uint32_t kAddressBits = 48;
+
+    explicit AddressIndex(uint32_t page_shift);
+    ~AddressIndex();
+
+    AddressIndex(const AddressIndex&) = delete;
+    AddressIndex& operator =(const AddressIndex&) = delete;
+
+    // Map [start, end) to |index|. Addresses beyond kAddressBits are not
+    // indexed.
+    void Add(uint32_t index, uint64_t start, uint64_t end);
+
+    // Unmap any part of [start, end) that maps to |index|, freeing nodes
+    // left empty. Other ranges are not restored where |index| had replaced
+    // them; the caller adds them again.
+    void Remove(uint32_t index, uint64_t start, uint64_t end);
+
+    void Clear();
+
+    // Number of nodes allocated, including the root.
+    size_t num_nodes() const { return num_nodes_; }
+
+    // Returns the index of the range containing |address|, plus one, or
+    // kNone.
+    uint32_t Lookup(uint64_t address) const {
+        if (address >> kAddressBits)
+            return kNone;
+
+        const uintptr_t* node = root_;
+        for (uint32_t shift = top_shift_; ; shift -= kLevelBits) {
+            uintptr_t slot = node[(address >> shift) & kLevelMask];
+            if (slot & kTerminal)
+                return uint32_t(slot >> 1);
+            if (!slot || shift == page_shift_)
+                return kNone;
+            node = reinterpret_cast<const uintptr_t*>(slot);
+        }
+    }
+
+    // As above, with the page size known at compile time. It must match the
+    // index's.
+    template <uint32_t PageShift>
+    uint32_t Lookup(uint64_t address) const {
+        static constexpr uint32_t kTopShift = TopShift(PageShift);
+
+        if (address >> kAddressBits)
+            return kNone;
+
+        const uintptr_t* node = root_;
+        for (uint32_t shift = kTopShift; ; shift -= kLevelBits) {
+            uintptr_t slot = node[(address >> shift) & kLevelMask];
+            if (slot & kTerminal)
+                return uint32_t(slot >> 1);
+            if (!slot || shift == PageShift)
+                return kNone;
+            node = reinterpret_cast<const uintptr_t*>(slot);
+        }
+    }
+
+  private:
+    static constexpr uint32_t kLevelBits = 9;
+    static constexpr uintptr_t kLevelMask = (uintptr_t(1) << kLevelBits) - 1;
+    static constexpr uintptr_t kTerminal = 1;
+
+    // The shift of the root level: the page shift plus whole levels, up to
+    // the address width.
+    static constexpr uint32_t TopShift(uint32_t page_shift) {
+        uint32_t shift = page_shift;
+        while (shift + kLevelBits < kAddressBits)
+            shift += kLevelBits;
+        return shift;
+    }
+
+    void Update(uintptr_t* node, uint32_t shift, uint64_t base, uint64_t start, uint64_t end,
+                uint32_t index, bool remove);
+    uintptr_t* NewNode();
+    void FreeNode(uintptr_t* node, uint32_t shift);
+
+  private:
+    uint32_t page_shift_;
+    uint32_t top_shift_;
+    uintptr_t* root_;
+    size_t num_nodes_ = 0;
+};
+
+} // namespace am
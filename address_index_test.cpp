@@ -0,0 +1,122 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "address_index.h"
+
+#include <gtest/gtest.h>
+
+using namespace am;
+
+TEST(AddressIndex, Empty) {
+    AddressIndex index(12);
+    EXPECT_EQ(index.Lookup(0), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0x7fffffffffffull), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0xffffffffffffffffull), AddressIndex::kNone);
+}
+
+TEST(AddressIndex, Pages) {
+    AddressIndex index(12);
+    index.Add(0, 0x10000, 0x12000);
+    index.Add(1, 0x12000, 0x13000);
+
+    EXPECT_EQ(index.Lookup(0xffff), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0x10000), 1);
+    EXPECT_EQ(index.Lookup(0x11fff), 1);
+    EXPECT_EQ(index.Lookup(0x12000), 2);
+    EXPECT_EQ(index.Lookup(0x12fff), 2);
+    EXPECT_EQ(index.Lookup(0x13000), AddressIndex::kNone);
+}
+
+TEST(AddressIndex, LargeRange) {
+    AddressIndex index(12);
+
+    // Unaligned at both ends, and spanning several top-level slots.
+    uint64_t start = 0x7f0000123000ull;
+    uint64_t end = start + (uint64_t(1) << 40) + 0x5000;
+    index.Add(7, start, end);
+
+    EXPECT_EQ(index.Lookup(start - 1), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(start), 8);
+    EXPECT_EQ(index.Lookup(start + (uint64_t(1) << 39)), 8);
+    EXPECT_EQ(index.Lookup(end - 1), 8);
+    EXPECT_EQ(index.Lookup(end), AddressIndex::kNone);
+}
+
+TEST(AddressIndex, Overlap) {
+    AddressIndex index(12);
+    index.Add(0, 0x100000, 0x400000);
+    index.Add(1, 0x200000, 0x300000);
+
+    EXPECT_EQ(index.Lookup(0x100000), 1);
+    EXPECT_EQ(index.Lookup(0x200000), 2);
+    EXPECT_EQ(index.Lookup(0x2fffff), 2);
+    EXPECT_EQ(index.Lookup(0x300000), 1);
+}
+
+TEST(AddressIndex, Remove) {
+    AddressIndex index(12);
+    index.Add(3, 0x40000000, 0x80000000);
+
+    // Punch a hole in the middle, which splits the covering slot.
+    index.Remove(3, 0x50001000, 0x50003000);
+    EXPECT_EQ(index.Lookup(0x50000fff), 4);
+    EXPECT_EQ(index.Lookup(0x50001000), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0x50002fff), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0x50003000), 4);
+
+    // Removing a different index is a no-op.
+    index.Remove(5, 0x40000000, 0x80000000);
+    EXPECT_EQ(index.Lookup(0x40000000), 4);
+
+    index.Remove(3, 0x40000000, 0x80000000);
+    EXPECT_EQ(index.Lookup(0x40000000), AddressIndex::kNone);
+    EXPECT_EQ(index.Lookup(0x7fffffff), AddressIndex::kNone);
+
+    // Nodes left empty are freed.
+    EXPECT_EQ(index.num_nodes(), 1);
+    index.Add(1, 0x12345000, 0x12346000);
+    index.Add(2, 0x12346000, 0x12347000);
+    EXPECT_GT(index.num_nodes(), 1);
+    index.Remove(1, 0x12345000, 0x12346000);
+    EXPECT_EQ(index.Lookup(0x12346000), 3);
+    EXPECT_GT(index.num_nodes(), 1);
+    index.Remove(2, 0x12346000, 0x12347000);
+    EXPECT_EQ(index.num_nodes(), 1);
+
+    index.Add(1, 0x1000, 0x2000);
+    index.Clear();
+    EXPECT_EQ(index.Lookup(0x1000), AddressIndex::kNone);
+}
+
+TEST(AddressIndex, Beyond48Bits) {
+    AddressIndex index(12);
+    index.Add(0, 0xfffffffff000ull, 0x1000000001000ull);
+    EXPECT_EQ(index.Lookup(0xfffffffff000ull), 1);
+    EXPECT_EQ(index.Lookup(0x1000000000000ull), AddressIndex::kNone);
+}
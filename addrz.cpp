@@ -31,86 +31,823 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <chrono>
 #include <limits>
 
 #include <amtl/am-bits.h>
 #include "platform.h"
+#include "pointer_cage.h"
+
+#if defined(__GNUC__)
+# define ADDRZ_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_MSC_VER)
+# include <xmmintrin.h>
+# define ADDRZ_PREFETCH(p) _mm_prefetch(reinterpret_cast<const char*>(p), _MM_HINT_T0)
+#else
+# define ADDRZ_PREFETCH(p)
+#endif
 
 namespace am {
 
-AddressDict::AddressDict(IPlatform* platform)
-  : platform_(platform)
+AddressDictCore::AddressDictCore(IPlatform* platform, const AddressDictOptions& options,
+                                 uint32_t page_shift, uint32_t id_bits)
+  : platform_(platform),
+    options_(options),
+    id_limit_((uint64_t(1) << id_bits) - 1)
 {
     if (!platform_)
         platform_ = IPlatform::GetDefault();
 
-    // Start at the first valid page.
-    next_id_ = platform_->GetPageSize() - 1;
-    assert(next_id_ != 0);
-}
+    // Start at the first valid page. Narrow ids cannot spare a page (with
+    // 64KiB pages, 16-bit ids have no room for one), so they start at 1.
+    int page_size = platform_->GetPageSize();
+    page_size_ = page_size;
+    next_id_ = (id_bits >= 32) ? page_size - 1 : 1;
+    assert(next_id_ != 0 && next_id_ < id_limit_);
+    assert(!page_shift || page_size == 1 << page_shift);
 
-std::optional<uint32_t> AddressDict::Make32bitAddress(void* address, size_t nbytes) {
-    if (address == nullptr)
-        return {0};
+    if (options_.direct_map_decode || options_.address_index)
+        assert(ke::IsPowerOfTwo(page_size));
+    assert(options_.align_shift <= uint32_t(ke::Log2(page_size)));
+    if (options_.reserve_chunk_size) {
+        assert(ke::IsPowerOfTwo(options_.reserve_chunk_size));
+        assert(options_.reserve_chunk_size >= size_t(page_size));
+    }
+    // The id table only covers a 32-bit id space.
+    assert(!options_.direct_map_decode || id_bits <= 32);
+    if (options_.direct_map_decode && id_bits <= 32)
+        id_table_ = std::make_unique<IdPageTable>(ke::Log2(page_size));
+    if (options_.address_index)
+        address_index_ = std::make_unique<AddressIndex>(ke::Log2(page_size));
+}
 
+std::optional<uint64_t> AddressDictCore::MakeIdSlow(uintptr_t value, size_t nbytes) {
     Range range;
-
-    uintptr_t value = reinterpret_cast<uintptr_t>(address);
-    auto it = FindRangeForAddress(value, nbytes);
-    if (it) {
-        range = sorted_maps_[it.value()];
+    if (auto existing = LookupAddress(value, nbytes)) {
+        range = *existing;
     } else {
+        if (options_.negative_cache_ttl_ms && InNegativeCache(value))
+            return {};
+
         // No existing range found, make a new one.
-        if (!GetMapForAddress(value, nbytes, &range.map))
+        if (!GetMapForAddress(value, nbytes, &range.map)) {
+            if (options_.negative_cache_ttl_ms) {
+                std::vector<Mapping> snapshot;
+                if (platform_->GetAllMappings(&snapshot))
+                    RememberGap(snapshot, value);
+            }
             return {};
-        if (range.map.size > std::numeric_limits<uint32_t>::max() ||
-            !ke::IsUint32AddSafe(next_id_, range.map.size))
-        {
-            // Can we truncate the range to make room?
-            uint32_t remaining = std::numeric_limits<uint32_t>::max() - next_id_;
-            if (!remaining || remaining < value - range.map.start)
+        }
+        if (!IsAllowed(range.map))
+            return {};
+        if (options_.reserve_chunk_size)
+            ClipToChunks(value, nbytes, &range.map);
+
+        if (auto grown = GrowLastRange(range.map)) {
+            range = *grown;
+        } else {
+            if (!ReserveIds(value, &range))
                 return {};
-            range.map.size = remaining;
+
+            InsertRange(range);
+            InsertSortedMap(range);
         }
+    }
 
-        // Reserve IDs for this mapping.
-        range.id = next_id_;
-        next_id_ += range.map.size;
+    if (options_.memoize_last_range)
+        compress_memo_ = Memo{range, generation_};
+    return IdForAddress(range, value);
+}
 
-        ranges_.emplace_back(range);
+template <typename Id>
+size_t AddressDictCore::MakeIdsImpl(void* const* addresses, size_t count, Id* ids,
+                                    const size_t* nbytes, bool* failed)
+{
+    size_t failures = 0;
+    auto fail = [&](size_t i) -> void {
+        ids[i] = 0;
+        if (failed)
+            failed[i] = true;
+        failures++;
+    };
+
+    // First pass: resolve everything that already has a range.
+    std::vector<size_t> misses;
+    size_t hint = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (failed)
+            failed[i] = false;
+
+        uintptr_t value = reinterpret_cast<uintptr_t>(addresses[i]);
+        if (!value) {
+            ids[i] = 0;
+            continue;
+        }
+        if (value & AlignMask()) {
+            fail(i);
+            continue;
+        }
+
+        const Range* range;
+        if (address_index_) {
+            range = LookupAddress(value, nbytes ? nbytes[i] : 0);
+        } else {
+            auto r = FindRangeForAddressFrom(value, hint);
+            if (r)
+                hint = r.value();
+            range = CheckRangeSpan(r ? &sorted_maps_[r.value()] : nullptr, value,
+                                   nbytes ? nbytes[i] : 0);
+            if (r && !range)
+                range = FindRangeCovering(value, nbytes[i]);
+        }
+        if (!range) {
+            misses.emplace_back(i);
+            continue;
+        }
 
-        // Resort the addr -> id table for fast lookup.
-        sorted_maps_.emplace_back(range);
-        std::sort(sorted_maps_.begin(), sorted_maps_.end());
+        if (auto id = IdForAddress(*range, value))
+            ids[i] = Id(id.value());
+        else
+            fail(i);
     }
 
-    assert(range.map.owns(address));
+    if (misses.empty())
+        return failures;
 
-    if (!ke::IsUint32AddSafe(range.id, (value - range.map.start)))
+    if (options_.negative_cache_ttl_ms) {
+        auto known_bad = [&](size_t i) -> bool {
+            if (!InNegativeCache(reinterpret_cast<uintptr_t>(addresses[i])))
+                return false;
+            fail(i);
+            return true;
+        };
+        misses.erase(std::remove_if(misses.begin(), misses.end(), known_bad), misses.end());
+        if (misses.empty())
+            return failures;
+    }
+
+    // Second pass: register new ranges in address order, so that consecutive
+    // misses in the same mapping share the range created for the first.
+    std::sort(misses.begin(), misses.end(), [addresses](size_t a, size_t b) -> bool {
+        return addresses[a] < addresses[b];
+    });
+
+    std::vector<Mapping> snapshot;
+    bool have_snapshot = platform_->GetAllMappings(&snapshot);
+
+    // |recent| is the range created or grown for the previous miss.
+    std::vector<Range> added;
+    std::optional<Range> recent;
+    for (size_t i : misses) {
+        uintptr_t value = reinterpret_cast<uintptr_t>(addresses[i]);
+        size_t span = nbytes ? nbytes[i] : 0;
+
+        Range range;
+        if (recent && recent->map.owns(value) &&
+            (span <= 1 || recent->map.owns(value + span - 1)))
+        {
+            range = recent.value();
+        } else {
+            bool ok = have_snapshot
+                      ? GetMapFromSnapshot(snapshot, value, span, &range.map)
+                      : GetMapForAddress(value, span, &range.map);
+            if (!ok && have_snapshot && options_.negative_cache_ttl_ms)
+                RememberGap(snapshot, value);
+            ok = ok && IsAllowed(range.map);
+            if (ok && options_.reserve_chunk_size)
+                ClipToChunks(value, span, &range.map);
+            if (!ok) {
+                fail(i);
+                continue;
+            }
+
+            // As in MakeIdSlow, a span running past the most recent range
+            // grows it rather than adding an overlapping one.
+            if (auto grown = GrowLastRange(range.map, added.empty() ? nullptr : &added.back())) {
+                range = *grown;
+            } else {
+                if (!ReserveIds(value, &range)) {
+                    fail(i);
+                    continue;
+                }
+                InsertRange(range);
+                added.emplace_back(range);
+            }
+            recent = range;
+        }
+
+        if (auto id = IdForAddress(range, value))
+            ids[i] = Id(id.value());
+        else
+            fail(i);
+    }
+
+    // Insert all new ranges into the addr -> id table at once.
+    if (!added.empty())
+        InsertSortedMaps(added.data(), added.data() + added.size());
+    return failures;
+}
+
+template size_t AddressDictCore::MakeIdsImpl(void* const*, size_t, uint16_t*, const size_t*,
+                                             bool*);
+template size_t AddressDictCore::MakeIdsImpl(void* const*, size_t, uint32_t*, const size_t*,
+                                             bool*);
+template size_t AddressDictCore::MakeIdsImpl(void* const*, size_t, uint64_t*, const size_t*,
+                                             bool*);
+
+std::optional<PrewarmStats> AddressDictCore::Prewarm(uintptr_t start, uintptr_t end,
+                                                     MappingFilter filter, void* data)
+{
+    std::vector<Mapping> snapshot;
+    if (!platform_->GetAllMappings(&snapshot))
         return {};
-    return {range.id + uint32_t(value - range.map.start)};
+    InvalidateNegativeCache();
+
+    PrewarmStats stats;
+    std::vector<Range> added;
+    for (const auto& map : snapshot) {
+        if (map.end() <= start || map.start >= end)
+            continue;
+        if (!IsAllowed(map) || (filter && !filter(data, map)))
+            continue;
+
+        Range range;
+        range.map = map;
+        range.map.start = std::max(map.start, start & ~AlignMask());
+        range.map.size = std::min(map.end(), end) - range.map.start;
+        if (LookupAddress(range.map.start, range.map.size))
+            continue;
+        if (!ReserveIds(range.map.start, &range))
+            continue;
+
+        InsertRange(range);
+        added.emplace_back(range);
+        stats.ranges++;
+        stats.ids_used += IdsFor(range.map.size);
+    }
+
+    if (!added.empty())
+        InsertSortedMaps(added.data(), added.data() + added.size());
+    return {stats};
 }
 
-std::optional<void*> AddressDict::RecoverAddress(uint32_t id, size_t nbytes) {
-    auto r = FindRangeForId(id);
-    if (!r)
+bool AddressDictCore::ReserveIds(uintptr_t value, Range* range) {
+    uint64_t ids = IdsFor(range->map.size);
+    bool fits = ids <= id_limit_ - next_id_;
+    if (!fits && options_.id_overflow == IdOverflow::TruncateFromAddress) {
+        uintptr_t start = std::max(range->map.start, value & ~uintptr_t(page_size_ - 1));
+        range->map.size -= start - range->map.start;
+        range->map.start = start;
+        ids = IdsFor(range->map.size);
+        fits = ids <= id_limit_ - next_id_;
+    }
+    bool truncate = options_.id_overflow != IdOverflow::Fail;
+
+    // Prefer released ids, so the unused end of the id space is kept whole.
+    // Once that is exhausted, a released interval too short for the mapping
+    // can still hold a truncated range.
+    if (!free_ids_.empty()) {
+        uint64_t needed = (fits || !truncate) ? ids : IdsFor(value - range->map.start + 1);
+        if (auto slot = FindFreeIds(ids, needed)) {
+            auto& free = free_ids_[slot.value()];
+            range->id = free.id;
+            if (free.size <= ids) {
+                TruncateToIds(range, free.size);
+                free_ids_.erase(free_ids_.begin() + slot.value());
+            } else {
+                free.id += ids;
+                free.size -= ids;
+            }
+            return true;
+        }
+    }
+
+    if (!fits) {
+        // Can we truncate the range to make room?
+        uint64_t remaining = id_limit_ - next_id_;
+        if (!truncate || remaining <= ((value - range->map.start) >> options_.align_shift))
+            return false;
+        TruncateToIds(range, remaining);
+        ids = remaining;
+    }
+
+    // Reserve IDs for this mapping.
+    range->id = next_id_;
+    next_id_ += ids;
+    return true;
+}
+
+void AddressDictCore::TruncateToIds(Range* range, uint64_t ids) {
+    uint64_t size = std::min<uint64_t>(range->map.size, ids << options_.align_shift);
+    range->map.size = size_t(size);
+}
+
+bool AddressDictCore::IsAllowed(const Mapping& map) const {
+    if (map.prot & kProtUnknown)
+        return true;
+    return (map.prot & options_.required_prot) == options_.required_prot &&
+           !(map.prot & options_.forbidden_prot);
+}
+
+// Trim |map| to the chunks holding |address| and |nbytes| after it.
+void AddressDictCore::ClipToChunks(uintptr_t address, size_t nbytes, Mapping* map) {
+    uint64_t mask = options_.reserve_chunk_size - 1;
+    uint64_t start = std::max<uint64_t>(map->start, address & ~mask);
+    uint64_t last = uint64_t(address) + std::max<size_t>(nbytes, 1);
+    uint64_t end = std::min<uint64_t>(uint64_t(map->start) + map->size, (last + mask) & ~mask);
+
+    map->start = uintptr_t(start);
+    map->size = size_t(end - start);
+}
+
+// If |map| continues the most recent range, grow that range to cover it
+// instead of registering a new one. This keeps ids contiguous across the
+// boundary, but only works while no ids have been handed out after it.
+//
+// |map| continues the range if it starts inside it, for example when a span
+// runs past its end. With chunked reservation, the next chunk over counts as
+// well.
+auto AddressDictCore::GrowLastRange(const Mapping& map, Range* pending) -> const Range* {
+    if (by_id_.empty())
+        return nullptr;
+
+    uint32_t slot = by_id_.back().slot;
+    Range& last = ranges_[slot];
+    if (RangeEnd(last) != next_id_ || map.end() <= last.map.end())
+        return nullptr;
+    if (!last.map.owns(map.start) &&
+        !(options_.reserve_chunk_size && last.map.end() == map.start))
+    {
+        return nullptr;
+    }
+
+    size_t size = map.end() - last.map.start;
+    uint64_t growth = IdsFor(size) - IdsFor(last.map.size);
+    if (growth > id_limit_ - next_id_)
+        return nullptr;
+
+    // Ranges are ordered by start address, so growing one in place keeps
+    // sorted_maps_ sorted. One that is not in sorted_maps_ yet is grown
+    // where it is.
+    if (pending && pending->id == last.id) {
+        pending->map.Merge(map);
+    } else {
+        auto pos = std::lower_bound(sorted_maps_.begin(), sorted_maps_.end(), last);
+        while (pos != sorted_maps_.end() && pos->id != last.id)
+            pos++;
+        assert(pos != sorted_maps_.end());
+        pos->map.Merge(map);
+    }
+
+    uint64_t old_end = next_id_;
+    last.map.Merge(map);
+    assert(last.map.size == size);
+    next_id_ += growth;
+    generation_++;
+    longest_range_ = std::max(longest_range_, last.map.size);
+
+    if (id_table_)
+        id_table_->Add(slot, uint32_t(old_end), next_id_);
+    if (address_index_)
+        address_index_->Add(slot, last.map.start, uint64_t(last.map.start) + last.map.size);
+    return &last;
+}
+
+void AddressDictCore::InsertRange(const Range& range) {
+    generation_++;
+    longest_range_ = std::max(longest_range_, range.map.size);
+
+    uint32_t slot;
+    if (!free_slots_.empty()) {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+        ranges_[slot] = range;
+    } else {
+        slot = uint32_t(ranges_.size());
+        ranges_.emplace_back(range);
+    }
+
+    // Fresh ids are handed out in increasing order, so this is usually an
+    // append. Reused ids go in the middle. Either way, only the neighbours'
+    // links change, and the lookup tables only need this range's entries.
+    auto pos = by_id_.end();
+    if (!by_id_.empty() && range.id < by_id_.back().id) {
+        pos = std::upper_bound(by_id_.begin(), by_id_.end(), range.id,
+                               [](uint64_t id, const IdSlot& entry) -> bool {
+            return id < entry.id;
+        });
+    }
+    const Range* prev = nullptr;
+    if (pos != by_id_.begin()) {
+        prev = &ranges_[(pos - 1)->slot];
+        ranges_[(pos - 1)->slot].next = slot;
+    }
+    ranges_[slot].next = (pos != by_id_.end()) ? pos->slot : kNoSlot;
+    by_id_.insert(pos, IdSlot{range.id, slot});
+
+    if (id_table_) {
+        // The range comes first on each of its pages, except the one it
+        // starts on if the previous range ends there too.
+        uint64_t start = range.id;
+        uint64_t page_mask = page_size_ - 1;
+        if (prev && ((RangeEnd(*prev) - 1) & ~page_mask) == (start & ~page_mask))
+            start = (start | page_mask) + 1;
+        if (start < RangeEnd(range))
+            id_table_->Set(slot, uint32_t(start), RangeEnd(range));
+    }
+    if (address_index_)
+        address_index_->Add(slot, range.map.start, uint64_t(range.map.start) + range.map.size);
+}
+
+// Once a range has been removed from the address index, give the pages it
+// held back to the ranges that share them.
+void AddressDictCore::ReindexAddresses(uint64_t start, uint64_t end) {
+    uint64_t page_mask = page_size_ - 1;
+    start &= ~page_mask;
+    end = (end + page_mask) & ~page_mask;
+
+    // No range holding |start| can begin more than longest_range_ before it.
+    uint64_t from = start - std::min<uint64_t>(start, longest_range_);
+    auto iter = std::lower_bound(sorted_maps_.begin(), sorted_maps_.end(), from,
+                                 [](const Range& range, uint64_t address) -> bool {
+        return range.map.start < address;
+    });
+    for (; iter != sorted_maps_.end() && iter->map.start < end; iter++) {
+        uint64_t range_end = uint64_t(iter->map.start) + iter->map.size;
+        if (range_end <= start)
+            continue;
+        auto slot = FindRangeForId(iter->id);
+        assert(slot);
+        address_index_->Add(uint32_t(slot.value()), std::max<uint64_t>(iter->map.start, start),
+                            std::min(range_end, end));
+    }
+}
+
+size_t AddressDictCore::ReleaseRange(void* address) {
+    uintptr_t value = reinterpret_cast<uintptr_t>(address);
+    return ReleaseRangesIf([value](const Range& range) -> bool {
+        return range.map.owns(value);
+    });
+}
+
+size_t AddressDictCore::ReleaseRanges(uintptr_t start, size_t size) {
+    uint64_t end = uint64_t(start) + size;
+    return ReleaseRangesIf([start, end](const Range& range) -> bool {
+        return range.map.start < end && uint64_t(range.map.start) + range.map.size > start;
+    });
+}
+
+size_t AddressDictCore::ReconcileMappings() {
+    platform_->InvalidateMappings();
+    InvalidateNegativeCache();
+
+    std::vector<Mapping> snapshot;
+    bool have_snapshot = platform_->GetAllMappings(&snapshot);
+
+    return ReleaseRangesIf([&, this](const Range& range) -> bool {
+        // The cage's owner decides when it goes away.
+        if (cage_size_ && range.id == cage_id_)
+            return false;
+
+        Mapping map;
+        if (have_snapshot)
+            return !GetMapFromSnapshot(snapshot, range.map.start, range.map.size, &map);
+        return !GetMapForAddress(range.map.start, range.map.size, &map);
+    });
+}
+
+template <typename Pred>
+size_t AddressDictCore::ReleaseRangesIf(Pred pred) {
+    auto usable_at = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(options_.id_quarantine_ms);
+
+    // by_id_ is sorted by id, so this is too.
+    std::vector<IdSlot> released;
+    for (const auto& entry : by_id_) {
+        const auto& range = ranges_[entry.slot];
+        if (pred(range)) {
+            FreeIds(range.id, IdsFor(range.map.size), usable_at);
+            released.emplace_back(entry);
+        }
+    }
+    if (released.empty())
+        return 0;
+
+    auto by_id = [](const IdSlot& entry, uint64_t id) -> bool {
+        return entry.id < id;
+    };
+    auto is_released = [&](uint64_t id) -> bool {
+        auto iter = std::lower_bound(released.begin(), released.end(), id, by_id);
+        return iter != released.end() && iter->id == id;
+    };
+    if (cage_size_ && is_released(cage_id_)) {
+        cage_start_ = 0;
+        cage_size_ = 0;
+        cage_id_ = 0;
+        cage_ids_ = 0;
+    }
+
+    // Drop them from by_id_, linking each survivor to the next.
+    uint32_t* link = nullptr;
+    auto out = by_id_.begin();
+    for (const auto& entry : by_id_) {
+        if (is_released(entry.id))
+            continue;
+        if (link)
+            *link = entry.slot;
+        link = &ranges_[entry.slot].next;
+        *out++ = entry;
+    }
+    if (link)
+        *link = kNoSlot;
+    by_id_.erase(out, by_id_.end());
+
+    sorted_maps_.erase(std::remove_if(sorted_maps_.begin(), sorted_maps_.end(),
+                                      [&](const Range& range) -> bool {
+        return is_released(range.id);
+    }), sorted_maps_.end());
+
+    // Only the released ranges' own entries change. In the id table, the
+    // next surviving range may start on a page a released range held.
+    uint64_t page_mask = page_size_ - 1;
+    for (const auto& entry : released) {
+        const auto& range = ranges_[entry.slot];
+        if (id_table_)
+            id_table_->Remove(entry.slot, uint32_t(range.id), RangeEnd(range));
+        if (address_index_) {
+            address_index_->Remove(entry.slot, range.map.start,
+                                   uint64_t(range.map.start) + range.map.size);
+        }
+    }
+    if (id_table_) {
+        for (const auto& entry : released) {
+            uint64_t last = RangeEnd(ranges_[entry.slot]) - 1;
+            auto next = std::lower_bound(by_id_.begin(), by_id_.end(), entry.id, by_id);
+            if (next != by_id_.end() && (next->id & ~page_mask) == (last & ~page_mask))
+                id_table_->Add(next->slot, uint32_t(next->id), next->id + 1);
+        }
+    }
+    for (const auto& entry : released) {
+        const auto& range = ranges_[entry.slot];
+        if (address_index_)
+            ReindexAddresses(range.map.start, uint64_t(range.map.start) + range.map.size);
+        ranges_[entry.slot] = Range{};
+        free_slots_.emplace_back(entry.slot);
+    }
+
+    generation_++;
+    return released.size();
+}
+
+std::optional<uint64_t> AddressDictCore::AttachCage(const PointerCage& cage) {
+    assert(cage.reserved());
+    assert(!(cage.base() & AlignMask()));
+    if (cage_size_ || !cage.reserved())
+        return {};
+
+    uint64_t start = cage.base();
+    uint64_t end = start + cage.size();
+    bool overlaps = std::any_of(sorted_maps_.begin(), sorted_maps_.end(),
+                                [start, end](const Range& range) -> bool {
+        return range.map.start < end && uint64_t(range.map.start) + range.map.size > start;
+    });
+    if (overlaps)
         return {};
 
-    const auto& range = ranges_[r.value()];
-    uintptr_t offset = id - range.id;
-    uintptr_t address = range.map.start + offset;
-    if (address + nbytes > range.map.end())
+    // The window must be whole, so neither reused nor truncated ids will do.
+    Range range;
+    range.map = Mapping{cage.base(), size_t(cage.size())};
+    uint64_t ids = IdsFor(range.map.size);
+    if (ids > id_limit_ - next_id_)
         return {};
-    return {reinterpret_cast<void*>(address)};
+
+    range.id = next_id_;
+    next_id_ += ids;
+    InsertRange(range);
+    InsertSortedMap(range);
+
+    cage_start_ = range.map.start;
+    cage_size_ = range.map.size;
+    cage_id_ = range.id;
+    cage_ids_ = ids;
+    return {range.id};
+}
+
+void AddressDictCore::InvalidateNegativeCache() {
+    gap_generation_++;
+}
+
+bool AddressDictCore::InNegativeCache(uintptr_t address) {
+    std::optional<std::chrono::steady_clock::time_point> now;
+    for (const auto& gap : gaps_) {
+        if (gap.generation != gap_generation_ || address < gap.start || address > gap.last)
+            continue;
+        if (!now)
+            now = std::chrono::steady_clock::now();
+        if (now.value() >= gap.expires)
+            continue;
+        stats_.negative_cache_hits++;
+        return true;
+    }
+    return false;
+}
+
+// Remember the gap between the mappings around |address|, if it is not
+// mapped in |snapshot|. The snapshot must be sorted and coalesced.
+void AddressDictCore::RememberGap(const std::vector<Mapping>& snapshot, uintptr_t address) {
+    auto next = std::upper_bound(snapshot.begin(), snapshot.end(), address,
+                                 [](uintptr_t address, const Mapping& map) -> bool {
+        return address < map.start;
+    });
+
+    Gap gap;
+    gap.start = 0;
+    gap.last = std::numeric_limits<uintptr_t>::max();
+    if (next != snapshot.begin()) {
+        auto prev = next - 1;
+        if (prev->owns(address))
+            return;
+        gap.start = prev->end();
+    }
+    if (next != snapshot.end())
+        gap.last = next->start - 1;
+    gap.generation = gap_generation_;
+    gap.expires = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(options_.negative_cache_ttl_ms);
+
+    gaps_[next_gap_] = gap;
+    next_gap_ = (next_gap_ + 1) % kNegativeCacheSize;
+    stats_.negative_cache_fills++;
+}
+
+// Add ids to the free list, merging with neighbouring intervals. A merged
+// interval is quarantined until its most recently freed part is usable.
+void AddressDictCore::FreeIds(uint64_t id, uint64_t size,
+                              std::chrono::steady_clock::time_point usable_at)
+{
+    auto pos = std::upper_bound(free_ids_.begin(), free_ids_.end(), id,
+                                [](uint64_t id, const FreeInterval& free) -> bool {
+        return id < free.id;
+    });
+    pos = free_ids_.insert(pos, FreeInterval{id, size, usable_at});
+
+    auto next = pos + 1;
+    if (next != free_ids_.end() && pos->id + pos->size == next->id) {
+        pos->size += next->size;
+        pos->usable_at = std::max(pos->usable_at, next->usable_at);
+        free_ids_.erase(next);
+    }
+    if (pos != free_ids_.begin()) {
+        auto prev = pos - 1;
+        if (prev->id + prev->size == pos->id) {
+            prev->size += pos->size;
+            prev->usable_at = std::max(prev->usable_at, pos->usable_at);
+            free_ids_.erase(pos);
+        }
+    }
+}
+
+// Best fit: the smallest usable interval holding |size| ids. Failing that,
+// the largest holding at least |needed|.
+std::optional<size_t> AddressDictCore::FindFreeIds(size_t size, size_t needed) {
+    auto now = std::chrono::steady_clock::now();
+
+    std::optional<size_t> best, largest;
+    for (size_t i = 0; i < free_ids_.size(); i++) {
+        const auto& free = free_ids_[i];
+        if (free.usable_at > now)
+            continue;
+        if (free.size >= size && (!best || free.size < free_ids_[best.value()].size))
+            best = {i};
+        if (free.size >= needed && (!largest || free.size > free_ids_[largest.value()].size))
+            largest = {i};
+    }
+    return best ? best : largest;
+}
+
+void AddressDictCore::InsertSortedMap(const Range& range) {
+    auto pos = std::upper_bound(sorted_maps_.begin(), sorted_maps_.end(), range);
+    sorted_maps_.insert(pos, range);
+}
+
+// Sort the new ranges on their own and merge them in, which is linear in the
+// existing table rather than a full re-sort.
+void AddressDictCore::InsertSortedMaps(const Range* first, const Range* last) {
+    if (last - first == 1) {
+        InsertSortedMap(*first);
+        return;
+    }
+
+    size_t old_size = sorted_maps_.size();
+    sorted_maps_.insert(sorted_maps_.end(), first, last);
+
+    auto middle = sorted_maps_.begin() + old_size;
+    std::sort(middle, sorted_maps_.end());
+    std::inplace_merge(sorted_maps_.begin(), middle, sorted_maps_.end());
+}
+
+template <typename Id>
+size_t AddressDictCore::RecoverAddressesImpl(const Id* ids, size_t count, void** addresses,
+                                             const size_t* nbytes, bool* failed)
+{
+    static constexpr size_t kLanes = 8;
+
+    size_t failures = 0;
+    auto finish = [&](size_t i, size_t slot) -> void {
+        const auto& range = ranges_[slot];
+        uint64_t id = ids[i];
+        if (id >= range.id && id < RangeEnd(range)) {
+            uintptr_t offset = uintptr_t((id - range.id) << options_.align_shift);
+            uintptr_t address = range.map.start + offset;
+            if (!nbytes || address + nbytes[i] <= range.map.end()) {
+                addresses[i] = reinterpret_cast<void*>(address);
+                return;
+            }
+        }
+        addresses[i] = nullptr;
+        if (failed)
+            failed[i] = true;
+        failures++;
+    };
+
+    if (failed)
+        std::fill(failed, failed + count, false);
+
+    if (id_table_) {
+        // Decoding is already constant time.
+        for (size_t i = 0; i < count; i++) {
+            if (auto range = RangeFromIdEntry(id_table_->Lookup(uint32_t(ids[i])), ids[i])) {
+                finish(i, range - ranges_.data());
+            } else {
+                addresses[i] = nullptr;
+                if (failed)
+                    failed[i] = true;
+                failures++;
+            }
+        }
+        return failures;
+    }
+
+    if (by_id_.empty()) {
+        std::fill(addresses, addresses + count, nullptr);
+        if (failed)
+            std::fill(failed, failed + count, true);
+        return count;
+    }
+
+    // Branchless binary search over each lane. Every lane takes the same
+    // number of steps, so they advance together, and each step prefetches
+    // the lane's next probe.
+    size_t lanes[kLanes];
+    size_t num_lanes = 0;
+    size_t last = by_id_[0].slot;
+    auto flush = [&]() -> void {
+        size_t base[kLanes] = {};
+        size_t len = by_id_.size();
+        while (len > 1) {
+            size_t half = len / 2;
+            size_t next_half = (len - half) / 2;
+            for (size_t l = 0; l < num_lanes; l++) {
+                if (by_id_[base[l] + half].id <= ids[lanes[l]])
+                    base[l] += half;
+                ADDRZ_PREFETCH(&by_id_[base[l] + next_half]);
+            }
+            len -= half;
+        }
+        for (size_t l = 0; l < num_lanes; l++)
+            finish(lanes[l], by_id_[base[l]].slot);
+        last = by_id_[base[num_lanes - 1]].slot;
+        num_lanes = 0;
+    };
+
+    for (size_t i = 0; i < count; i++) {
+        const auto& prev = ranges_[last];
+        if (ids[i] >= prev.id && ids[i] < RangeEnd(prev)) {
+            finish(i, last);
+            continue;
+        }
+
+        lanes[num_lanes++] = i;
+        if (num_lanes == kLanes)
+            flush();
+    }
+    if (num_lanes)
+        flush();
+    return failures;
 }
 
 // If the user requests multiple pages, they may cross multiple mappings. We
 // want to combine them into one contiguous range so that pointer arithmetic
 // works as much as possible.
-bool AddressDict::GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map) {
+bool AddressDictCore::GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map) {
     if (!platform_->GetAddressMapping(reinterpret_cast<void*>(address), map))
         return false;
+    return ExtendMap(address, nbytes, map);
+}
 
+// Grow |map| with the mappings after it until |nbytes| from |address| fit.
+bool AddressDictCore::ExtendMap(uintptr_t address, size_t nbytes, Mapping* map) {
     while (true) {
         size_t offset_in_map = address - map->start;
         size_t max_read = map->size - offset_in_map;
@@ -124,32 +861,91 @@ bool AddressDict::GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* ma
         assert(next.start <= map->end());
         assert(next.end() > map->end());
 
-        map->size += next.end() - map->end();
+        map->Merge(next);
+    }
+    return true;
+}
+
+bool AddressDictCore::GetMapFromSnapshot(const std::vector<Mapping>& snapshot,
+                                         uintptr_t address, size_t nbytes, Mapping* map)
+{
+    auto it = FindAddressInSortedMap(snapshot, reinterpret_cast<void*>(address));
+    if (!it)
+        return false;
+
+    // The snapshot is coalesced, but only up to attribute changes if the
+    // platform respects them.
+    size_t index = it.value();
+    *map = snapshot[index];
+    while (map->end() - address < nbytes) {
+        if (++index == snapshot.size() || snapshot[index].start != map->end())
+            return false;
+        map->Merge(snapshot[index]);
     }
     return true;
 }
 
-std::optional<size_t> AddressDict::FindRangeForId(uint32_t id) {
+template size_t AddressDictCore::RecoverAddressesImpl(const uint16_t*, size_t, void**,
+                                                      const size_t*, bool*);
+template size_t AddressDictCore::RecoverAddressesImpl(const uint32_t*, size_t, void**,
+                                                      const size_t*, bool*);
+template size_t AddressDictCore::RecoverAddressesImpl(const uint64_t*, size_t, void**,
+                                                      const size_t*, bool*);
+
+std::optional<size_t> AddressDictCore::FindRangeForId(uint64_t id) {
+    if (id_table_) {
+        if (auto range = RangeFromIdEntry(id_table_->Lookup(uint32_t(id)), id))
+            return {range - ranges_.data()};
+        return {};
+    }
+
     size_t lower = 0;
-    size_t upper = ranges_.size();
+    size_t upper = by_id_.size();
     while (lower < upper) {
         size_t mid = (lower + upper) / 2;
-        const auto& range = ranges_[mid];
+        const auto& range = ranges_[by_id_[mid].slot];
         if (id < range.id) {
             upper = mid;
-        } else if (id >= range.range_end()) {
+        } else if (id >= RangeEnd(range)) {
             lower = mid + 1;
         } else {
-            assert(id >= range.id && id < range.range_end());
-            return {mid};
+            assert(id >= range.id && id < RangeEnd(range));
+            return {by_id_[mid].slot};
         }
     }
     return {};
 }
 
-std::optional<size_t> AddressDict::FindRangeForAddress(uintptr_t address) {
-    size_t lower = 0;
-    size_t upper = sorted_maps_.size();
+std::optional<size_t> AddressDictCore::FindRangeForAddress(uintptr_t address) {
+    return SearchSortedMaps(address, 0, sorted_maps_.size());
+}
+
+// Search forward from a previous hit with exponentially growing steps, so an
+// address near the last one is found in a few probes.
+std::optional<size_t> AddressDictCore::FindRangeForAddressFrom(uintptr_t address, size_t hint) {
+    if (hint >= sorted_maps_.size() || address < sorted_maps_[hint].map.start)
+        return FindRangeForAddress(address);
+    if (sorted_maps_[hint].map.owns(address))
+        return {hint};
+
+    size_t lower = hint + 1;
+    size_t bound = lower;
+    size_t step = 1;
+    while (bound < sorted_maps_.size() && sorted_maps_[bound].map.end() <= address) {
+        lower = bound + 1;
+        bound += step;
+        step *= 2;
+    }
+    if (auto r = SearchSortedMaps(address, lower, std::min(bound + 1, sorted_maps_.size())))
+        return r;
+
+    // Ranges can overlap, so a miss here is not definitive.
+    return FindRangeForAddress(address);
+}
+
+std::optional<size_t> AddressDictCore::SearchSortedMaps(uintptr_t address, size_t lower,
+                                                        size_t upper)
+{
     while (lower < upper) {
         size_t mid = (lower + upper) / 2;
         const auto& range = sorted_maps_[mid];
@@ -165,14 +961,43 @@ std::optional<size_t> AddressDict::FindRangeForAddress(uintptr_t address) {
     return {};
 }
 
-std::optional<size_t> AddressDict::FindRangeForAddress(uintptr_t address, size_t nbytes) {
-    auto r = FindRangeForAddress(address);
-    if (!r || nbytes <= 1)
-        return r;
+auto AddressDictCore::LookupAddress(uintptr_t address, size_t nbytes) -> const Range* {
+    const Range* range = nullptr;
+    if (address_index_ && (uint64_t(address) >> AddressIndex::kAddressBits) == 0) {
+        uint32_t entry = address_index_->Lookup(address);
+        if (entry == AddressIndex::kNone)
+            return nullptr;
+        range = RangeFromAddressEntry(entry, address);
+    }
+    if (!range) {
+        if (auto r = FindRangeForAddress(address))
+            range = &sorted_maps_[r.value()];
+    }
+    if (!range)
+        return nullptr;
+    if (auto covering = CheckRangeSpan(range, address, nbytes))
+        return covering;
+    return FindRangeCovering(address, nbytes);
+}
 
-    if (!sorted_maps_[r.value()].map.owns(address + nbytes - 1))
-        return {};
-    return {};
+// A range that is too short for a span can overlap a longer one registered
+// later for the same mapping. Look back through the ranges starting at or
+// before |address| for one that covers the span. Shorter ranges can sit
+// between the two, so only stop once no range is long enough to reach
+// |address|.
+auto AddressDictCore::FindRangeCovering(uintptr_t address, size_t nbytes) -> const Range* {
+    auto iter = std::upper_bound(sorted_maps_.begin(), sorted_maps_.end(), address,
+                                 [](uintptr_t address, const Range& range) -> bool {
+        return address < range.map.start;
+    });
+    while (iter != sorted_maps_.begin()) {
+        --iter;
+        if (address - iter->map.start >= longest_range_)
+            break;
+        if (iter->map.owns(address) && iter->map.owns(address + nbytes - 1))
+            return &*iter;
+    }
+    return nullptr;
 }
 
 } // namespace am
@@ -29,68 +29,679 @@
 
 #pragma once
 
+#include <assert.h>
 #include <stdint.h>
 
+#include <chrono>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "address_index.h"
+#include "id_table.h"
 #include "mapping.h"
 #include "platform.h"
 
+#if defined(__GNUC__)
+# define ADDRZ_ALWAYS_INLINE __attribute__((always_inline)) inline
+#elif defined(_MSC_VER)
+# define ADDRZ_ALWAYS_INLINE __forceinline
+#else
+# define ADDRZ_ALWAYS_INLINE inline
+#endif
+
 namespace am {
 
-class AddressDict final {
+class PointerCage;
+
+// What to do with a new range that needs more ids than are left.
+enum class IdOverflow : uint8_t {
+    // Keep the start of the mapping, and as much after it as there are ids
+    // for. Fails if that does not reach the address.
+    TruncateFromStart,
+    // Drop the part of the mapping before the address's page, then truncate
+    // from there. Suits narrow ids, where single mappings can be larger than
+    // the whole id space.
+    TruncateFromAddress,
+    // Never truncate: fail, and leave the ids for mappings that fit.
+    Fail,
+};
+
+struct AddressDictOptions {
+    // Keep a page-granular table from ids to ranges, so that RecoverAddress
+    // does not need to search. Memory use is proportional to the id space in
+    // use: 4KiB for every 4MiB of ids with 4KiB pages.
+    bool direct_map_decode = false;
+
+    // Keep a radix tree from address pages to ranges, so that
+    // Make32bitAddress finds an existing range, or learns that there is none,
+    // in a constant number of loads instead of a binary search.
+    bool address_index = false;
+
+    // Remember the last range used in each direction and try it first. It
+    // only costs a bounds check, so runs of pointers into the same mapping
+    // skip the search entirely. Hit rates are reported in AddressDictStats.
+    bool memoize_last_range = false;
+
+    // After a range is released, keep its ids out of circulation for this
+    // long, so that a stale id held somewhere fails to decode instead of
+    // decoding to an unrelated mapping.
+    uint32_t id_quarantine_ms = 0;
+
+    // If non-zero, a new range covers only the aligned chunks of its mapping
+    // that the address (and |nbytes|) touch, rather than the whole mapping.
+    // Id use then tracks the working set instead of the size of the virtual
+    // address space. Touching the next chunk of the most recent range grows
+    // it in place, so pointer arithmetic keeps working across the boundary.
+    // Must be a power of two, and at least the page size.
+    size_t reserve_chunk_size = 0;
+
+    // If non-zero, remember the unmapped gap around an address that failed
+    // to resolve, for this long, so that repeated bad pointers fail without
+    // querying the platform. A handful of gaps are kept. Call
+    // AddressDict::InvalidateNegativeCache when memory is mapped, to see it
+    // before the entries expire.
+    uint32_t negative_cache_ttl_ms = 0;
+
+    // Only register memory whose mapping has all of the |required_prot| bits
+    // and none of the |forbidden_prot| bits (see kProtRead and friends). For
+    // example, requiring kProtRead keeps guard pages and PROT_NONE
+    // reservations from ever getting ids, so no id can decode into them.
+    // Mappings with unknown permissions are allowed.
+    //
+    // The platform should coalesce with Coalesce::SameAttributes. Otherwise
+    // mappings merged with their neighbours only keep the permissions they
+    // all share, and may be rejected.
+    uint8_t required_prot = 0;
+    uint8_t forbidden_prot = 0;
+
+    // If non-zero, ids count units of 1 << align_shift bytes rather than
+    // bytes, which multiplies the memory an id space reaches. For example,
+    // 32-bit ids reach 32GiB with an align_shift of 3, for 8-byte aligned
+    // pointers. Pointers without that alignment cannot be compressed. Adding
+    // n to an id moves n units, not n bytes. At most the page shift.
+    uint8_t align_shift = 0;
+
+    // See IdOverflow. With 16-bit ids, consider reserve_chunk_size too, so
+    // that one large mapping cannot take the whole id space.
+    IdOverflow id_overflow = IdOverflow::TruncateFromStart;
+};
+
+// A 48-bit id, stored in six bytes with no alignment requirement. Dictionaries
+// with PackedId48 ids take and return them as uint64_t; use this type, or
+// PackIds48 and UnpackIds48 on arrays, to store them compactly.
+struct PackedId48 {
+    uint8_t bytes[6];
+
+    static PackedId48 FromValue(uint64_t value) {
+        assert(!(value >> 48));
+        PackedId48 packed;
+        for (size_t i = 0; i < 6; i++)
+            packed.bytes[i] = uint8_t(value >> (i * 8));
+        return packed;
+    }
+
+    uint64_t value() const {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 6; i++)
+            value |= uint64_t(bytes[i]) << (i * 8);
+        return value;
+    }
+};
+static_assert(sizeof(PackedId48) == 6);
+
+static inline void PackIds48(const uint64_t* ids, size_t count, PackedId48* out) {
+    for (size_t i = 0; i < count; i++)
+        out[i] = PackedId48::FromValue(ids[i]);
+}
+
+static inline void UnpackIds48(const PackedId48* packed, size_t count, uint64_t* ids) {
+    for (size_t i = 0; i < count; i++)
+        ids[i] = packed[i].value();
+}
+
+// The id types a BasicAddressDict can hand out: |Value| is the integer type
+// ids are passed around as, and |kBits| their width. The all-ones value of
+// each width is never used. Load and Store convert between the id type as
+// stored and its Value.
+template <typename IdType>
+struct IdTraits;
+
+template <>
+struct IdTraits<uint16_t> {
+    using Value = uint16_t;
+    static constexpr uint32_t kBits = 16;
+    static Value Load(uint16_t id) { return id; }
+    static uint16_t Store(Value id) { return id; }
+};
+
+template <>
+struct IdTraits<uint32_t> {
+    using Value = uint32_t;
+    static constexpr uint32_t kBits = 32;
+    static Value Load(uint32_t id) { return id; }
+    static uint32_t Store(Value id) { return id; }
+};
+
+template <>
+struct IdTraits<PackedId48> {
+    using Value = uint64_t;
+    static constexpr uint32_t kBits = 48;
+    static Value Load(PackedId48 id) { return id.value(); }
+    static PackedId48 Store(Value id) { return PackedId48::FromValue(id); }
+};
+
+struct AddressDictStats {
+    uint64_t compress_memo_hits = 0;
+    uint64_t compress_memo_misses = 0;
+    uint64_t recover_memo_hits = 0;
+    uint64_t recover_memo_misses = 0;
+    // Addresses rejected by the negative cache, and gaps added to it.
+    uint64_t negative_cache_hits = 0;
+    uint64_t negative_cache_fills = 0;
+};
+
+struct PrewarmStats {
+    // Number of ranges registered.
+    size_t ranges = 0;
+    // Number of ids they took.
+    uint64_t ids_used = 0;
+};
+
+// The out-of-line part of an address dictionary: registration, batches,
+// searches and bookkeeping. Use it through BasicAddressDict, which adds the
+// single-pointer entry points and keeps their fast paths inline.
+class AddressDictCore {
   public:
-    AddressDict(IPlatform* platform = nullptr);
+    const AddressDictStats& stats() const { return stats_; }
 
-    // Compress a pointer into a 32-bit value. Optionally, specify the number
-    // of bytes to ensure are valid in the id. This is important to make sure
-    // additional pages are included if needed, as not all platforms can return
-    // a coalesced mapping.
-    std::optional<uint32_t> Make32bitAddress(void* address, size_t nbytes = 0);
+    // Number of id ranges that have been registered.
+    size_t num_ranges() const { return by_id_.size(); }
+
+    // Forget every range containing |address|, for example after it is
+    // unmapped. Their ids stop decoding and, after the quarantine period in
+    // AddressDictOptions, are reused for new ranges. Returns the number of
+    // ranges released.
+    size_t ReleaseRange(void* address);
+    size_t ReleaseRange(uintptr_t address) {
+        return ReleaseRange(reinterpret_cast<void*>(address));
+    }
 
-    // Recover a pointer from a 32-bit value. Optionally, validate that it is
-    // possible to read |nbytes|. This is highly recommended to make sure ids
-    // are not overflowed past their mapped range.
-    std::optional<void*> RecoverAddress(uint32_t id, size_t nbytes = 0);
+    // Release every range overlapping [start, start + size), for example from
+    // an MmapTracker unmap callback.
+    size_t ReleaseRanges(uintptr_t start, size_t size);
 
-    std::optional<uint32_t> Make32bitAddress(uintptr_t address, size_t nbytes = 0) {
-        return Make32bitAddress(reinterpret_cast<void*>(address), nbytes);
+    // Release every range that is no longer fully mapped. Returns the number
+    // of ranges released. This also drops the negative cache.
+    size_t ReconcileMappings();
+
+    // Forget all unmapped gaps remembered by the negative cache.
+    void InvalidateNegativeCache();
+
+    // Give all of |cage| one window of consecutive ids, so that its pointers
+    // compress and recover with a subtract and an add, checked before any
+    // other lookup. The cage must be reserved, and nothing in it may have an
+    // id yet. It must stay reserved until it is released from the dictionary,
+    // for example with ReleaseRange(cage.base()). Only one cage can be
+    // attached at a time.
+    //
+    // Returns the id of the cage's base. Returns nullopt if a cage is
+    // already attached, if a range already overlaps the cage (for example
+    // one coalesced from a neighbouring mapping by Prewarm), or if there are
+    // not enough ids left. A full 4GiB cage needs an align_shift, or ids
+    // wider than 32 bits.
+    std::optional<uint64_t> AttachCage(const PointerCage& cage);
+
+    // Register every current mapping overlapping [start, end), clipped to it,
+    // so that later compression never takes the platform slow path. Mappings
+    // come from one platform snapshot and are added with a single sort.
+    // Memory that already has a range is skipped. Mappings are registered
+    // whole, even with reserve_chunk_size. This also drops the negative cache.
+    //
+    // Returns nullopt if the platform cannot enumerate its mappings.
+    std::optional<PrewarmStats> Prewarm(
+        uintptr_t start = 0, uintptr_t end = std::numeric_limits<uintptr_t>::max())
+    {
+        return Prewarm(start, end, nullptr, nullptr);
     }
-    std::optional<uintptr_t> RecoverAddressValue(uint32_t id, size_t nbytes = 0) {
-        if (auto val = RecoverAddress(id, nbytes); val)
-            return {reinterpret_cast<uintptr_t>(val.value())};
-        return {};
+
+    // As above, only registering mappings for which |filter(map)| is true.
+    template <typename Func>
+    std::optional<PrewarmStats> PrewarmIf(
+        Func&& filter, uintptr_t start = 0,
+        uintptr_t end = std::numeric_limits<uintptr_t>::max())
+    {
+        using FuncType = std::remove_reference_t<Func>;
+        return Prewarm(start, end, &FilterThunk<FuncType>, &filter);
     }
 
-  private:
-    bool GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map);
+  protected:
+    // If |page_shift| is not zero, it must match the platform's page size.
+    // Ids are |id_bits| wide.
+    AddressDictCore(IPlatform* platform, const AddressDictOptions& options,
+                    uint32_t page_shift, uint32_t id_bits);
+
+    static constexpr uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
 
     struct Range {
         Mapping map;
-        uint32_t id;
-
-        uint32_t range_end() const {
-            return id + map.size;
-        }
+        uint64_t id;
+        // In ranges_, the slot of the range with the next higher id, or
+        // kNoSlot. Meaningless in copies.
+        uint32_t next = kNoSlot;
 
         bool operator <(const Range& other) const {
             return map < other.map;
         }
     };
 
-    // Return an index into sorted_maps_.
-    std::optional<size_t> FindRangeForAddress(uintptr_t address);
-    std::optional<size_t> FindRangeForAddress(uintptr_t address, size_t nbytes);
+    // A copy of a recently used range. It is only trusted if nothing has
+    // changed in the dictionary since, as tracked by generation_.
+    struct Memo {
+        Range range;
+        uint64_t generation = 0;
+    };
+
+    // Compress an address that the memo and address index did not resolve.
+    std::optional<uint64_t> MakeIdSlow(uintptr_t address, size_t nbytes);
+
+    // Instantiated for the Value type of each IdTraits.
+    template <typename Id>
+    size_t MakeIdsImpl(void* const* addresses, size_t count, Id* ids, const size_t* nbytes,
+                       bool* failed);
+    template <typename Id>
+    size_t RecoverAddressesImpl(const Id* ids, size_t count, void** addresses,
+                                const size_t* nbytes, bool* failed);
+
+    uintptr_t AlignMask() const {
+        return (uintptr_t(1) << options_.align_shift) - 1;
+    }
 
-    // Return an index into ranges_.
-    std::optional<size_t> FindRangeForId(uint32_t id);
+    // Number of ids spanning |bytes|.
+    uint64_t IdsFor(uint64_t bytes) const {
+        return (bytes + AlignMask()) >> options_.align_shift;
+    }
+
+    uint64_t RangeEnd(const Range& range) const {
+        return range.id + IdsFor(range.map.size);
+    }
+
+    // |value| must be aligned.
+    std::optional<uint64_t> IdForAddress(const Range& range, uintptr_t value) const {
+        assert(range.map.owns(value));
+        assert(!(value & AlignMask()));
+
+        uint64_t offset = (value - range.map.start) >> options_.align_shift;
+        if (offset > id_limit_ - range.id)
+            return {};
+        return {range.id + offset};
+    }
+
+    std::optional<void*> AddressForId(const Range& range, uint64_t id, size_t nbytes) const {
+        uintptr_t offset = uintptr_t((id - range.id) << options_.align_shift);
+        uintptr_t address = range.map.start + offset;
+        if (address + nbytes > range.map.end())
+            return {};
+        return {reinterpret_cast<void*>(address)};
+    }
+
+    static const Range* CheckRangeSpan(const Range* range, uintptr_t address, size_t nbytes) {
+        if (!range || nbytes <= 1)
+            return range;
+
+        if (!range->map.owns(address + nbytes - 1))
+            return nullptr;
+        return range;
+    }
+
+    // Resolve an IdPageTable entry for |id| to the range holding it. The page
+    // may start in an earlier range, so step forward. There are only several
+    // ranges to a page when mappings are smaller than a page.
+    const Range* RangeFromIdEntry(uint32_t entry, uint64_t id) const {
+        if (entry == IdPageTable::kNone)
+            return nullptr;
+        for (uint32_t slot = entry - 1; slot != kNoSlot; ) {
+            const auto& range = ranges_[slot];
+            if (id < range.id)
+                break;
+            if (id < RangeEnd(range))
+                return &range;
+            slot = range.next;
+        }
+        return nullptr;
+    }
+
+    // Resolve an AddressIndex entry for |address|. Ranges smaller than a
+    // page can share one, in which case the index only knows one of them.
+    const Range* RangeFromAddressEntry(uint32_t entry, uintptr_t address) const {
+        if (entry == AddressIndex::kNone)
+            return nullptr;
+        const Range* range = &ranges_[entry - 1];
+        if (!range->map.owns(address))
+            return nullptr;
+        return range;
+    }
+
+    // Return a slot in ranges_.
+    std::optional<size_t> FindRangeForId(uint64_t id);
 
   private:
+    using MappingFilter = bool (*)(void* data, const Mapping& map);
+
+    template <typename Func>
+    static bool FilterThunk(void* data, const Mapping& map) {
+        return (*static_cast<Func*>(data))(map);
+    }
+
+    std::optional<PrewarmStats> Prewarm(uintptr_t start, uintptr_t end, MappingFilter filter,
+                                        void* data);
+
+    bool GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map);
+    bool GetMapFromSnapshot(const std::vector<Mapping>& snapshot, uintptr_t address,
+                            size_t nbytes, Mapping* map);
+    bool ExtendMap(uintptr_t address, size_t nbytes, Mapping* map);
+    void ClipToChunks(uintptr_t address, size_t nbytes, Mapping* map);
+    bool IsAllowed(const Mapping& map) const;
+
+    // Assign ids to a new range for |address|, truncating it if the id space
+    // is nearly exhausted.
+    bool ReserveIds(uintptr_t address, Range* range);
+    void TruncateToIds(Range* range, uint64_t ids);
+    void InsertRange(const Range& range);
+    void ReindexAddresses(uint64_t start, uint64_t end);
+
+    template <typename Pred>
+    size_t ReleaseRangesIf(Pred pred);
+
+    // A run of released ids, unusable until |usable_at|.
+    struct FreeInterval {
+        uint64_t id;
+        uint64_t size;
+        std::chrono::steady_clock::time_point usable_at;
+    };
+    void FreeIds(uint64_t id, uint64_t size, std::chrono::steady_clock::time_point usable_at);
+    std::optional<size_t> FindFreeIds(size_t size, size_t needed);
+
+    // An unmapped region, from |start| to |last| inclusive.
+    struct Gap {
+        uintptr_t start;
+        uintptr_t last;
+        uint64_t generation;
+        std::chrono::steady_clock::time_point expires;
+    };
+    static constexpr size_t kNegativeCacheSize = 16;
+
+    bool InNegativeCache(uintptr_t address);
+    void RememberGap(const std::vector<Mapping>& snapshot, uintptr_t address);
+    // |pending| is a range not yet in sorted_maps_, to grow instead if it is
+    // the last one.
+    const Range* GrowLastRange(const Mapping& map, Range* pending = nullptr);
+
+    // Add ranges to sorted_maps_, keeping it sorted.
+    void InsertSortedMap(const Range& range);
+    void InsertSortedMaps(const Range* first, const Range* last);
+
+    // Find the range holding |address| and |nbytes| after it, if any.
+    const Range* LookupAddress(uintptr_t address, size_t nbytes);
+    const Range* FindRangeCovering(uintptr_t address, size_t nbytes);
+
+    // Return an index into sorted_maps_.
+    std::optional<size_t> FindRangeForAddress(uintptr_t address);
+    std::optional<size_t> FindRangeForAddressFrom(uintptr_t address, size_t hint);
+    std::optional<size_t> SearchSortedMaps(uintptr_t address, size_t lower, size_t upper);
+
+  protected:
     IPlatform* platform_ = nullptr;
-    uint32_t next_id_ = 0;
+    AddressDictOptions options_;
+    // One past the highest id.
+    uint64_t id_limit_;
+    std::unique_ptr<IdPageTable> id_table_;
+    std::unique_ptr<AddressIndex> address_index_;
+
+    // Ranges stay in the same slot for as long as they exist, so that the
+    // lookup tables can hold slots. Freed slots are reused.
     std::vector<Range> ranges_;
+    std::vector<uint32_t> free_slots_;
+
+    // Every range's id and slot, sorted by id, for searching.
+    struct IdSlot {
+        uint64_t id;
+        uint32_t slot;
+    };
+    std::vector<IdSlot> by_id_;
+
+    // The attached cage, if any, and its id window.
+    uintptr_t cage_start_ = 0;
+    uint64_t cage_size_ = 0;
+    uint64_t cage_id_ = 0;
+    uint64_t cage_ids_ = 0;
+
+    uint64_t generation_ = 1;
+    Memo compress_memo_;
+    Memo recover_memo_;
+    AddressDictStats stats_;
+
+  private:
+    size_t page_size_ = 0;
+    uint64_t next_id_ = 0;
     std::vector<Range> sorted_maps_;
+    // The largest range ever inserted, which bounds how far before an
+    // address a range holding it can start.
+    size_t longest_range_ = 0;
+    // Sorted by id, with no two intervals adjacent.
+    std::vector<FreeInterval> free_ids_;
+
+    // Entries from an older gap generation are stale. Filled round-robin.
+    Gap gaps_[kNegativeCacheSize] = {};
+    size_t next_gap_ = 0;
+    uint64_t gap_generation_ = 1;
+};
+
+// Maps pointers to ids and back. Pointers into memory the dictionary has seen
+// before are compressed and recovered inline: an attached cage, a memo hit,
+// or an AddressIndex or IdPageTable hit, is a few loads and compares with no
+// call. Anything else goes to the out-of-line AddressDictCore.
+//
+// |Platform| is the IPlatform implementation to query. The slow path calls
+// it through IPlatform either way; naming a final class only types the
+// constructor argument and platform(). Only an IPlatform dictionary can be
+// built without a platform, falling back to IPlatform::GetDefault().
+// |IdType| picks the id width, see IdTraits: uint16_t, uint32_t, or
+// PackedId48. direct_map_decode needs ids of at most 32 bits. |PageShift|, if
+// not zero, is the platform's page size fixed at compile time, which folds
+// the index shifts and masks into constants.
+template <typename Platform = IPlatform, typename IdType = uint32_t, uint32_t PageShift = 0>
+class BasicAddressDict : public AddressDictCore {
+    static_assert(std::is_base_of_v<IPlatform, Platform>, "Platform must implement IPlatform");
+
+  public:
+    using Id = typename IdTraits<IdType>::Value;
+    using IdStorage = IdType;
+    static constexpr uint32_t kIdBits = IdTraits<IdType>::kBits;
+
+    BasicAddressDict(Platform* platform = DefaultPlatform(),
+                     const AddressDictOptions& options = {})
+      : AddressDictCore(platform, options, PageShift, kIdBits)
+    {
+        assert((platform || std::is_same_v<Platform, IPlatform>));
+    }
+
+    // Compress a pointer into an id. Optionally, specify the number of bytes
+    // to ensure are valid in the id. This is important to make sure
+    // additional pages are included if needed, as not all platforms can return
+    // a coalesced mapping.
+    ADDRZ_ALWAYS_INLINE std::optional<Id> MakeId(void* address, size_t nbytes = 0) {
+        if (address == nullptr)
+            return {0};
+
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        if (value & AlignMask())
+            return {};
+        if (value - cage_start_ < cage_size_) {
+            uint64_t offset = value - cage_start_;
+            if (nbytes > cage_size_ - offset)
+                return {};
+            return {Id(cage_id_ + (offset >> options_.align_shift))};
+        }
+        if (options_.memoize_last_range) {
+            const Range& last = compress_memo_.range;
+            if (compress_memo_.generation == generation_ && last.map.owns(value) &&
+                CheckRangeSpan(&last, value, nbytes))
+            {
+                stats_.compress_memo_hits++;
+                return Narrow(IdForAddress(last, value));
+            }
+            stats_.compress_memo_misses++;
+        }
+        return MakeIdFromIndex(value, nbytes);
+    }
+
+    // Recover a pointer from an id. Optionally, validate that it is possible
+    // to read |nbytes|. This is highly recommended to make sure ids are not
+    // overflowed past their mapped range.
+    ADDRZ_ALWAYS_INLINE std::optional<void*> RecoverAddress(Id id, size_t nbytes = 0) {
+        if (uint64_t(id) - cage_id_ < cage_ids_) {
+            uint64_t offset = (uint64_t(id) - cage_id_) << options_.align_shift;
+            if (nbytes > cage_size_ - offset)
+                return {};
+            return {reinterpret_cast<void*>(cage_start_ + uintptr_t(offset))};
+        }
+        if (options_.memoize_last_range) {
+            const Range& last = recover_memo_.range;
+            if (recover_memo_.generation == generation_ && id >= last.id &&
+                id < RangeEnd(last))
+            {
+                stats_.recover_memo_hits++;
+                return AddressForId(last, id, nbytes);
+            }
+            stats_.recover_memo_misses++;
+        }
+        return RecoverAddressFromTable(id, nbytes);
+    }
+
+    std::optional<Id> MakeId(uintptr_t address, size_t nbytes = 0) {
+        return MakeId(reinterpret_cast<void*>(address), nbytes);
+    }
+    std::optional<uintptr_t> RecoverAddressValue(Id id, size_t nbytes = 0) {
+        if (auto val = RecoverAddress(id, nbytes); val)
+            return {reinterpret_cast<uintptr_t>(val.value())};
+        return {};
+    }
+
+    // The 32-bit names, for dictionaries with 32-bit ids.
+    std::optional<uint32_t> Make32bitAddress(void* address, size_t nbytes = 0) {
+        static_assert(kIdBits == 32, "use MakeId");
+        return MakeId(address, nbytes);
+    }
+    std::optional<uint32_t> Make32bitAddress(uintptr_t address, size_t nbytes = 0) {
+        static_assert(kIdBits == 32, "use MakeId");
+        return MakeId(address, nbytes);
+    }
+
+    // Compress |count| pointers into |ids|. If |nbytes| is given, it has one
+    // entry per address, with the same meaning as in MakeId.
+    //
+    // Sorted or clustered inputs are cheap: each lookup starts from the range
+    // the previous address hit. Addresses without a range are resolved from a
+    // single platform snapshot and registered together.
+    //
+    // Addresses that cannot be compressed are written as 0 and, if |failed|
+    // is given, flagged there. Returns the number of failures.
+    size_t MakeIds(void* const* addresses, size_t count, Id* ids,
+                   const size_t* nbytes = nullptr, bool* failed = nullptr)
+    {
+        return MakeIdsImpl(addresses, count, ids, nbytes, failed);
+    }
+    size_t Make32bitAddresses(void* const* addresses, size_t count, uint32_t* ids,
+                              const size_t* nbytes = nullptr, bool* failed = nullptr)
+    {
+        static_assert(kIdBits == 32, "use MakeIds");
+        return MakeIds(addresses, count, ids, nbytes, failed);
+    }
+
+    // Recover |count| pointers from |ids|. If |nbytes| is given, it has one
+    // entry per id, with the same meaning as in RecoverAddress.
+    //
+    // Ids that fall in the same range as the previous one skip the search.
+    // The rest are searched several at a time in lockstep, prefetching each
+    // lane's next probe, so cache misses overlap instead of serializing.
+    //
+    // Ids that cannot be recovered are written as nullptr and, if |failed| is
+    // given, flagged there. Returns the number of failures.
+    size_t RecoverAddresses(const Id* ids, size_t count, void** addresses,
+                            const size_t* nbytes = nullptr, bool* failed = nullptr)
+    {
+        return RecoverAddressesImpl(ids, count, addresses, nbytes, failed);
+    }
+
+    Platform* platform() const { return static_cast<Platform*>(platform_); }
+
+  private:
+    // Only instantiated when the constructor's default argument is used.
+    static Platform* DefaultPlatform() {
+        static_assert(std::is_same_v<Platform, IPlatform>,
+                      "only BasicAddressDict<IPlatform> has a default platform");
+        return nullptr;
+    }
+
+    // The rest of MakeId and RecoverAddress, kept apart so that the checks
+    // above stay small enough to inline everywhere.
+    std::optional<Id> MakeIdFromIndex(uintptr_t value, size_t nbytes) {
+        if (address_index_) {
+            const Range* range = RangeFromAddressEntry(LookupIndex(value), value);
+            if (CheckRangeSpan(range, value, nbytes)) {
+                if (options_.memoize_last_range)
+                    compress_memo_ = Memo{*range, generation_};
+                return Narrow(IdForAddress(*range, value));
+            }
+        }
+        return Narrow(MakeIdSlow(value, nbytes));
+    }
+
+    std::optional<void*> RecoverAddressFromTable(Id id, size_t nbytes) {
+        const Range* found;
+        if (id_table_) {
+            found = RangeFromIdEntry(LookupIdTable(id), id);
+        } else {
+            auto r = FindRangeForId(id);
+            found = r ? &ranges_[r.value()] : nullptr;
+        }
+        if (!found)
+            return {};
+        if (options_.memoize_last_range)
+            recover_memo_ = Memo{*found, generation_};
+        return AddressForId(*found, id, nbytes);
+    }
+
+    // Ids are below id_limit_, so they fit.
+    static std::optional<Id> Narrow(std::optional<uint64_t> id) {
+        if (!id)
+            return {};
+        return {Id(id.value())};
+    }
+
+    uint32_t LookupIndex(uintptr_t address) const {
+        if constexpr (PageShift != 0)
+            return address_index_->template Lookup<PageShift>(address);
+        else
+            return address_index_->Lookup(address);
+    }
+    uint32_t LookupIdTable(Id id) const {
+        if constexpr (PageShift != 0)
+            return id_table_->template Lookup<PageShift>(uint32_t(id));
+        else
+            return id_table_->Lookup(uint32_t(id));
+    }
+};
+
+// The instantiation for any IPlatform, with 32-bit ids and the page size read
+// at runtime.
+class AddressDict final : public BasicAddressDict<> {
+  public:
+    using BasicAddressDict::BasicAddressDict;
 };
 
 } // namespace am
@@ -29,10 +29,17 @@
 
 #include "addrz.h"
 
+#include <algorithm>
+#include <chrono>
 #include <limits>
+#include <memory>
+#include <random>
+#include <thread>
 
 #include <gtest/gtest.h>
 
+#include "pointer_cage.h"
+
 using namespace am;
 
 class TestPlatform final : public IPlatform {
@@ -46,6 +53,7 @@ class TestPlatform final : public IPlatform {
     int GetPageSize() override { return 4096; }
 
     bool GetAddressMapping(void* address, Mapping* map) override {
+        lookups_++;
         auto it = FindAddressInMap(maps_, address);
         if (!it)
             return false;
@@ -53,16 +61,39 @@ class TestPlatform final : public IPlatform {
         return true;
     }
 
+    bool GetAllMappings(std::vector<Mapping>* maps) override {
+        if (!enumerable_)
+            return false;
+        *maps = maps_;
+        SortAndCoalesceMaps(*maps, Coalesce::SameAttributes);
+        return true;
+    }
+
     void ClearMappings() {
         maps_.clear();
     }
 
-    void AddMapping(uintptr_t start, size_t size) {
-        maps_.emplace_back(Mapping{start, size});
+    void SetEnumerable(bool enumerable) {
+        enumerable_ = enumerable;
+    }
+
+    size_t lookups() const { return lookups_; }
+
+    void AddMapping(uintptr_t start, size_t size, uint8_t prot = kProtUnknown) {
+        maps_.emplace_back(Mapping{start, size, 0, prot});
+    }
+
+    void RemoveMapping(uintptr_t start) {
+        maps_.erase(std::remove_if(maps_.begin(), maps_.end(),
+                                   [start](const Mapping& map) -> bool {
+            return map.start == start;
+        }), maps_.end());
     }
 
   private:
     std::vector<Mapping> maps_;
+    bool enumerable_ = false;
+    size_t lookups_ = 0;
 };
 
 class AddressDictTest : public ::testing::Test {
@@ -149,6 +180,1030 @@ TEST_F(AddressDictTest, ExpandedRange) {
     EXPECT_EQ(ad_.RecoverAddressValue(id2.value() + 8192 - 1), 4096 + 8192 - 1);
 }
 
+TEST_F(AddressDictTest, SpanReusesRange) {
+    platform_.ClearMappings();
+    platform_.AddMapping(4096, 8192);
+    platform_.AddMapping(65536, 4096);
+    platform_.AddMapping(65536 + 4096, 4096);
+    platform_.AddMapping(65536 + 8192, 4096);
+
+    auto id = ad_.Make32bitAddress(4096, 64);
+    ASSERT_NE(id, std::nullopt);
+    for (size_t i = 0; i < 100; i++) {
+        EXPECT_EQ(ad_.Make32bitAddress(4096, 64), id);
+        EXPECT_EQ(ad_.Make32bitAddress(4096 + 128, 64), id.value() + 128);
+    }
+    EXPECT_EQ(ad_.num_ranges(), 1);
+
+    // Spans that run past the most recent range grow it in place.
+    auto id2 = ad_.Make32bitAddress(65536 + 4000, 64);
+    ASSERT_NE(id2, std::nullopt);
+    EXPECT_EQ(ad_.num_ranges(), 2);
+    for (size_t i = 0; i < 100; i++) {
+        EXPECT_EQ(ad_.Make32bitAddress(65536 + 4000, 64), id2);
+        EXPECT_EQ(ad_.Make32bitAddress(65536 + 4000 + i * 64, 128), id2.value() + i * 64);
+    }
+    EXPECT_EQ(ad_.num_ranges(), 2);
+    EXPECT_EQ(ad_.RecoverAddressValue(id2.value() + 6400, 128), 65536 + 4000 + 6400);
+
+    // The first range can no longer grow; ids after it are taken.
+    EXPECT_EQ(ad_.Make32bitAddress(4096 + 8000, 8192), std::nullopt);
+    EXPECT_EQ(ad_.num_ranges(), 2);
+
+    // So a span crossing into the next mapping needs an overlapping range,
+    // but only one.
+    platform_.AddMapping(4096 + 8192, 4096);
+    auto id3 = ad_.Make32bitAddress(4096 + 8000, 1024);
+    ASSERT_NE(id3, std::nullopt);
+    EXPECT_EQ(ad_.num_ranges(), 3);
+    for (size_t i = 0; i < 100; i++) {
+        EXPECT_EQ(ad_.Make32bitAddress(4096 + 8000, 1024), id3);
+        // Either range may answer, but both decode to the same address.
+        auto again = ad_.Make32bitAddress(4096, 64);
+        ASSERT_NE(again, std::nullopt);
+        EXPECT_EQ(ad_.RecoverAddressValue(again.value(), 64), 4096);
+    }
+    EXPECT_EQ(ad_.num_ranges(), 3);
+}
+
+TEST_F(AddressDictTest, ReleaseRange) {
+    platform_.ClearMappings();
+    platform_.AddMapping(65536, 8192);
+    platform_.AddMapping(131072, 4096);
+
+    auto id = ad_.Make32bitAddress(65536 + 100);
+    ASSERT_NE(id, std::nullopt);
+    auto id2 = ad_.Make32bitAddress(131072);
+    ASSERT_NE(id2, std::nullopt);
+
+    EXPECT_EQ(ad_.ReleaseRange(1), 0);
+    EXPECT_EQ(ad_.ReleaseRange(65536 + 4096), 1);
+    EXPECT_EQ(ad_.num_ranges(), 1);
+    EXPECT_EQ(ad_.RecoverAddress(id.value()), std::nullopt);
+    EXPECT_EQ(ad_.RecoverAddressValue(id2.value()), 131072);
+
+    // A mapping of the same size or smaller reuses the released ids.
+    platform_.RemoveMapping(65536);
+    platform_.AddMapping(262144, 4096);
+    auto id3 = ad_.Make32bitAddress(262144);
+    ASSERT_NE(id3, std::nullopt);
+    EXPECT_EQ(id3.value(), id.value() - 100);
+    EXPECT_EQ(ad_.RecoverAddressValue(id3.value()), 262144);
+    EXPECT_EQ(ad_.Make32bitAddress(131072), id2);
+
+    // The rest of the interval is still free.
+    platform_.AddMapping(327680, 4096);
+    auto id4 = ad_.Make32bitAddress(327680);
+    ASSERT_NE(id4, std::nullopt);
+    EXPECT_EQ(id4.value(), id3.value() + 4096);
+    EXPECT_EQ(ad_.RecoverAddressValue(id2.value()), 131072);
+    EXPECT_EQ(ad_.RecoverAddressValue(id3.value()), 262144);
+}
+
+TEST_F(AddressDictTest, ReconcileMappings) {
+    platform_.ClearMappings();
+    for (size_t i = 0; i < 8; i++)
+        platform_.AddMapping(65536 * (i + 1), 4096);
+
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < 8; i++) {
+        auto id = ad_.Make32bitAddress(65536 * (i + 1));
+        ASSERT_NE(id, std::nullopt);
+        ids.emplace_back(id.value());
+    }
+
+    EXPECT_EQ(ad_.ReconcileMappings(), 0);
+    for (size_t i = 0; i < 8; i += 2)
+        platform_.RemoveMapping(65536 * (i + 1));
+    EXPECT_EQ(ad_.ReconcileMappings(), 4);
+    EXPECT_EQ(ad_.num_ranges(), 4);
+
+    for (size_t i = 0; i < 8; i++) {
+        if (i % 2)
+            EXPECT_EQ(ad_.RecoverAddressValue(ids[i]), 65536 * (i + 1));
+        else
+            EXPECT_EQ(ad_.RecoverAddress(ids[i]), std::nullopt);
+    }
+}
+
+TEST(AddressDictChunks, ReserveOnTouch) {
+    static constexpr size_t kChunk = 65536;
+
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(1 << 20, 256 * 1024 * 1024);
+
+    AddressDictOptions options;
+    options.reserve_chunk_size = kChunk;
+    AddressDict ad(&platform, options);
+
+    // Only the touched chunk is reserved.
+    uintptr_t base = (1 << 20) + 64 * kChunk;
+    auto id = ad.Make32bitAddress(base + 100);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(id.value()), base + 100);
+    EXPECT_EQ(ad.RecoverAddress(id.value() - 101), std::nullopt);
+    EXPECT_EQ(ad.RecoverAddress(id.value() - 100 + kChunk), std::nullopt);
+
+    // The next chunk over extends the range, so arithmetic still works.
+    auto id2 = ad.Make32bitAddress(base + kChunk + 100);
+    ASSERT_NE(id2, std::nullopt);
+    EXPECT_EQ(id2.value(), id.value() + kChunk);
+    EXPECT_EQ(ad.num_ranges(), 1);
+
+    // A span across a chunk boundary reserves both chunks.
+    auto id3 = ad.Make32bitAddress(base + 10 * kChunk - 8, 16);
+    ASSERT_NE(id3, std::nullopt);
+    EXPECT_EQ(ad.num_ranges(), 2);
+    EXPECT_EQ(ad.RecoverAddressValue(id3.value(), 16), base + 10 * kChunk - 8);
+    EXPECT_EQ(ad.RecoverAddressValue(id3.value() + kChunk + 8 - 1),
+              base + 10 * kChunk + kChunk - 1);
+
+    // Scattered touches cost a chunk each, not the whole mapping.
+    for (size_t i = 0; i < 100; i++) {
+        uintptr_t address = (1 << 20) + ((i * 37) % 4096) * kChunk;
+        auto id = ad.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(ad.RecoverAddressValue(id.value()), address);
+    }
+    auto last = ad.Make32bitAddress(base + 2 * kChunk);
+    ASSERT_NE(last, std::nullopt);
+    EXPECT_LT(last.value(), 200 * kChunk);
+}
+
+TEST(AddressDictChunks, HugeMapping) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(65536, std::numeric_limits<size_t>::max() - kOffsetSlack);
+
+    AddressDictOptions options;
+    options.reserve_chunk_size = 2 * 1024 * 1024;
+    AddressDict ad(&platform, options);
+
+    // Without chunks, the first address would take the whole id space.
+    for (size_t i = 0; i < 64; i++) {
+        uintptr_t address = 65536 + i * 64 * 1024 * 1024;
+        auto id = ad.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt) << i;
+        EXPECT_EQ(ad.RecoverAddressValue(id.value()), address);
+    }
+}
+
+TEST(AddressDictPrewarm, RegistersEverything) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 16; i++)
+        platform.AddMapping(65536 * (i + 1), 4096 * (1 + i % 3));
+
+    AddressDict ad(&platform);
+    EXPECT_EQ(ad.Prewarm(), std::nullopt);
+
+    platform.SetEnumerable(true);
+    auto id = ad.Make32bitAddress(65536 * 3);
+    ASSERT_NE(id, std::nullopt);
+
+    auto stats = ad.Prewarm();
+    ASSERT_NE(stats, std::nullopt);
+    EXPECT_EQ(stats->ranges, 15);
+    EXPECT_EQ(ad.num_ranges(), 16);
+
+    uint64_t expected_ids = 0;
+    for (size_t i = 0; i < 16; i++) {
+        if (i != 2)
+            expected_ids += 4096 * (1 + i % 3);
+    }
+    EXPECT_EQ(stats->ids_used, expected_ids);
+
+    // Everything is registered, so the platform is no longer consulted.
+    platform.SetEnumerable(false);
+    for (size_t i = 0; i < 16; i++)
+        platform.RemoveMapping(65536 * (i + 1));
+    for (size_t i = 0; i < 16; i++) {
+        uintptr_t address = 65536 * (i + 1) + 12;
+        auto id = ad.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(ad.RecoverAddressValue(id.value()), address);
+    }
+    EXPECT_EQ(ad.Make32bitAddress(65536 * 3), id);
+    EXPECT_EQ(ad.num_ranges(), 16);
+}
+
+TEST(AddressDictPrewarm, Filtered) {
+    TestPlatform platform;
+    platform.SetEnumerable(true);
+    platform.ClearMappings();
+    for (size_t i = 0; i < 16; i++)
+        platform.AddMapping(65536 * (i + 1), 8192);
+
+    AddressDict ad(&platform);
+
+    // Address ranges clip mappings.
+    auto stats = ad.Prewarm(65536 * 2 + 4096, 65536 * 4 + 4096);
+    ASSERT_NE(stats, std::nullopt);
+    EXPECT_EQ(stats->ranges, 3);
+    EXPECT_EQ(stats->ids_used, 4096 + 8192 + 4096);
+
+    stats = ad.PrewarmIf([](const Mapping& map) -> bool {
+        return map.start >= 65536 * 8;
+    });
+    ASSERT_NE(stats, std::nullopt);
+    EXPECT_EQ(stats->ranges, 9);
+    EXPECT_EQ(ad.num_ranges(), 12);
+}
+
+TEST(AddressDictPolicy, RejectsGuardPages) {
+    TestPlatform platform;
+    platform.SetEnumerable(true);
+    platform.ClearMappings();
+    platform.AddMapping(65536, 4096, 0);
+    platform.AddMapping(65536 + 4096, 8192, kProtRead | kProtWrite);
+    platform.AddMapping(131072, 4096, kProtRead | kProtWrite | kProtExec);
+    platform.AddMapping(196608, 4096);
+
+    AddressDictOptions options;
+    options.required_prot = kProtRead;
+    options.forbidden_prot = kProtExec;
+    AddressDict ad(&platform, options);
+
+    EXPECT_EQ(ad.Make32bitAddress(65536 + 12), std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(131072 + 12), std::nullopt);
+    EXPECT_NE(ad.Make32bitAddress(65536 + 4096 + 12), std::nullopt);
+    EXPECT_NE(ad.Make32bitAddress(196608), std::nullopt);
+
+    // A span reaching into the guard page is rejected too.
+    EXPECT_EQ(ad.Make32bitAddress(65536 + 4000, 200), std::nullopt);
+
+    AddressDict prewarmed(&platform, options);
+    auto stats = prewarmed.Prewarm();
+    ASSERT_NE(stats, std::nullopt);
+    EXPECT_EQ(stats->ranges, 2);
+    EXPECT_EQ(stats->ids_used, 8192 + 4096);
+}
+
+TEST(AddressDictNegativeCache, FailsFast) {
+    TestPlatform platform;
+    platform.SetEnumerable(true);
+    platform.ClearMappings();
+    platform.AddMapping(65536, 4096);
+    platform.AddMapping(65536 * 4, 4096);
+
+    AddressDictOptions options;
+    options.negative_cache_ttl_ms = 60 * 60 * 1000;
+    AddressDict ad(&platform, options);
+
+    EXPECT_EQ(ad.Make32bitAddress(65536 * 2), std::nullopt);
+    EXPECT_EQ(ad.stats().negative_cache_fills, 1);
+
+    // Anywhere in the same gap fails without asking the platform.
+    size_t lookups = platform.lookups();
+    for (size_t i = 0; i < 100; i++) {
+        EXPECT_EQ(ad.Make32bitAddress(65536 + 4096 + i * 1000), std::nullopt);
+        EXPECT_EQ(ad.Make32bitAddress(65536 * 4 - 1), std::nullopt);
+    }
+    EXPECT_EQ(platform.lookups(), lookups);
+    EXPECT_EQ(ad.stats().negative_cache_hits, 200);
+
+    // Mapped neighbours still work.
+    EXPECT_NE(ad.Make32bitAddress(65536 * 4), std::nullopt);
+    EXPECT_NE(ad.Make32bitAddress(65536), std::nullopt);
+
+    // Batches use the cache too.
+    void* addresses[] = {
+        reinterpret_cast<void*>(65536 * 3),
+        reinterpret_cast<void*>(65536),
+    };
+    uint32_t ids[2];
+    EXPECT_EQ(ad.Make32bitAddresses(addresses, 2, ids), 1);
+    EXPECT_EQ(ad.stats().negative_cache_hits, 201);
+
+    // New memory is not seen until the cache is invalidated.
+    platform.AddMapping(65536 * 2, 4096);
+    EXPECT_EQ(ad.Make32bitAddress(65536 * 2), std::nullopt);
+    ad.InvalidateNegativeCache();
+    EXPECT_NE(ad.Make32bitAddress(65536 * 2), std::nullopt);
+}
+
+TEST(AddressDictNegativeCache, Expires) {
+    TestPlatform platform;
+    platform.SetEnumerable(true);
+    platform.ClearMappings();
+    platform.AddMapping(65536, 4096);
+
+    AddressDictOptions options;
+    options.negative_cache_ttl_ms = 1;
+    AddressDict ad(&platform, options);
+
+    EXPECT_EQ(ad.Make32bitAddress(65536 * 2), std::nullopt);
+    platform.AddMapping(65536 * 2, 4096);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_NE(ad.Make32bitAddress(65536 * 2), std::nullopt);
+}
+
+TEST(AddressDictRelease, ReuseWithIndexes) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 16; i++)
+        platform.AddMapping(65536 * (i + 1), 4096 * (1 + i % 3));
+
+    AddressDictOptions options;
+    options.direct_map_decode = true;
+    options.address_index = true;
+    AddressDict ad(&platform, options);
+
+    for (size_t i = 0; i < 16; i++)
+        ASSERT_NE(ad.Make32bitAddress(65536 * (i + 1)), std::nullopt);
+    for (size_t i = 0; i < 16; i += 3)
+        ASSERT_EQ(ad.ReleaseRange(65536 * (i + 1)), 1);
+
+    // Re-registering fills the holes, out of id order.
+    for (size_t i = 0; i < 16; i++) {
+        uintptr_t address = 65536 * (i + 1) + 8;
+        auto id = ad.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(ad.RecoverAddressValue(id.value()), address);
+    }
+    EXPECT_EQ(ad.num_ranges(), 16);
+}
+
+// Release and re-register at random, so ranges with reused ids land between
+// others and share pages with their neighbours, and check every live range
+// still resolves both ways through the indexes.
+TEST(AddressDictRelease, ChurnWithIndexes) {
+    static constexpr size_t kMappings = 64;
+
+    TestPlatform platform;
+    platform.ClearMappings();
+    std::vector<uintptr_t> starts;
+    for (size_t i = 0; i < kMappings; i++) {
+        // Every fourth page is split into four small mappings.
+        uintptr_t start = 131072 * (i / 4 + 1);
+        size_t size = 4096 * (1 + i % 5) + 100;
+        if (i % 16 < 4) {
+            start += 1024 * (i % 4);
+            size = 1024;
+        } else {
+            start += 32768 * (i % 4);
+        }
+        platform.AddMapping(start, size);
+        starts.emplace_back(start);
+    }
+
+    AddressDictOptions options;
+    options.direct_map_decode = true;
+    options.address_index = true;
+    AddressDict ad(&platform, options);
+
+    std::mt19937 rng(7);
+    std::vector<std::optional<uint32_t>> ids(kMappings);
+    for (size_t round = 0; round < 2000; round++) {
+        size_t i = rng() % kMappings;
+        if (ids[i] && rng() % 2) {
+            ASSERT_EQ(ad.ReleaseRange(starts[i]), 1);
+            ids[i] = std::nullopt;
+        } else {
+            auto id = ad.Make32bitAddress(starts[i]);
+            ASSERT_NE(id, std::nullopt);
+            EXPECT_TRUE(!ids[i] || id == ids[i]);
+            ids[i] = id;
+        }
+
+        for (size_t j = 0; j < kMappings; j++) {
+            if (!ids[j])
+                continue;
+            ASSERT_EQ(ad.Make32bitAddress(starts[j] + 10), ids[j].value() + 10) << round;
+            ASSERT_EQ(ad.RecoverAddressValue(ids[j].value() + 10), starts[j] + 10) << round;
+        }
+    }
+}
+
+TEST(AddressDictRelease, Quarantine) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(65536, 4096);
+    platform.AddMapping(131072, 4096);
+
+    AddressDictOptions options;
+    options.id_quarantine_ms = 60 * 60 * 1000;
+    options.direct_map_decode = true;
+    options.address_index = true;
+    AddressDict ad(&platform, options);
+
+    auto id = ad.Make32bitAddress(65536);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad.ReleaseRange(65536), 1);
+
+    // Quarantined ids are not reused; fresh ones are taken instead.
+    auto id2 = ad.Make32bitAddress(131072);
+    ASSERT_NE(id2, std::nullopt);
+    EXPECT_EQ(id2.value(), id.value() + 4096);
+    EXPECT_EQ(ad.RecoverAddress(id.value()), std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(id2.value()), 131072);
+}
+
+TEST_F(AddressDictTest, Batch) {
+    void* addresses[] = {
+        reinterpret_cast<void*>(17000),
+        nullptr,
+        reinterpret_cast<void*>(32768 + 5),
+        reinterpret_cast<void*>(50),
+        reinterpret_cast<void*>(16384 + 100),
+        reinterpret_cast<void*>(17001),
+    };
+    constexpr size_t kCount = sizeof(addresses) / sizeof(addresses[0]);
+
+    uint32_t ids[kCount];
+    bool failed[kCount];
+    ASSERT_EQ(ad_.Make32bitAddresses(addresses, kCount, ids, nullptr, failed), 1);
+
+    for (size_t i = 0; i < kCount; i++) {
+        if (i == 3) {
+            EXPECT_TRUE(failed[i]);
+            EXPECT_EQ(ids[i], 0);
+            continue;
+        }
+        EXPECT_FALSE(failed[i]);
+        if (addresses[i]) {
+            EXPECT_EQ(ad_.RecoverAddress(ids[i]), std::optional<void*>{addresses[i]});
+        } else {
+            EXPECT_EQ(ids[i], 0);
+        }
+    }
+    EXPECT_EQ(ids[5], ids[0] + 1);
+    EXPECT_EQ(ids[0], ids[4] + (17000 - 16384 - 100));
+
+    // Everything hits existing ranges now, and agrees with single lookups.
+    uint32_t ids2[kCount];
+    ASSERT_EQ(ad_.Make32bitAddresses(addresses, kCount, ids2), 1);
+    for (size_t i = 0; i < kCount; i++) {
+        EXPECT_EQ(ids[i], ids2[i]);
+        if (i != 3) {
+            EXPECT_EQ(ad_.Make32bitAddress(addresses[i]), std::optional<uint32_t>{ids[i]});
+        }
+    }
+}
+
+TEST_F(AddressDictTest, BatchSpan) {
+    void* addresses[] = {
+        reinterpret_cast<void*>(16384),
+        reinterpret_cast<void*>(32768),
+    };
+    size_t nbytes[] = {4096 + 20, 8192};
+
+    uint32_t ids[2];
+    bool failed[2];
+    ASSERT_EQ(ad_.Make32bitAddresses(addresses, 2, ids, nbytes, failed), 1);
+    EXPECT_FALSE(failed[0]);
+    EXPECT_TRUE(failed[1]);
+    EXPECT_EQ(ad_.RecoverAddressValue(ids[0], 4096 + 20), 16384);
+}
+
+// The batch path grows the most recent range for spans past its end, as the
+// single-address path does.
+TEST_F(AddressDictTest, BatchSpanGrowsRange) {
+    platform_.ClearMappings();
+    platform_.AddMapping(65536, 4096);
+    platform_.AddMapping(65536 + 4096, 4096);
+    platform_.AddMapping(65536 + 8192, 4096);
+
+    // Growing a range created earlier in the same batch.
+    void* addresses[] = {
+        reinterpret_cast<void*>(65536 + 100),
+        reinterpret_cast<void*>(65536 + 4000),
+        reinterpret_cast<void*>(65536 + 4100),
+    };
+    size_t nbytes[] = {64, 200, 8};
+    uint32_t ids[3];
+    ASSERT_EQ(ad_.Make32bitAddresses(addresses, 3, ids, nbytes), 0);
+    EXPECT_EQ(ad_.num_ranges(), 1);
+    EXPECT_EQ(ids[1], ids[0] + 3900);
+    EXPECT_EQ(ids[2], ids[0] + 4000);
+
+    // Growing a range from an earlier call.
+    void* more[] = {
+        reinterpret_cast<void*>(65536 + 8000),
+        reinterpret_cast<void*>(65536 + 8300),
+    };
+    size_t more_nbytes[] = {400, 8};
+    ASSERT_EQ(ad_.Make32bitAddresses(more, 2, ids + 1, more_nbytes), 0);
+    EXPECT_EQ(ad_.num_ranges(), 1);
+    EXPECT_EQ(ids[1], ids[0] + 7900);
+    EXPECT_EQ(ids[2], ids[0] + 8200);
+    EXPECT_EQ(ad_.RecoverAddressValue(ids[2], 8), 65536 + 8300);
+}
+
+// A short range between an address and a long range that covers its span
+// does not hide the long one.
+TEST_F(AddressDictTest, CoveringRangeBehindShortOnes) {
+    platform_.ClearMappings();
+    platform_.AddMapping(8192, 4096);
+    platform_.AddMapping(16384, 4096);
+    ASSERT_NE(ad_.Make32bitAddress(8192), std::nullopt);
+    ASSERT_NE(ad_.Make32bitAddress(16384), std::nullopt);
+
+    // The mappings were replaced by one large one.
+    platform_.ClearMappings();
+    platform_.AddMapping(4096, 40000);
+    auto id = ad_.Make32bitAddress(4096);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad_.num_ranges(), 3);
+
+    EXPECT_EQ(ad_.Make32bitAddress(20000, 1024), id.value() + 20000 - 4096);
+    EXPECT_EQ(ad_.num_ranges(), 3);
+}
+
+TEST_F(AddressDictTest, BatchRecover) {
+    EXPECT_EQ(ad_.RecoverAddresses(nullptr, 0, nullptr), 0);
+
+    // Lots of ranges, so the search takes several steps.
+    platform_.ClearMappings();
+    static constexpr size_t kRanges = 100;
+    for (size_t i = 0; i < kRanges; i++)
+        platform_.AddMapping(65536 + i * 8192, 4096);
+
+    std::vector<uint32_t> ids;
+    std::vector<uintptr_t> expected;
+    for (size_t i = 0; i < kRanges; i++) {
+        uintptr_t address = 65536 + ((i * 37) % kRanges) * 8192 + i;
+        auto id = ad_.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt);
+        ids.emplace_back(id.value());
+        expected.emplace_back(address);
+
+        // A run in the same range.
+        ids.emplace_back(id.value() + 1);
+        expected.emplace_back(address + 1);
+    }
+    ids.emplace_back(1);
+    expected.emplace_back(0);
+    ids.emplace_back(std::numeric_limits<uint32_t>::max());
+    expected.emplace_back(0);
+
+    std::vector<void*> addresses(ids.size());
+    std::unique_ptr<bool[]> failed(new bool[ids.size()]);
+    ASSERT_EQ(ad_.RecoverAddresses(ids.data(), ids.size(), addresses.data(), nullptr,
+                                   failed.get()),
+              2);
+    for (size_t i = 0; i < ids.size(); i++) {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(addresses[i]), expected[i]);
+        EXPECT_EQ(failed[i], expected[i] == 0);
+        if (expected[i]) {
+            EXPECT_EQ(ad_.RecoverAddressValue(ids[i]), std::optional<uintptr_t>{expected[i]});
+        }
+    }
+
+    // Validate spans: the last byte of a range is fine, one more is not.
+    uint32_t first = ad_.Make32bitAddress(65536).value();
+    uint32_t span_ids[] = {first, first};
+    size_t nbytes[] = {4096, 4097};
+    void* span_addresses[2];
+    ASSERT_EQ(ad_.RecoverAddresses(span_ids, 2, span_addresses, nbytes), 1);
+    EXPECT_EQ(span_addresses[0], reinterpret_cast<void*>(65536));
+    EXPECT_EQ(span_addresses[1], nullptr);
+}
+
+TEST(AddressDictDirectMap, MatchesSearch) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 50; i++)
+        platform.AddMapping(65536 + i * 65536, 4096 * (1 + i % 7));
+    // Smaller than a page, so several ranges share one page of ids.
+    for (size_t i = 0; i < 10; i++)
+        platform.AddMapping(0x10000000 + i * 4096, 16);
+
+    AddressDictOptions options;
+    options.direct_map_decode = true;
+    AddressDict direct(&platform, options);
+    AddressDict search(&platform);
+
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < 50; i++) {
+        uintptr_t address = 65536 + ((i * 13) % 50) * 65536 + i;
+        auto a = direct.Make32bitAddress(address);
+        auto b = search.Make32bitAddress(address);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, b);
+        ids.emplace_back(a.value());
+    }
+    for (size_t i = 0; i < 10; i++) {
+        auto a = direct.Make32bitAddress(0x10000000 + i * 4096 + 3);
+        auto b = search.Make32bitAddress(0x10000000 + i * 4096 + 3);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, b);
+        ids.emplace_back(a.value());
+    }
+
+    for (uint32_t id = 0; id < ids.back() + 8192; id++)
+        ASSERT_EQ(direct.RecoverAddressValue(id), search.RecoverAddressValue(id)) << id;
+
+    std::vector<void*> batch(ids.size());
+    ASSERT_EQ(direct.RecoverAddresses(ids.data(), ids.size(), batch.data()), 0);
+    for (size_t i = 0; i < ids.size(); i++)
+        EXPECT_EQ(batch[i], direct.RecoverAddress(ids[i]));
+}
+
+TEST(AddressDictAddressIndex, MatchesSearch) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 50; i++)
+        platform.AddMapping(65536 + i * 65536, 4096 * (1 + i % 7));
+    for (size_t i = 0; i < 10; i++)
+        platform.AddMapping(0x10000000 + i * 64, 16);
+
+    AddressDictOptions options;
+    options.address_index = true;
+    AddressDict indexed(&platform, options);
+    AddressDict search(&platform);
+
+    for (size_t i = 0; i < 50; i++) {
+        uintptr_t address = 65536 + ((i * 13) % 50) * 65536 + i;
+        auto a = indexed.Make32bitAddress(address);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, search.Make32bitAddress(address));
+    }
+    for (size_t i = 0; i < 10; i++) {
+        auto a = indexed.Make32bitAddress(0x10000000 + i * 64 + 3);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, search.Make32bitAddress(0x10000000 + i * 64 + 3));
+    }
+
+    // Every address, hit or miss, agrees.
+    for (uintptr_t address = 60000; address < 65536 * 52; address += 509)
+        ASSERT_EQ(indexed.Make32bitAddress(address), search.Make32bitAddress(address));
+    for (uintptr_t address = 0x10000000; address < 0x10000000 + 640; address++)
+        ASSERT_EQ(indexed.Make32bitAddress(address), search.Make32bitAddress(address));
+
+    std::vector<void*> addresses;
+    for (size_t i = 0; i < 50; i++)
+        addresses.emplace_back(reinterpret_cast<void*>(65536 + i * 65536 + 7));
+    std::vector<uint32_t> ids(addresses.size());
+    ASSERT_EQ(indexed.Make32bitAddresses(addresses.data(), addresses.size(), ids.data()), 0);
+    for (size_t i = 0; i < addresses.size(); i++)
+        EXPECT_EQ(indexed.RecoverAddress(ids[i]), std::optional<void*>{addresses[i]});
+}
+
+TEST(AddressDictMemo, MatchesSearch) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 8; i++)
+        platform.AddMapping(65536 + i * 65536, 8192);
+
+    AddressDictOptions options;
+    options.memoize_last_range = true;
+    AddressDict memo(&platform, options);
+    AddressDict search(&platform);
+
+    // Runs of addresses in the same mapping, with a new mapping every fourth
+    // run so the memo is invalidated along the way.
+    std::vector<uint32_t> ids;
+    for (size_t run = 0; run < 32; run++) {
+        uintptr_t base = 65536 + ((run / 4) * 65536);
+        for (size_t i = 0; i < 16; i++) {
+            auto a = memo.Make32bitAddress(base + i * 64);
+            ASSERT_NE(a, std::nullopt);
+            ASSERT_EQ(a, search.Make32bitAddress(base + i * 64));
+            ids.emplace_back(a.value());
+        }
+    }
+    for (uint32_t id : ids)
+        ASSERT_EQ(memo.RecoverAddressValue(id), search.RecoverAddressValue(id)) << id;
+    for (uint32_t id = 0; id < ids.back() + 8192; id += 31)
+        ASSERT_EQ(memo.RecoverAddressValue(id), search.RecoverAddressValue(id)) << id;
+
+    const auto& stats = memo.stats();
+    EXPECT_EQ(stats.compress_memo_hits + stats.compress_memo_misses, ids.size());
+    EXPECT_GT(stats.compress_memo_hits, ids.size() * 3 / 4);
+    EXPECT_GT(stats.recover_memo_hits, ids.size() * 3 / 4);
+
+    // Spans are still checked on a hit.
+    auto id = memo.Make32bitAddress(65536);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(memo.RecoverAddress(id.value(), 8193), std::nullopt);
+    EXPECT_EQ(memo.Make32bitAddress(65536, 8193), search.Make32bitAddress(65536, 8193));
+
+    // Without the option, nothing is counted.
+    EXPECT_EQ(search.stats().compress_memo_misses, 0);
+}
+
+TEST(BasicAddressDict, DefaultPlatform) {
+    // AddressDict stays a class of its own, and only it (or another
+    // IPlatform dictionary) falls back to the default platform.
+    static_assert(std::is_class_v<AddressDict>);
+    static_assert(std::is_base_of_v<BasicAddressDict<>, AddressDict>);
+    static_assert(!std::is_same_v<BasicAddressDict<>, AddressDict>);
+
+    AddressDict ad;
+    EXPECT_EQ(ad.platform(), IPlatform::GetDefault());
+    BasicAddressDict<IPlatform, uint16_t> narrow;
+    EXPECT_EQ(narrow.platform(), IPlatform::GetDefault());
+}
+
+TEST(BasicAddressDict, FixedPageShift) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 64; i++)
+        platform.AddMapping(65536 + i * 65536, 4096 * (1 + i % 5));
+    for (size_t i = 0; i < 10; i++)
+        platform.AddMapping(0x10000000 + i * 64, 16);
+
+    AddressDictOptions options;
+    options.direct_map_decode = true;
+    options.address_index = true;
+    options.memoize_last_range = true;
+    BasicAddressDict<TestPlatform, uint32_t, 12> fixed(&platform, options);
+    AddressDict search(&platform);
+    EXPECT_EQ(fixed.platform(), &platform);
+
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < 64; i++) {
+        uintptr_t address = 65536 + ((i * 13) % 64) * 65536 + i;
+        auto a = fixed.Make32bitAddress(address);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, search.Make32bitAddress(address));
+        ids.emplace_back(a.value());
+    }
+    for (size_t i = 0; i < 10; i++) {
+        auto a = fixed.Make32bitAddress(0x10000000 + i * 64 + 3);
+        ASSERT_NE(a, std::nullopt);
+        ASSERT_EQ(a, search.Make32bitAddress(0x10000000 + i * 64 + 3));
+    }
+
+    // Hits, misses and spans agree once everything is registered.
+    for (uintptr_t address = 60000; address < 65536 * 66; address += 509) {
+        ASSERT_EQ(fixed.Make32bitAddress(address), search.Make32bitAddress(address));
+        ASSERT_EQ(fixed.Make32bitAddress(address, 4096), search.Make32bitAddress(address, 4096));
+    }
+    for (uint32_t id = 0; id < ids.back() + 65536; id += 97) {
+        ASSERT_EQ(fixed.RecoverAddressValue(id), search.RecoverAddressValue(id)) << id;
+        ASSERT_EQ(fixed.RecoverAddressValue(id, 64), search.RecoverAddressValue(id, 64)) << id;
+    }
+}
+
+TEST(AddressDictIdWidth, Narrow) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    for (size_t i = 0; i < 8; i++)
+        platform.AddMapping(65536 + i * 65536, 4096);
+    platform.AddMapping(0x1000000, 1024 * 1024);
+
+    BasicAddressDict<TestPlatform, uint16_t> ad(&platform);
+    static_assert(std::is_same_v<decltype(ad)::Id, uint16_t>);
+
+    std::vector<void*> addresses;
+    for (size_t i = 0; i < 8; i++)
+        addresses.emplace_back(reinterpret_cast<void*>(65536 + i * 65536 + i));
+    std::vector<uint16_t> ids(addresses.size());
+    ASSERT_EQ(ad.MakeIds(addresses.data(), addresses.size(), ids.data()), 0);
+    EXPECT_EQ(ids[0], 1);
+    for (size_t i = 0; i < addresses.size(); i++) {
+        EXPECT_EQ(ad.MakeId(addresses[i]), ids[i]);
+        EXPECT_EQ(ad.RecoverAddress(ids[i]), std::optional<void*>{addresses[i]});
+    }
+    std::vector<void*> recovered(ids.size());
+    ASSERT_EQ(ad.RecoverAddresses(ids.data(), ids.size(), recovered.data()), 0);
+    EXPECT_EQ(recovered, addresses);
+
+    // The large mapping is truncated to the ids left, from its start.
+    auto id = ad.MakeId(0x1000000 + 100);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(id.value()), 0x1000000 + 100);
+    EXPECT_EQ(ad.RecoverAddressValue(0xffff), std::nullopt);
+    EXPECT_EQ(ad.MakeId(0x1000000 + 512 * 1024), std::nullopt);
+}
+
+TEST(AddressDictIdWidth, NarrowLargePages) {
+    class LargePagePlatform final : public IPlatform {
+      public:
+        int GetPageSize() override { return 65536; }
+
+        bool GetAddressMapping(void* address, Mapping* map) override {
+            *map = Mapping{reinterpret_cast<uintptr_t>(address) & ~uintptr_t(0xffff), 32768};
+            return true;
+        }
+    } platform;
+
+    AddressDictOptions options;
+    options.direct_map_decode = true;
+    BasicAddressDict<IPlatform, uint16_t> ad(&platform, options);
+    EXPECT_EQ(ad.MakeId(uintptr_t(0x10000)), 1);
+    EXPECT_EQ(ad.MakeId(uintptr_t(0x20000)), 1 + 32768);
+    EXPECT_EQ(ad.RecoverAddressValue(1 + 32768 + 5), 0x20000 + 5);
+}
+
+TEST(AddressDictIdWidth, OverflowPolicy) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(0x1000000, 1024 * 1024);
+    platform.AddMapping(0x2000000, 4096);
+
+    AddressDictOptions options;
+    options.id_overflow = IdOverflow::TruncateFromAddress;
+    BasicAddressDict<TestPlatform, uint16_t> from_address(&platform, options);
+    uintptr_t address = 0x1000000 + 512 * 1024 + 123;
+    auto id = from_address.MakeId(address);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(from_address.RecoverAddressValue(id.value()), address);
+    EXPECT_EQ(from_address.RecoverAddressValue(id.value() - 123), address - 123);
+    EXPECT_EQ(from_address.RecoverAddressValue(id.value() - 124), std::nullopt);
+
+    options.id_overflow = IdOverflow::Fail;
+    BasicAddressDict<TestPlatform, uint16_t> fail(&platform, options);
+    EXPECT_EQ(fail.MakeId(0x1000000), std::nullopt);
+    EXPECT_NE(fail.MakeId(0x2000000), std::nullopt);
+}
+
+TEST(AddressDictIdWidth, Wide) {
+    if (sizeof(void*) == sizeof(uint32_t)) {
+        GTEST_SKIP() << "Skipping 64-bit only test.";
+    }
+
+    static constexpr uint64_t kGiB = 1024 * 1024 * 1024;
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(65536, size_t(16 * kGiB));
+    platform.AddMapping(size_t(32 * kGiB), 4096);
+
+    uintptr_t address = uintptr_t(65536 + 8 * kGiB);
+    AddressDict narrow(&platform);
+    EXPECT_EQ(narrow.Make32bitAddress(address), std::nullopt);
+
+    BasicAddressDict<TestPlatform, PackedId48> ad(&platform);
+    auto id = ad.MakeId(address);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_GT(id.value(), std::numeric_limits<uint32_t>::max());
+    EXPECT_EQ(ad.RecoverAddressValue(id.value(), 4096), address);
+
+    std::vector<void*> addresses = {
+        reinterpret_cast<void*>(address + 8),
+        reinterpret_cast<void*>(uintptr_t(32 * kGiB) + 8),
+        reinterpret_cast<void*>(uintptr_t(64 * kGiB)),
+    };
+    std::vector<uint64_t> ids(addresses.size());
+    bool failed[3];
+    ASSERT_EQ(ad.MakeIds(addresses.data(), addresses.size(), ids.data(), nullptr, failed), 1);
+    EXPECT_TRUE(failed[2]);
+
+    std::vector<PackedId48> packed(ids.size());
+    PackIds48(ids.data(), ids.size(), packed.data());
+    std::vector<uint64_t> unpacked(ids.size());
+    UnpackIds48(packed.data(), packed.size(), unpacked.data());
+    EXPECT_EQ(unpacked, ids);
+
+    std::vector<void*> recovered(ids.size());
+    ASSERT_EQ(ad.RecoverAddresses(unpacked.data(), 2, recovered.data()), 0);
+    EXPECT_EQ(recovered[0], addresses[0]);
+    EXPECT_EQ(recovered[1], addresses[1]);
+}
+
+TEST(AddressDictAlign, Units) {
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(65536, 65536);
+    platform.AddMapping(262144, 8192);
+
+    AddressDictOptions options;
+    options.align_shift = 3;
+    options.direct_map_decode = true;
+    options.address_index = true;
+    AddressDict ad(&platform, options);
+
+    auto id = ad.Make32bitAddress(65536 + 64, 16);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(65536 + 72), id.value() + 1);
+    EXPECT_EQ(ad.RecoverAddressValue(id.value() + 2), 65536 + 80);
+    EXPECT_EQ(ad.Make32bitAddress(65536 + 65), std::nullopt);
+
+    // The range takes an eighth of the ids its bytes would.
+    auto other = ad.Make32bitAddress(262144);
+    ASSERT_NE(other, std::nullopt);
+    EXPECT_EQ(other.value() - (id.value() - 8), 65536 / 8);
+
+    // Spans are still in bytes.
+    uint32_t last = other.value() + 8192 / 8 - 1;
+    EXPECT_EQ(ad.RecoverAddressValue(last, 8), 262144 + 8192 - 8);
+    EXPECT_EQ(ad.RecoverAddressValue(last, 9), std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(last + 1), std::nullopt);
+
+    void* addresses[] = {
+        reinterpret_cast<void*>(65536 + 4096),
+        reinterpret_cast<void*>(65536 + 4097),
+        reinterpret_cast<void*>(262144 + 8),
+    };
+    uint32_t ids[3];
+    bool failed[3];
+    ASSERT_EQ(ad.Make32bitAddresses(addresses, 3, ids, nullptr, failed), 1);
+    EXPECT_TRUE(failed[1]);
+    void* recovered[3];
+    ASSERT_EQ(ad.RecoverAddresses(ids, 3, recovered), 1);
+    EXPECT_EQ(recovered[0], addresses[0]);
+    EXPECT_EQ(recovered[2], addresses[2]);
+}
+
+TEST(AddressDictAlign, Reach) {
+    if (sizeof(void*) == sizeof(uint32_t)) {
+        GTEST_SKIP() << "Skipping 64-bit only test.";
+    }
+
+    static constexpr uint64_t kGiB = 1024 * 1024 * 1024;
+    TestPlatform platform;
+    platform.ClearMappings();
+    platform.AddMapping(65536, size_t(24 * kGiB));
+
+    uintptr_t address = uintptr_t(65536 + 20 * kGiB);
+    AddressDict bytes(&platform);
+    EXPECT_EQ(bytes.Make32bitAddress(address), std::nullopt);
+
+    AddressDictOptions options;
+    options.align_shift = 3;
+    AddressDict aligned(&platform, options);
+    auto id = aligned.Make32bitAddress(address);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(aligned.RecoverAddressValue(id.value()), address);
+}
+
+TEST(AddressDictCage, Defaults) {
+    PointerCage cage;
+    ASSERT_TRUE(cage.Reserve());
+    void* object = cage.Allocate(64);
+    ASSERT_NE(object, nullptr);
+
+    AddressDict ad;
+    auto base_id = ad.AttachCage(cage);
+    ASSERT_NE(base_id, std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(object), base_id.value() + cage.Compress(object));
+}
+
+TEST(AddressDictCage, AlreadyCovered) {
+    PointerCage cage(64 * 1024 * 1024);
+    ASSERT_TRUE(cage.Reserve());
+    void* object = cage.Allocate(64);
+    ASSERT_NE(object, nullptr);
+
+    // A range already holds part of the cage, so it cannot be attached.
+    AddressDict ad;
+    auto id = ad.Make32bitAddress(object);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(ad.AttachCage(cage), std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(object), id);
+}
+
+TEST(AddressDictCage, FixedWindow) {
+    PointerCage cage(64 * 1024 * 1024);
+    ASSERT_TRUE(cage.Reserve());
+
+    TestPlatform platform;
+    platform.SetEnumerable(true);
+    AddressDictOptions options;
+    options.memoize_last_range = true;
+    AddressDict ad(&platform, options);
+
+    // Foreign pointers keep working around the cage.
+    auto foreign = ad.Make32bitAddress(16384 + 8);
+    ASSERT_NE(foreign, std::nullopt);
+
+    auto base_id = ad.AttachCage(cage);
+    ASSERT_NE(base_id, std::nullopt);
+    EXPECT_EQ(ad.AttachCage(cage), std::nullopt);
+
+    size_t lookups = platform.lookups();
+    std::vector<void*> objects;
+    for (size_t i = 0; i < 100; i++) {
+        void* ptr = cage.Allocate(24 + i * 40);
+        ASSERT_NE(ptr, nullptr);
+        auto id = ad.Make32bitAddress(ptr, 24);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(id.value(), base_id.value() + cage.Compress(ptr));
+        EXPECT_EQ(ad.RecoverAddress(id.value(), 24), std::optional<void*>{ptr});
+        objects.emplace_back(ptr);
+    }
+    EXPECT_EQ(platform.lookups(), lookups);
+    EXPECT_EQ(ad.stats().compress_memo_hits + ad.stats().compress_memo_misses, 1);
+
+    // The window ends with the cage.
+    uint32_t last = uint32_t(base_id.value() + cage.size() - 1);
+    EXPECT_EQ(ad.RecoverAddressValue(last), cage.base() + cage.size() - 1);
+    EXPECT_EQ(ad.RecoverAddressValue(last, 2), std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(cage.base() + cage.size() - 1, 2), std::nullopt);
+
+    // The batch paths see the same window.
+    std::vector<uint32_t> ids(objects.size());
+    ASSERT_EQ(ad.Make32bitAddresses(objects.data(), objects.size(), ids.data()), 0);
+    for (size_t i = 0; i < objects.size(); i++)
+        EXPECT_EQ(ids[i], base_id.value() + cage.Compress(objects[i]));
+    EXPECT_EQ(ad.RecoverAddressValue(foreign.value()), 16384 + 8);
+
+    // Releasing the cage closes the window.
+    EXPECT_EQ(ad.ReleaseRange(cage.base()), 1);
+    EXPECT_EQ(ad.RecoverAddress(ids[0]), std::nullopt);
+    EXPECT_EQ(ad.Make32bitAddress(objects[0]), std::nullopt);
+}
+
+TEST(PackedId48, RoundTrip) {
+    static_assert(sizeof(PackedId48[4]) == 24);
+    uint64_t values[] = {0, 1, 0xff, 0x1234567890ab, 0xffffffffffff};
+    for (uint64_t value : values)
+        EXPECT_EQ(PackedId48::FromValue(value).value(), value);
+}
+
 TEST(AddressDictPlatformText, StackVar) {
     AddressDict ad;
 
@@ -160,3 +1215,19 @@ TEST(AddressDictPlatformText, StackVar) {
     ASSERT_NE(ptr, std::nullopt);
     EXPECT_EQ(ptr, &ad);
 }
+
+TEST(AddressDictPlatformText, Batch) {
+    AddressDict ad;
+
+    static constexpr size_t kCount = 1000;
+    std::unique_ptr<int[]> heap(new int[kCount]);
+    std::unique_ptr<void*[]> addresses(new void*[kCount]);
+    for (size_t i = 0; i < kCount; i++)
+        addresses[i] = (i % 2) ? &heap[i] : &heap[kCount - i - 1];
+    addresses[kCount / 2] = &ad;
+
+    std::unique_ptr<uint32_t[]> ids(new uint32_t[kCount]);
+    ASSERT_EQ(ad.Make32bitAddresses(addresses.get(), kCount, ids.get()), 0);
+    for (size_t i = 0; i < kCount; i++)
+        EXPECT_EQ(ad.RecoverAddress(ids[i], sizeof(int)), std::optional<void*>{addresses[i]});
+}
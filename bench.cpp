@@ -0,0 +1,309 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "addrz.h"
+#include "compressed_ptr.h"
+#include "pointer_cage.h"
+
+using namespace am;
+
+// Mappings are synthesized rather than read from the OS, so that the timings
+// only reflect the dictionary.
+class BenchPlatform final : public IPlatform {
+  public:
+    static constexpr uintptr_t kBase = 0x10000000;
+    static constexpr uintptr_t kStride = 8192;
+    static constexpr size_t kSize = 4096;
+
+    explicit BenchPlatform(size_t count)
+      : count_(count)
+    {}
+
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        if (value < kBase)
+            return false;
+        size_t index = (value - kBase) / kStride;
+        if (index >= count_ || (value - kBase) % kStride >= kSize)
+            return false;
+        *map = Mapping{kBase + index * kStride, kSize};
+        return true;
+    }
+
+    static uintptr_t AddressOf(size_t index) { return kBase + index * kStride; }
+
+  private:
+    size_t count_;
+};
+
+class Timer {
+  public:
+    Timer()
+      : start_(std::chrono::steady_clock::now())
+    {}
+
+    double ns() const {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+  private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+static std::vector<void*> ShuffledAddresses(size_t count) {
+    std::vector<void*> addresses;
+    for (size_t i = 0; i < count; i++)
+        addresses.emplace_back(reinterpret_cast<void*>(BenchPlatform::AddressOf(i)));
+    std::shuffle(addresses.begin(), addresses.end(), std::mt19937(count));
+    return addresses;
+}
+
+static void BenchRegistration() {
+    printf("Range registration, shuffled order (ns per range)\n");
+    printf("%10s %12s %12s\n", "ranges", "single", "batch");
+
+    for (size_t count = 1000; count <= 64000; count *= 4) {
+        BenchPlatform platform(count);
+        auto addresses = ShuffledAddresses(count);
+
+        double single;
+        {
+            AddressDict ad(&platform);
+            Timer timer;
+            for (void* address : addresses) {
+                if (!ad.Make32bitAddress(address))
+                    abort();
+            }
+            single = timer.ns() / count;
+        }
+
+        double batch;
+        {
+            AddressDict ad(&platform);
+            std::vector<uint32_t> ids(count);
+            Timer timer;
+            if (ad.Make32bitAddresses(addresses.data(), count, ids.data()) != 0)
+                abort();
+            batch = timer.ns() / count;
+        }
+
+        printf("%10zu %12.1f %12.1f\n", count, single, batch);
+    }
+}
+
+// Time compressing and recovering already-registered addresses in random
+// order, with the lookup indexes on, so every call is a fast-path hit. 48-bit
+// ids decode by binary search, since the id table only covers 32 bits.
+template <typename Dict>
+static void BenchHits(const char* name, size_t count) {
+    BenchPlatform platform(count);
+    auto addresses = ShuffledAddresses(count);
+
+    AddressDictOptions options;
+    options.direct_map_decode = Dict::kIdBits <= 32;
+    options.address_index = true;
+    Dict ad(&platform, options);
+    std::vector<typename Dict::Id> ids(count);
+    if (ad.MakeIds(addresses.data(), count, ids.data()) != 0) {
+        // Not enough ids at this width.
+        printf("%24s %10zu %12s %12s\n", name, count, "-", "-");
+        return;
+    }
+
+    static constexpr size_t kRounds = 16;
+    uint64_t sum = 0;
+    Timer compress_timer;
+    for (size_t round = 0; round < kRounds; round++) {
+        for (void* address : addresses)
+            sum += ad.MakeId(address).value();
+    }
+    double compress = compress_timer.ns() / (count * kRounds);
+
+    Timer recover_timer;
+    for (size_t round = 0; round < kRounds; round++) {
+        for (auto id : ids)
+            sum += reinterpret_cast<uintptr_t>(ad.RecoverAddress(id).value());
+    }
+    double recover = recover_timer.ns() / (count * kRounds);
+
+    if (!sum)
+        abort();
+    printf("%24s %10zu %12.1f %12.1f\n", name, count, compress, recover);
+}
+
+// Time cage pointers through an attached dictionary, against the cage's own
+// subtract and add.
+static void BenchCage(size_t count) {
+    PointerCage cage(256 * 1024 * 1024);
+    if (!cage.Reserve())
+        abort();
+
+    std::vector<void*> objects;
+    for (size_t i = 0; i < count; i++)
+        objects.emplace_back(cage.Allocate(64));
+    std::shuffle(objects.begin(), objects.end(), std::mt19937(count));
+
+    BenchPlatform platform(0);
+    AddressDict ad(&platform);
+    if (!ad.AttachCage(cage))
+        abort();
+
+    static constexpr size_t kRounds = 16;
+    uint64_t sum = 0;
+    Timer compress_timer;
+    for (size_t round = 0; round < kRounds; round++) {
+        for (void* object : objects)
+            sum += ad.Make32bitAddress(object).value();
+    }
+    double compress = compress_timer.ns() / (count * kRounds);
+
+    Timer raw_timer;
+    for (size_t round = 0; round < kRounds; round++) {
+        for (void* object : objects)
+            sum += cage.Compress(object);
+    }
+    double raw = raw_timer.ns() / (count * kRounds);
+
+    if (!sum)
+        abort();
+    printf("%10zu %12.1f %12.1f\n", count, compress, raw);
+}
+
+struct BenchNode {
+    uint64_t value;
+    char padding[56];
+};
+
+// Time walking a CompressedPtrVector against a vector of raw pointers, over
+// the same cage-allocated nodes: once in order, and once through a shuffled
+// list of indexes. Without |attach| the nodes resolve through the dict's
+// ranges instead of the cage window.
+static void BenchContainers(size_t count, bool attach) {
+    PointerCage cage(256 * 1024 * 1024);
+    if (!cage.Reserve())
+        abort();
+
+    AddressDictOptions options;
+    options.address_index = true;
+    AddressDict ad(IPlatform::GetDefault(), options);
+    if (attach && !ad.AttachCage(cage))
+        abort();
+    GlobalDictBinding<>::Bind(&ad);
+
+    std::vector<BenchNode*> raw;
+    CompressedPtrVector<BenchNode> compressed;
+    for (size_t i = 0; i < count; i++) {
+        auto node = static_cast<BenchNode*>(cage.Allocate(sizeof(BenchNode)));
+        node->value = i;
+        raw.emplace_back(node);
+        if (!compressed.push_back(node))
+            abort();
+    }
+
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937(count));
+
+    static constexpr size_t kRounds = 16;
+    uint64_t sum = 0;
+    auto time = [&](auto&& body) -> double {
+        Timer timer;
+        for (size_t round = 0; round < kRounds; round++)
+            body();
+        return timer.ns() / (count * kRounds);
+    };
+
+    double raw_iter = time([&] {
+        for (BenchNode* node : raw)
+            sum += node->value;
+    });
+    double compressed_iter = time([&] {
+        for (BenchNode* node : compressed)
+            sum += node->value;
+    });
+    double raw_random = time([&] {
+        for (size_t index : order)
+            sum += raw[index]->value;
+    });
+    double compressed_random = time([&] {
+        for (size_t index : order)
+            sum += compressed[index]->value;
+    });
+
+    GlobalDictBinding<>::Bind(nullptr);
+    if (!sum)
+        abort();
+    printf("%10zu %8s %10.1f %12.1f %10.1f %12.1f\n", count, attach ? "cage" : "ranges",
+           raw_iter, compressed_iter, raw_random, compressed_random);
+}
+
+int main() {
+    BenchRegistration();
+
+    printf("\nCage pointers, shuffled order (ns per call)\n");
+    printf("%10s %12s %12s\n", "objects", "dict", "cage");
+    for (size_t count = 1000; count <= 64000; count *= 4)
+        BenchCage(count);
+
+    printf("\nContainers, sum of node values (ns per element)\n");
+    printf("%10s %8s %10s %12s %10s %12s\n", "nodes", "lookup", "raw iter", "compr. iter",
+           "raw rand", "compr. rand");
+    for (size_t count = 1000; count <= 256000; count *= 16) {
+        BenchContainers(count, true);
+        BenchContainers(count, false);
+    }
+
+    printf("\nIndexed hits, shuffled order (ns per call)\n");
+    printf("%24s %10s %12s %12s\n", "dict", "ranges", "compress", "recover");
+    for (size_t count = 1000; count <= 64000; count *= 4) {
+        BenchHits<AddressDict>("AddressDict", count);
+        BenchHits<BasicAddressDict<BenchPlatform, uint32_t, 12>>("BasicAddressDict<12>", count);
+    }
+
+    // 16-bit ids only have room for a handful of these mappings.
+    printf("\nId widths, indexed hits, shuffled order (ns per call)\n");
+    printf("%24s %10s %12s %12s\n", "ids", "ranges", "compress", "recover");
+    for (size_t count : {12, 1000, 64000}) {
+        BenchHits<BasicAddressDict<BenchPlatform, uint16_t, 12>>("16-bit", count);
+        BenchHits<BasicAddressDict<BenchPlatform, uint32_t, 12>>("32-bit", count);
+        BenchHits<BasicAddressDict<BenchPlatform, PackedId48, 12>>("48-bit", count);
+    }
+    return 0;
+}
@@ -0,0 +1,268 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "addrz.h"
+
+namespace am {
+
+// Binds CompressedPtrs to the dictionary they decode through. A binding is any
+// type with a static dict() returning the dictionary; this one holds a single
+// process-wide dictionary per dictionary type, set with Bind. Define another
+// binding type for a second dictionary, or a thread-local one.
+template <typename Dict = AddressDict>
+struct GlobalDictBinding {
+    static Dict* dict() { return sDict; }
+    static void Bind(Dict* dict) { sDict = dict; }
+
+    static inline Dict* sDict = nullptr;
+};
+
+// A pointer to T stored as a dictionary id: 4 bytes with an AddressDict, or
+// 2 or 6 with 16- or 48-bit ids. Dereferencing recovers the address through
+// the bound dictionary's inline fast path, and checks that the whole T is in
+// the id's range.
+//
+// Constructing from a T* asserts that it compresses; use Compress to handle
+// failure. Id 0 is nullptr.
+template <typename T, typename Binding = GlobalDictBinding<>>
+class CompressedPtr final {
+  public:
+    using Dict = std::remove_pointer_t<decltype(Binding::dict())>;
+    using IdStorage = typename Dict::IdStorage;
+    using Id = typename Dict::Id;
+
+    CompressedPtr()
+      : id_(IdTraits<IdStorage>::Store(0))
+    {}
+    CompressedPtr(std::nullptr_t)
+      : CompressedPtr()
+    {}
+    explicit CompressedPtr(T* ptr)
+      : id_(IdTraits<IdStorage>::Store(MakeId(ptr).value_or(0)))
+    {
+        assert(!ptr || id() != 0);
+    }
+
+    static std::optional<CompressedPtr> Compress(T* ptr) {
+        auto id = MakeId(ptr);
+        if (!id)
+            return {};
+        return {FromId(id.value())};
+    }
+
+    static CompressedPtr FromId(Id id) {
+        CompressedPtr ptr;
+        ptr.id_ = IdTraits<IdStorage>::Store(id);
+        return ptr;
+    }
+
+    Id id() const { return IdTraits<IdStorage>::Load(id_); }
+
+    // Returns nullptr for id 0. An id that no longer decodes asserts, and
+    // also gives nullptr.
+    T* get() const {
+        Id id = this->id();
+        if (!id)
+            return nullptr;
+        auto address = Binding::dict()->RecoverAddress(id, sizeof(T));
+        assert(address);
+        return static_cast<T*>(address.value_or(nullptr));
+    }
+
+    T* operator ->() const { return get(); }
+    T& operator *() const { return *get(); }
+    explicit operator bool() const { return id() != 0; }
+
+    CompressedPtr& operator =(std::nullptr_t) {
+        id_ = IdTraits<IdStorage>::Store(0);
+        return *this;
+    }
+
+    bool operator ==(const CompressedPtr& other) const { return id() == other.id(); }
+    bool operator !=(const CompressedPtr& other) const { return id() != other.id(); }
+
+  private:
+    static std::optional<Id> MakeId(T* ptr) {
+        return Binding::dict()->MakeId(static_cast<void*>(ptr), sizeof(T));
+    }
+
+  private:
+    IdStorage id_;
+};
+
+// A vector of T* that stores only the ids, so it takes a half (or a quarter,
+// with 16-bit ids) of the memory of std::vector<T*> on 64-bit. Elements are
+// read back as T*; there are no references to them.
+template <typename T, typename Binding = GlobalDictBinding<>>
+class CompressedPtrVector final {
+  public:
+    using Ptr = CompressedPtr<T, Binding>;
+    using Id = typename Ptr::Id;
+
+    class const_iterator {
+      public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T*;
+        using difference_type = ptrdiff_t;
+        using pointer = T* const*;
+        using reference = T*;
+
+        const_iterator() = default;
+
+        T* operator *() const { return pos_->get(); }
+        T* operator [](difference_type n) const { return pos_[n].get(); }
+
+        const_iterator& operator ++() { ++pos_; return *this; }
+        const_iterator operator ++(int) { return const_iterator(pos_++); }
+        const_iterator& operator --() { --pos_; return *this; }
+        const_iterator operator --(int) { return const_iterator(pos_--); }
+        const_iterator& operator +=(difference_type n) { pos_ += n; return *this; }
+        const_iterator& operator -=(difference_type n) { pos_ -= n; return *this; }
+        const_iterator operator +(difference_type n) const { return const_iterator(pos_ + n); }
+        const_iterator operator -(difference_type n) const { return const_iterator(pos_ - n); }
+        difference_type operator -(const const_iterator& other) const { return pos_ - other.pos_; }
+
+        bool operator ==(const const_iterator& other) const { return pos_ == other.pos_; }
+        bool operator !=(const const_iterator& other) const { return pos_ != other.pos_; }
+        bool operator <(const const_iterator& other) const { return pos_ < other.pos_; }
+
+      private:
+        friend class CompressedPtrVector;
+
+        explicit const_iterator(const Ptr* pos)
+          : pos_(pos)
+        {}
+
+      private:
+        const Ptr* pos_ = nullptr;
+    };
+
+    size_t size() const { return ptrs_.size(); }
+    bool empty() const { return ptrs_.empty(); }
+    void reserve(size_t n) { ptrs_.reserve(n); }
+    void clear() { ptrs_.clear(); }
+    void pop_back() { ptrs_.pop_back(); }
+
+    // Returns false, and adds nothing, if |ptr| cannot be compressed.
+    bool push_back(T* ptr) {
+        auto compressed = Ptr::Compress(ptr);
+        if (!compressed)
+            return false;
+        ptrs_.emplace_back(compressed.value());
+        return true;
+    }
+
+    // Append |count| pointers, compressed as one batch. Returns the number
+    // that could not be compressed; if any, nothing is added.
+    size_t append(T* const* ptrs, size_t count) {
+        static_assert(sizeof(Ptr) == sizeof(typename Ptr::IdStorage));
+
+        // Copied rather than cast, since T* objects cannot be read as void*.
+        std::vector<void*> addresses(ptrs, ptrs + count);
+        std::vector<Id> ids(count);
+        std::vector<size_t> nbytes(count, sizeof(T));
+        size_t failures = Binding::dict()->MakeIds(addresses.data(), count, ids.data(),
+                                                   nbytes.data());
+        if (failures)
+            return failures;
+
+        ptrs_.reserve(ptrs_.size() + count);
+        for (Id id : ids)
+            ptrs_.emplace_back(Ptr::FromId(id));
+        return 0;
+    }
+
+    // Returns false, and leaves the element alone, if |ptr| cannot be
+    // compressed.
+    bool set(size_t index, T* ptr) {
+        auto compressed = Ptr::Compress(ptr);
+        if (!compressed)
+            return false;
+        ptrs_[index] = compressed.value();
+        return true;
+    }
+
+    T* operator [](size_t index) const { return ptrs_[index].get(); }
+    T* front() const { return ptrs_.front().get(); }
+    T* back() const { return ptrs_.back().get(); }
+
+    // Decode every element into |out| as one batch, which is faster than
+    // iterating when the ids are scattered across many ranges. Null elements
+    // decode as nullptr. Returns the number of ids that no longer decode;
+    // those are written as nullptr too.
+    size_t decode(T** out) const {
+        std::vector<void*> addresses(ptrs_.size());
+        std::vector<size_t> nbytes(ptrs_.size(), sizeof(T));
+        std::unique_ptr<bool[]> failed(new bool[ptrs_.size()]());
+        size_t failures;
+        if constexpr (std::is_same_v<typename Ptr::IdStorage, Id>) {
+            auto ids = reinterpret_cast<const Id*>(ptrs_.data());
+            failures = Binding::dict()->RecoverAddresses(ids, ptrs_.size(), addresses.data(),
+                                                         nbytes.data(), failed.get());
+        } else {
+            std::vector<Id> ids(ptrs_.size());
+            for (size_t i = 0; i < ptrs_.size(); i++)
+                ids[i] = ptrs_[i].id();
+            failures = Binding::dict()->RecoverAddresses(ids.data(), ids.size(),
+                                                         addresses.data(), nbytes.data(),
+                                                         failed.get());
+        }
+
+        // Id 0 has no range, but is not a failure. Either way, it decoded to
+        // nullptr.
+        for (size_t i = 0; i < ptrs_.size(); i++) {
+            out[i] = static_cast<T*>(addresses[i]);
+            if (failed[i] && !ptrs_[i])
+                failures--;
+        }
+        return failures;
+    }
+
+    const_iterator begin() const { return const_iterator(ptrs_.data()); }
+    const_iterator end() const { return const_iterator(ptrs_.data() + ptrs_.size()); }
+
+    // The compressed elements themselves.
+    const std::vector<Ptr>& ptrs() const { return ptrs_; }
+
+  private:
+    std::vector<Ptr> ptrs_;
+};
+
+} // namespace am
@@ -0,0 +1,217 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "compressed_ptr.h"
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace am;
+
+namespace {
+
+struct Node {
+    int value;
+    Node* next;
+};
+
+using WideDict = BasicAddressDict<IPlatform, PackedId48>;
+
+struct WideBinding {
+    static WideDict* dict() { return sDict; }
+    static inline WideDict* sDict = nullptr;
+};
+
+// A single page, which is never dereferenced.
+class OnePagePlatform final : public IPlatform {
+  public:
+    static constexpr uintptr_t kBase = 0x10000000;
+
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        if (value < kBase || value >= kBase + 4096)
+            return false;
+        *map = Mapping{kBase, 4096};
+        return true;
+    }
+};
+
+struct SmallBinding {
+    static AddressDict* dict() { return sDict; }
+    static inline AddressDict* sDict = nullptr;
+};
+
+class CompressedPtrTest : public ::testing::Test {
+  protected:
+    void SetUp() override { GlobalDictBinding<>::Bind(&dict_); }
+    void TearDown() override { GlobalDictBinding<>::Bind(nullptr); }
+
+    AddressDict dict_{IPlatform::GetDefault()};
+};
+
+} // anonymous namespace
+
+TEST_F(CompressedPtrTest, Basic) {
+    static_assert(sizeof(CompressedPtr<Node>) == 4);
+
+    CompressedPtr<Node> null;
+    EXPECT_FALSE(null);
+    EXPECT_EQ(null.get(), nullptr);
+    EXPECT_EQ(null, CompressedPtr<Node>(nullptr));
+
+    auto node = std::make_unique<Node>(Node{7, nullptr});
+    CompressedPtr<Node> ptr(node.get());
+    ASSERT_TRUE(ptr);
+    EXPECT_EQ(ptr.get(), node.get());
+    EXPECT_EQ(ptr->value, 7);
+    (*ptr).value = 8;
+    EXPECT_EQ(node->value, 8);
+
+    EXPECT_EQ(CompressedPtr<Node>::FromId(ptr.id()), ptr);
+    EXPECT_NE(ptr, null);
+
+    ptr = nullptr;
+    EXPECT_FALSE(ptr);
+}
+
+TEST_F(CompressedPtrTest, Compress) {
+    auto node = std::make_unique<Node>();
+    auto ptr = CompressedPtr<Node>::Compress(node.get());
+    ASSERT_TRUE(ptr);
+    EXPECT_EQ(ptr->get(), node.get());
+
+    EXPECT_FALSE(CompressedPtr<Node>::Compress(reinterpret_cast<Node*>(8)));
+}
+
+TEST_F(CompressedPtrTest, Vector) {
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::vector<Node*> raw;
+    for (int i = 0; i < 100; i++) {
+        nodes.emplace_back(std::make_unique<Node>(Node{i, nullptr}));
+        raw.emplace_back(nodes.back().get());
+    }
+
+    CompressedPtrVector<Node> vec;
+    EXPECT_TRUE(vec.empty());
+    for (size_t i = 0; i < 50; i++)
+        ASSERT_TRUE(vec.push_back(raw[i]));
+    ASSERT_EQ(vec.append(raw.data() + 50, 50), 0);
+    ASSERT_EQ(vec.size(), raw.size());
+    EXPECT_EQ(vec.front(), raw.front());
+    EXPECT_EQ(vec.back(), raw.back());
+
+    int expected = 0;
+    for (Node* node : vec)
+        EXPECT_EQ(node->value, expected++);
+    for (size_t i = 0; i < vec.size(); i++)
+        EXPECT_EQ(vec[i], raw[i]);
+    EXPECT_EQ(vec.end() - vec.begin(), 100);
+    EXPECT_EQ(vec.begin()[10], raw[10]);
+
+    std::vector<Node*> decoded(vec.size());
+    EXPECT_EQ(vec.decode(decoded.data()), 0);
+    EXPECT_EQ(decoded, raw);
+
+    ASSERT_TRUE(vec.set(0, raw[99]));
+    EXPECT_EQ(vec[0], raw[99]);
+    EXPECT_FALSE(vec.set(0, reinterpret_cast<Node*>(8)));
+    EXPECT_EQ(vec[0], raw[99]);
+    vec.pop_back();
+    EXPECT_EQ(vec.size(), 99);
+
+    // A failed append adds nothing.
+    Node* bad[] = {raw[0], reinterpret_cast<Node*>(8)};
+    EXPECT_EQ(vec.append(bad, 2), 1);
+    EXPECT_FALSE(vec.push_back(bad[1]));
+    EXPECT_EQ(vec.size(), 99);
+
+    vec.clear();
+    EXPECT_TRUE(vec.empty());
+}
+
+TEST_F(CompressedPtrTest, NullElements) {
+    auto node = std::make_unique<Node>();
+
+    CompressedPtrVector<Node> vec;
+    ASSERT_TRUE(vec.push_back(node.get()));
+    ASSERT_TRUE(vec.push_back(nullptr));
+    Node* batch[] = {nullptr, node.get()};
+    ASSERT_EQ(vec.append(batch, 2), 0);
+    EXPECT_EQ(vec[1], nullptr);
+
+    Node* decoded[4] = {};
+    EXPECT_EQ(vec.decode(decoded), 0);
+    EXPECT_EQ(decoded[0], node.get());
+    EXPECT_EQ(decoded[1], nullptr);
+    EXPECT_EQ(decoded[2], nullptr);
+    EXPECT_EQ(decoded[3], node.get());
+}
+
+TEST(CompressedPtrSize, AppendChecksSize) {
+    OnePagePlatform platform;
+    AddressDict dict(&platform);
+    SmallBinding::sDict = &dict;
+
+    // Only the first half of this Node is in the mapping.
+    auto partial = reinterpret_cast<Node*>(OnePagePlatform::kBase + 4096 - sizeof(Node) / 2);
+    auto whole = reinterpret_cast<Node*>(OnePagePlatform::kBase);
+
+    CompressedPtrVector<Node, SmallBinding> vec;
+    EXPECT_FALSE(vec.push_back(partial));
+    Node* batch[] = {whole, partial};
+    EXPECT_EQ(vec.append(batch, 2), 1);
+    EXPECT_TRUE(vec.empty());
+    EXPECT_EQ(vec.append(batch, 1), 0);
+    EXPECT_EQ(vec.size(), 1);
+
+    SmallBinding::sDict = nullptr;
+}
+
+TEST(CompressedPtrWide, Binding) {
+    static_assert(sizeof(CompressedPtr<Node, WideBinding>) == 6);
+
+    WideDict dict(IPlatform::GetDefault());
+    WideBinding::sDict = &dict;
+
+    auto node = std::make_unique<Node>(Node{3, nullptr});
+    CompressedPtr<Node, WideBinding> ptr(node.get());
+    EXPECT_EQ(ptr->value, 3);
+
+    CompressedPtrVector<Node, WideBinding> vec;
+    ASSERT_TRUE(vec.push_back(node.get()));
+    Node* decoded = nullptr;
+    EXPECT_EQ(vec.decode(&decoded), 0);
+    EXPECT_EQ(decoded, node.get());
+
+    WideBinding::sDict = nullptr;
+}
@@ -0,0 +1,497 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "concurrent_addrz.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <amtl/am-bits.h>
+
+namespace am {
+
+// Epoch-based reclamation. Each reading thread owns a slot, which holds the
+// global epoch it observed on entry, or 0 while it is not reading. A table
+// retired at epoch E can be freed once every slot is either 0 or >= E: those
+// readers observed the epoch after the new table was published, so they
+// cannot have loaded the old one.
+//
+// Slots are shared by all dictionaries. If they run out, readers fall back
+// to a shared counter, which blocks reclamation while it is non-zero.
+namespace {
+
+static constexpr size_t kMaxSlots = 256;
+
+struct alignas(64) EpochSlot {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> in_use;
+};
+
+std::atomic<uint64_t> sGlobalEpoch{1};
+std::atomic<size_t> sOverflowReaders{0};
+EpochSlot sSlots[kMaxSlots];
+
+class ThreadSlot {
+  public:
+    ThreadSlot() {
+        for (size_t i = 0; i < kMaxSlots; i++) {
+            bool expected = false;
+            if (sSlots[i].in_use.compare_exchange_strong(expected, true)) {
+                slot_ = &sSlots[i];
+                break;
+            }
+        }
+    }
+    ~ThreadSlot() {
+        if (slot_) {
+            slot_->epoch.store(0);
+            slot_->in_use.store(false);
+        }
+    }
+
+    EpochSlot* slot() const { return slot_; }
+    size_t depth = 0;
+
+  private:
+    EpochSlot* slot_ = nullptr;
+};
+
+thread_local ThreadSlot tThreadSlot;
+
+class ReadGuard {
+  public:
+    ReadGuard() {
+        if (tThreadSlot.depth++)
+            return;
+        if (EpochSlot* slot = tThreadSlot.slot())
+            slot->epoch.store(sGlobalEpoch.load());
+        else
+            sOverflowReaders.fetch_add(1);
+    }
+    ~ReadGuard() {
+        if (--tThreadSlot.depth)
+            return;
+        if (EpochSlot* slot = tThreadSlot.slot())
+            slot->epoch.store(0, std::memory_order_release);
+        else
+            sOverflowReaders.fetch_sub(1, std::memory_order_release);
+    }
+};
+
+// Returns the oldest epoch any reader may be using, or 0 if reclamation is
+// blocked.
+uint64_t OldestActiveEpoch() {
+    if (sOverflowReaders.load())
+        return 0;
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (const auto& slot : sSlots) {
+        uint64_t epoch = slot.epoch.load();
+        if (epoch)
+            oldest = std::min(oldest, epoch);
+    }
+    return oldest;
+}
+
+// Dictionary addresses can be reused, so memos are keyed by a unique id.
+std::atomic<uint64_t> sNextDictId{1};
+
+// Threads are spread over the stat shards round-robin.
+std::atomic<size_t> sNextStatShard{0};
+thread_local size_t tStatShard = sNextStatShard.fetch_add(1);
+
+} // anonymous namespace
+
+ConcurrentAddressDict::ConcurrentAddressDict(IPlatform* platform,
+                                             const AddressDictOptions& options)
+  : platform_(platform),
+    options_(options),
+    dict_id_(sNextDictId.fetch_add(1)),
+    generation_(1),
+    table_(new Table())
+{
+    if (!platform_)
+        platform_ = IPlatform::GetDefault();
+
+    // Nothing else is implemented, and ignoring an option would change which
+    // addresses get ids, or what they decode to.
+    assert(!options_.direct_map_decode && !options_.address_index);
+    assert(!options_.id_quarantine_ms && !options_.reserve_chunk_size);
+    assert(!options_.negative_cache_ttl_ms);
+    assert(!options_.required_prot && !options_.forbidden_prot && !options_.align_shift);
+    assert(options_.id_overflow == IdOverflow::TruncateFromStart);
+
+    // Start at the first valid page.
+    next_id_ = platform_->GetPageSize() - 1;
+    assert(next_id_ != 0);
+}
+
+ConcurrentAddressDict::~ConcurrentAddressDict() {
+    delete table_.load();
+    for (const auto& retired : retired_)
+        delete retired.table;
+}
+
+std::optional<uint32_t> ConcurrentAddressDict::Make32bitAddress(void* address, size_t nbytes) {
+    if (address == nullptr)
+        return {0};
+
+    uintptr_t value = reinterpret_cast<uintptr_t>(address);
+
+    // Read the generation before the table, so a memo can never be newer
+    // than the table it was filled from.
+    uint64_t generation = generation_.load(std::memory_order_acquire);
+    ThreadMemo* memo = nullptr;
+    if (options_.memoize_last_range) {
+        memo = GetMemo();
+        const Range& last = memo->compress;
+        if (memo->compress_generation == generation && last.map.owns(value) &&
+            (nbytes <= 1 || last.map.owns(value + nbytes - 1)))
+        {
+            Shard().compress_memo_hits.fetch_add(1, std::memory_order_relaxed);
+            return {last.id + uint32_t(value - last.map.start)};
+        }
+        Shard().compress_memo_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Range range;
+    bool found = false;
+    {
+        ReadGuard guard;
+        if (const Range* existing = table_.load()->FindForAddress(value, nbytes)) {
+            range = *existing;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Slow path. The platform query is the expensive part, and runs
+        // without any lock held.
+        if (!GetMapForAddress(value, nbytes, &range.map))
+            return {};
+
+        // Another thread may have registered it while we were querying, or
+        // be about to.
+        if (const auto existing = ClaimMapping(value, nbytes, range.map)) {
+            range = existing.value();
+            found = true;
+        }
+    }
+
+    if (!found) {
+        Mapping claimed = range.map;
+        bool reserved = true;
+        if (auto grown = GrowLastRange(range.map)) {
+            range = grown.value();
+        } else if ((reserved = ReserveIds(value, &range))) {
+            Publish([&range](Table* table) -> void {
+                // Reservations can be published out of order, so insert by id.
+                auto by_id = std::upper_bound(table->ranges.begin(), table->ranges.end(),
+                                              range,
+                                              [](const Range& a, const Range& b) -> bool {
+                    return a.id < b.id;
+                });
+                table->ranges.insert(by_id, range);
+                auto by_address = std::upper_bound(table->sorted_maps.begin(),
+                                                   table->sorted_maps.end(), range);
+                table->sorted_maps.insert(by_address, range);
+                table->longest = std::max(table->longest, range.map.size);
+            });
+        }
+        UnclaimMapping(claimed);
+        if (!reserved)
+            return {};
+    }
+
+    assert(range.map.owns(value));
+
+    if (!ke::IsUint32AddSafe(range.id, (value - range.map.start)))
+        return {};
+    if (memo && found) {
+        memo->compress = range;
+        memo->compress_generation = generation;
+    }
+    return {range.id + uint32_t(value - range.map.start)};
+}
+
+std::optional<void*> ConcurrentAddressDict::RecoverAddress(uint32_t id, size_t nbytes) {
+    uint64_t generation = generation_.load(std::memory_order_acquire);
+    ThreadMemo* memo = nullptr;
+    Range found;
+    const Range* range = nullptr;
+    if (options_.memoize_last_range) {
+        memo = GetMemo();
+        const Range& last = memo->recover;
+        if (memo->recover_generation == generation && id >= last.id && id < last.range_end()) {
+            Shard().recover_memo_hits.fetch_add(1, std::memory_order_relaxed);
+            range = &last;
+        } else {
+            Shard().recover_memo_misses.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (!range) {
+        ReadGuard guard;
+        const Range* existing = table_.load()->FindForId(id);
+        if (!existing)
+            return {};
+        found = *existing;
+        range = &found;
+        if (memo) {
+            memo->recover = found;
+            memo->recover_generation = generation;
+        }
+    }
+
+    uintptr_t address = range->map.start + (id - range->id);
+    if (address + nbytes > range->map.end())
+        return {};
+    return {reinterpret_cast<void*>(address)};
+}
+
+auto ConcurrentAddressDict::GetMemo() const -> ThreadMemo* {
+    static thread_local ThreadMemo tMemo;
+    if (tMemo.dict_id != dict_id_)
+        tMemo = ThreadMemo{dict_id_};
+    return &tMemo;
+}
+
+auto ConcurrentAddressDict::Shard() const -> StatShard& {
+    return stat_shards_[tStatShard % kStatShards];
+}
+
+AddressDictStats ConcurrentAddressDict::stats() const {
+    AddressDictStats stats;
+    for (const auto& shard : stat_shards_) {
+        stats.compress_memo_hits += shard.compress_memo_hits.load(std::memory_order_relaxed);
+        stats.compress_memo_misses += shard.compress_memo_misses.load(std::memory_order_relaxed);
+        stats.recover_memo_hits += shard.recover_memo_hits.load(std::memory_order_relaxed);
+        stats.recover_memo_misses += shard.recover_memo_misses.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+bool ConcurrentAddressDict::ReserveIds(uintptr_t value, Range* range) {
+    size_t size;
+    uint32_t start = next_id_.load();
+    do {
+        size = range->map.size;
+        if (size > std::numeric_limits<uint32_t>::max() || !ke::IsUint32AddSafe(start, size)) {
+            // Can we truncate the range to make room?
+            uint32_t remaining = std::numeric_limits<uint32_t>::max() - start;
+            if (remaining <= value - range->map.start)
+                return false;
+            size = remaining;
+        }
+    } while (!next_id_.compare_exchange_weak(start, uint32_t(start + size)));
+
+    range->id = start;
+    range->map.size = size;
+    return true;
+}
+
+// See AddressDict::GrowLastRange. The range with the highest id can only be
+// grown while next_id_ still ends it, so taking the new ids with a
+// compare-and-swap from its end also stops anyone else growing it.
+auto ConcurrentAddressDict::GrowLastRange(const Mapping& map) -> std::optional<Range> {
+    Range last;
+    {
+        ReadGuard guard;
+        const Table* current = table_.load();
+        if (current->ranges.empty())
+            return {};
+        last = current->ranges.back();
+    }
+    if (!last.map.owns(map.start) || map.end() <= last.map.end())
+        return {};
+
+    uint64_t growth = map.end() - last.map.end();
+    if (growth > std::numeric_limits<uint32_t>::max() - last.range_end())
+        return {};
+    uint32_t end = uint32_t(last.range_end());
+    if (!next_id_.compare_exchange_strong(end, uint32_t(end + growth)))
+        return {};
+
+    Range grown = last;
+    grown.map.Merge(map);
+    Publish([&grown](Table* table) -> void {
+        auto by_id = std::lower_bound(table->ranges.begin(), table->ranges.end(), grown,
+                                      [](const Range& a, const Range& b) -> bool {
+            return a.id < b.id;
+        });
+        assert(by_id != table->ranges.end() && by_id->id == grown.id);
+        by_id->map = grown.map;
+
+        // Growing in place keeps the start, so sorted_maps stays sorted.
+        auto by_address = std::lower_bound(table->sorted_maps.begin(),
+                                           table->sorted_maps.end(), grown);
+        while (by_address->id != grown.id)
+            by_address++;
+        by_address->map = grown.map;
+        table->longest = std::max(table->longest, grown.map.size);
+    });
+    return {grown};
+}
+
+// Publish a copy of the table with |edit| applied, retrying if another writer
+// publishes first.
+template <typename Func>
+void ConcurrentAddressDict::Publish(Func edit) {
+    while (true) {
+        ReadGuard guard;
+        const Table* current = table_.load();
+
+        auto table = new Table(*current);
+        edit(table);
+        if (table_.compare_exchange_strong(current, table)) {
+            generation_.fetch_add(1, std::memory_order_release);
+            Retire(current);
+            return;
+        }
+        delete table;
+    }
+}
+
+// Returns the range another writer published for |address| while we were
+// querying, waiting for it if the writer is still reserving ids. Otherwise,
+// |map| is claimed, and the caller must reserve and publish its range and
+// then unclaim it. Claims are what stop two writers reserving ids for the
+// same memory.
+std::optional<ConcurrentAddressDict::Range>
+ConcurrentAddressDict::ClaimMapping(uintptr_t address, size_t nbytes, const Mapping& map) {
+    std::unique_lock<std::mutex> lock(claim_lock_);
+    while (true) {
+        {
+            ReadGuard guard;
+            if (const Range* existing = table_.load()->FindForAddress(address, nbytes))
+                return {*existing};
+        }
+
+        bool overlaps = false;
+        for (const auto& claim : claims_) {
+            if (claim.start < map.end() && map.start < claim.end()) {
+                overlaps = true;
+                break;
+            }
+        }
+        if (!overlaps)
+            break;
+        claim_cv_.wait(lock);
+    }
+    claims_.emplace_back(map);
+    return {};
+}
+
+void ConcurrentAddressDict::UnclaimMapping(const Mapping& map) {
+    {
+        std::lock_guard<std::mutex> lock(claim_lock_);
+        auto iter = std::find_if(claims_.begin(), claims_.end(),
+                                 [&map](const Mapping& claim) -> bool {
+            return claim.start == map.start;
+        });
+        assert(iter != claims_.end());
+        claims_.erase(iter);
+    }
+    claim_cv_.notify_all();
+}
+
+void ConcurrentAddressDict::Retire(const Table* table) {
+    uint64_t epoch = sGlobalEpoch.fetch_add(1) + 1;
+
+    std::lock_guard<std::mutex> lock(retire_lock_);
+    retired_.emplace_back(Retired{table, epoch});
+
+    uint64_t oldest = OldestActiveEpoch();
+    auto first_kept = std::partition(retired_.begin(), retired_.end(),
+                                     [oldest](const Retired& retired) -> bool {
+        return retired.epoch <= oldest;
+    });
+    for (auto iter = retired_.begin(); iter != first_kept; iter++)
+        delete iter->table;
+    retired_.erase(retired_.begin(), first_kept);
+}
+
+// See AddressDict::GetMapForAddress.
+bool ConcurrentAddressDict::GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map) {
+    if (!platform_->GetAddressMapping(reinterpret_cast<void*>(address), map))
+        return false;
+
+    while (map->end() - address < nbytes) {
+        Mapping next;
+        if (!platform_->GetAddressMapping(reinterpret_cast<void*>(map->end()), &next))
+            return false;
+
+        assert(next.start <= map->end());
+        assert(next.end() > map->end());
+
+        map->Merge(next);
+    }
+    return true;
+}
+
+// See AddressDict::FindRangeCovering. Ranges can overlap, so look back
+// through the ones starting at or before |address| until none is long enough
+// to reach it.
+auto ConcurrentAddressDict::Table::FindForAddress(uintptr_t address, size_t nbytes) const
+    -> const Range*
+{
+    auto iter = std::upper_bound(sorted_maps.begin(), sorted_maps.end(), address,
+                                 [](uintptr_t address, const Range& range) -> bool {
+        return address < range.map.start;
+    });
+    while (iter != sorted_maps.begin()) {
+        --iter;
+        if (address - iter->map.start >= longest)
+            break;
+        if (iter->map.owns(address) && (nbytes <= 1 || iter->map.owns(address + nbytes - 1)))
+            return &*iter;
+    }
+    return nullptr;
+}
+
+auto ConcurrentAddressDict::Table::FindForId(uint32_t id) const -> const Range* {
+    size_t lower = 0;
+    size_t upper = ranges.size();
+    while (lower < upper) {
+        size_t mid = (lower + upper) / 2;
+        const auto& range = ranges[mid];
+        if (id < range.id) {
+            upper = mid;
+        } else if (id >= range.range_end()) {
+            lower = mid + 1;
+        } else {
+            return &range;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace am
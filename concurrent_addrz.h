@@ -0,0 +1,176 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "addrz.h"
+#include "mapping.h"
+#include "platform.h"
+
+namespace am {
+
+// A thread-safe AddressDict. Readers never block: RecoverAddress, and
+// Make32bitAddress when the address already has a range, look up an
+// immutable snapshot of the range tables. Old snapshots are reclaimed once no
+// reader can still be looking at them (epoch-based reclamation).
+//
+// Writers of different mappings do not block each other either. The platform
+// is queried without holding any lock, ids are reserved with an atomic bump of
+// next_id_, and the new range is published by swapping in a copy of the
+// snapshot with compare-and-swap. Before reserving, a writer claims the
+// mapping; a second writer for the same memory waits for the first to
+// publish and uses its range, so no ids are reserved twice.
+//
+// Single-threaded, and with the default options, ids are assigned the way
+// AddressDict assigns 32-bit ids: from the same first id, growing the most
+// recent range when a span runs past its end. Ranges are never released.
+//
+// Of AddressDictOptions, only memoize_last_range is supported, and the
+// constructor asserts that the rest are left at their defaults. The memo is
+// per-thread, so threads working in different mappings do not evict each
+// other's entries.
+class ConcurrentAddressDict final {
+  public:
+    ConcurrentAddressDict(IPlatform* platform = nullptr,
+                          const AddressDictOptions& options = {});
+    ~ConcurrentAddressDict();
+
+    ConcurrentAddressDict(const ConcurrentAddressDict&) = delete;
+    ConcurrentAddressDict& operator =(const ConcurrentAddressDict&) = delete;
+
+    // See AddressDict.
+    std::optional<uint32_t> Make32bitAddress(void* address, size_t nbytes = 0);
+    std::optional<void*> RecoverAddress(uint32_t id, size_t nbytes = 0);
+
+    std::optional<uint32_t> Make32bitAddress(uintptr_t address, size_t nbytes = 0) {
+        return Make32bitAddress(reinterpret_cast<void*>(address), nbytes);
+    }
+    std::optional<uintptr_t> RecoverAddressValue(uint32_t id, size_t nbytes = 0) {
+        if (auto val = RecoverAddress(id, nbytes); val)
+            return {reinterpret_cast<uintptr_t>(val.value())};
+        return {};
+    }
+
+    // Memo counters, summed over all threads.
+    AddressDictStats stats() const;
+
+  private:
+    struct Range {
+        Mapping map;
+        uint32_t id;
+
+        uint64_t range_end() const {
+            return uint64_t(id) + map.size;
+        }
+
+        bool operator <(const Range& other) const {
+            return map < other.map;
+        }
+    };
+
+    // Immutable once published.
+    struct Table {
+        // Sorted by id.
+        std::vector<Range> ranges;
+        // Sorted by start address. As in AddressDict, a range can overlap a
+        // longer one registered later for a span past its end.
+        std::vector<Range> sorted_maps;
+        // The size of the longest range, which bounds FindForAddress.
+        size_t longest = 0;
+
+        const Range* FindForAddress(uintptr_t address, size_t nbytes) const;
+        const Range* FindForId(uint32_t id) const;
+    };
+
+    struct Retired {
+        const Table* table;
+        uint64_t epoch;
+    };
+
+    // Ranges are copied out of the table, so a memo stays safe to read after
+    // the table it came from is reclaimed.
+    struct ThreadMemo {
+        uint64_t dict_id = 0;
+        uint64_t compress_generation = 0;
+        uint64_t recover_generation = 0;
+        Range compress;
+        Range recover;
+    };
+    ThreadMemo* GetMemo() const;
+
+    // Counters are sharded by thread, so threads do not all write the same
+    // cache line.
+    static constexpr size_t kStatShards = 16;
+    struct alignas(64) StatShard {
+        std::atomic<uint64_t> compress_memo_hits{0};
+        std::atomic<uint64_t> compress_memo_misses{0};
+        std::atomic<uint64_t> recover_memo_hits{0};
+        std::atomic<uint64_t> recover_memo_misses{0};
+    };
+    StatShard& Shard() const;
+
+    bool GetMapForAddress(uintptr_t address, size_t nbytes, Mapping* map);
+    bool ReserveIds(uintptr_t address, Range* range);
+    std::optional<Range> GrowLastRange(const Mapping& map);
+    template <typename Func>
+    void Publish(Func edit);
+    std::optional<Range> ClaimMapping(uintptr_t address, size_t nbytes, const Mapping& map);
+    void UnclaimMapping(const Mapping& map);
+    void Retire(const Table* table);
+
+  private:
+    IPlatform* platform_ = nullptr;
+    AddressDictOptions options_;
+    uint64_t dict_id_;
+    std::atomic<uint64_t> generation_;
+    std::atomic<const Table*> table_;
+    std::atomic<uint32_t> next_id_;
+
+    mutable StatShard stat_shards_[kStatShards];
+
+    // Mappings whose ids are being reserved. Never held across platform
+    // calls.
+    std::mutex claim_lock_;
+    std::condition_variable claim_cv_;
+    std::vector<Mapping> claims_;
+
+    // Protects retired_ only; never held across platform calls.
+    std::mutex retire_lock_;
+    std::vector<Retired> retired_;
+};
+
+} // namespace am
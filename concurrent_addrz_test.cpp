@@ -0,0 +1,360 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "concurrent_addrz.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "addrz.h"
+
+using namespace am;
+
+namespace {
+
+class SyntheticPlatform final : public IPlatform {
+  public:
+    static constexpr uintptr_t kBase = 0x10000000;
+    static constexpr uintptr_t kStride = 8192;
+    static constexpr size_t kSize = 4096;
+
+    explicit SyntheticPlatform(size_t count)
+      : count_(count)
+    {}
+
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        if (value < kBase)
+            return false;
+        size_t index = (value - kBase) / kStride;
+        if (index >= count_ || (value - kBase) % kStride >= kSize)
+            return false;
+        *map = Mapping{kBase + index * kStride, kSize};
+        return true;
+    }
+
+  private:
+    size_t count_;
+};
+
+// Records how many lookups are in flight at once.
+class SlowPlatform final : public IPlatform {
+  public:
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        size_t now = ++in_flight_;
+        size_t peak = peak_.load();
+        while (now > peak && !peak_.compare_exchange_weak(peak, now))
+            ;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        in_flight_--;
+
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        *map = Mapping{value & ~uintptr_t(0xffff), 0x10000};
+        return true;
+    }
+
+    size_t peak() const { return peak_; }
+
+  private:
+    std::atomic<size_t> in_flight_{0};
+    std::atomic<size_t> peak_{0};
+};
+
+// Reports every page as a mapping of its own, as a platform that does not
+// coalesce would.
+class PagePlatform final : public IPlatform {
+  public:
+    static constexpr uintptr_t kBase = 0x20000000;
+    static constexpr size_t kPages = 8;
+
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        if (value < kBase || value >= kBase + kPages * 4096)
+            return false;
+        *map = Mapping{value & ~uintptr_t(4095), 4096};
+        return true;
+    }
+};
+
+// Hands out 1GiB mappings, slowly, so that racing writers overlap.
+class HugePlatform final : public IPlatform {
+  public:
+    static constexpr uintptr_t kSize = uintptr_t(1) << 30;
+
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        uintptr_t value = reinterpret_cast<uintptr_t>(address);
+        *map = Mapping{value & ~(kSize - 1), kSize};
+        return true;
+    }
+};
+
+} // anonymous namespace
+
+TEST(ConcurrentAddressDict, MatchesAddressDict) {
+    SyntheticPlatform platform(100);
+    ConcurrentAddressDict cad(&platform);
+    AddressDict ad(&platform);
+
+    EXPECT_EQ(cad.Make32bitAddress(nullptr), std::optional<uint32_t>{0});
+    EXPECT_EQ(cad.Make32bitAddress(50), std::nullopt);
+    EXPECT_EQ(cad.RecoverAddress(912734873), std::nullopt);
+
+    for (size_t i = 0; i < 100; i++) {
+        uintptr_t address = SyntheticPlatform::kBase + ((i * 37) % 100) * 8192 + i;
+        auto id = cad.Make32bitAddress(address);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(id, ad.Make32bitAddress(address));
+        EXPECT_EQ(cad.RecoverAddressValue(id.value()), std::optional<uintptr_t>{address});
+    }
+
+    auto id = cad.Make32bitAddress(SyntheticPlatform::kBase);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_NE(cad.RecoverAddress(id.value(), 4096), std::nullopt);
+    EXPECT_EQ(cad.RecoverAddress(id.value(), 4097), std::nullopt);
+}
+
+TEST(ConcurrentAddressDict, MatchesAddressDictGrowing) {
+    PagePlatform platform;
+    ConcurrentAddressDict cad(&platform);
+    AddressDict ad(&platform);
+
+    // Each span runs one page further, growing the same range every time.
+    uintptr_t base = PagePlatform::kBase;
+    for (size_t i = 0; i < PagePlatform::kPages; i++) {
+        uintptr_t address = base + i * 4096 + 4000;
+        size_t nbytes = (i + 1 < PagePlatform::kPages) ? 200 : 0;
+        auto id = cad.Make32bitAddress(address, nbytes);
+        ASSERT_NE(id, std::nullopt);
+        EXPECT_EQ(id, ad.Make32bitAddress(address, nbytes));
+        EXPECT_EQ(cad.Make32bitAddress(base), ad.Make32bitAddress(base));
+    }
+
+    uintptr_t last = base + PagePlatform::kPages * 4096 - 1;
+    EXPECT_EQ(cad.RecoverAddressValue(cad.Make32bitAddress(base).value() + (last - base)),
+              std::optional<uintptr_t>{last});
+}
+
+TEST(ConcurrentAddressDict, Memo) {
+    SyntheticPlatform platform(100);
+    AddressDictOptions options;
+    options.memoize_last_range = true;
+    ConcurrentAddressDict cad(&platform, options);
+    AddressDict ad(&platform);
+
+    for (size_t i = 0; i < 100; i++) {
+        uintptr_t base = SyntheticPlatform::kBase + ((i * 37) % 100) * 8192;
+        for (size_t j = 0; j < 8; j++) {
+            auto id = cad.Make32bitAddress(base + j * 16);
+            ASSERT_NE(id, std::nullopt);
+            EXPECT_EQ(id, ad.Make32bitAddress(base + j * 16));
+            EXPECT_EQ(cad.RecoverAddressValue(id.value()),
+                      std::optional<uintptr_t>{base + j * 16});
+        }
+    }
+
+    auto stats = cad.stats();
+    EXPECT_EQ(stats.compress_memo_hits + stats.compress_memo_misses, 800);
+    EXPECT_GE(stats.compress_memo_hits, 600);
+    EXPECT_GE(stats.recover_memo_hits, 600);
+
+    // Other threads have their own memo, but count towards the same totals.
+    std::thread([&]() -> void {
+        EXPECT_NE(cad.Make32bitAddress(SyntheticPlatform::kBase), std::nullopt);
+    }).join();
+    EXPECT_EQ(cad.stats().compress_memo_misses, stats.compress_memo_misses + 1);
+
+    // A different dictionary does not see this one's memo, and using it
+    // does not reset this one's counters.
+    ConcurrentAddressDict other(&platform, options);
+    auto id = other.Make32bitAddress(SyntheticPlatform::kBase + 8192);
+    ASSERT_NE(id, std::nullopt);
+    EXPECT_EQ(other.stats().compress_memo_hits, 0);
+    EXPECT_EQ(other.stats().compress_memo_misses, 1);
+    EXPECT_NE(cad.Make32bitAddress(SyntheticPlatform::kBase + 16), std::nullopt);
+    EXPECT_EQ(cad.stats().compress_memo_hits + cad.stats().compress_memo_misses, 802);
+}
+
+TEST(ConcurrentAddressDict, Threads) {
+    static constexpr size_t kRanges = 2000;
+    static constexpr size_t kThreads = 8;
+
+    SyntheticPlatform platform(kRanges);
+    ConcurrentAddressDict cad(&platform);
+
+    // Every thread registers and decodes every range, in a different order,
+    // so threads race on both registration and lookups.
+    // Coprime with kRanges, so each thread visits every range.
+    static constexpr size_t kSteps[kThreads] = {1, 3, 7, 11, 13, 17, 19, 23};
+
+    std::vector<std::unique_ptr<uint32_t[]>> ids;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> errors{0};
+    for (size_t t = 0; t < kThreads; t++)
+        ids.emplace_back(new uint32_t[kRanges]);
+    for (size_t t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() -> void {
+            for (size_t i = 0; i < kRanges; i++) {
+                size_t index = (i * kSteps[t] + t * 97) % kRanges;
+                uintptr_t address = SyntheticPlatform::kBase + index * 8192 + t;
+                auto id = cad.Make32bitAddress(address);
+                if (!id || cad.RecoverAddressValue(id.value()) != address) {
+                    errors++;
+                    continue;
+                }
+                ids[t][index] = id.value() - t;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    ASSERT_EQ(errors, 0);
+
+    // Threads agree on the range for each mapping.
+    for (size_t i = 0; i < kRanges; i++) {
+        for (size_t t = 1; t < kThreads; t++)
+            ASSERT_EQ(ids[t][i], ids[0][i]);
+    }
+}
+
+TEST(ConcurrentAddressDict, ConcurrentWriters) {
+    static constexpr size_t kThreads = 4;
+
+    SlowPlatform platform;
+    ConcurrentAddressDict cad(&platform);
+
+    // Half the threads race on one mapping, the rest have their own.
+    std::vector<std::thread> threads;
+    std::vector<uint32_t> ids(kThreads);
+    for (size_t t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() -> void {
+            uintptr_t base = (t % 2) ? 0x100000 : 0x200000 + t * 0x10000;
+            ids[t] = cad.Make32bitAddress(base + 0x10).value_or(0);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // Platform queries overlapped instead of queueing behind a lock.
+    EXPECT_GT(platform.peak(), 1);
+
+    // The racing threads agreed on a single range.
+    EXPECT_NE(ids[1], 0);
+    EXPECT_EQ(ids[1], ids[3]);
+    for (size_t t = 0; t < kThreads; t++) {
+        uintptr_t base = (t % 2) ? 0x100000 : 0x200000 + t * 0x10000;
+        EXPECT_EQ(cad.RecoverAddressValue(ids[t]), std::optional<uintptr_t>{base + 0x10});
+    }
+}
+
+TEST(ConcurrentAddressDict, RacesKeepIds) {
+    static constexpr size_t kThreads = 8;
+    static constexpr size_t kMappings = 3;
+
+    // Three of these nearly fill the id space, so a single duplicate
+    // reservation leaves the last mapping truncated.
+    HugePlatform platform;
+    ConcurrentAddressDict cad(&platform);
+
+    std::vector<std::thread> threads;
+    std::vector<std::vector<uint32_t>> ids(kThreads, std::vector<uint32_t>(kMappings));
+    for (size_t t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() -> void {
+            // Start on different mappings, so that duplicate reservations
+            // could not simply be wound back.
+            for (size_t n = 0; n < kMappings; n++) {
+                size_t i = (n + t) % kMappings;
+                uintptr_t address = (i + 1) * HugePlatform::kSize + 0x10;
+                ids[t][i] = cad.Make32bitAddress(address).value_or(0);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < kMappings; i++) {
+        ASSERT_NE(ids[0][i], 0);
+        for (size_t t = 1; t < kThreads; t++)
+            EXPECT_EQ(ids[t][i], ids[0][i]);
+
+        uintptr_t last = (i + 2) * HugePlatform::kSize - 1;
+        EXPECT_EQ(cad.RecoverAddressValue(ids[0][i] - 0x10 + HugePlatform::kSize - 1),
+                  std::optional<uintptr_t>{last});
+    }
+}
+
+TEST(ConcurrentAddressDict, SpanCrossesRangeEnd) {
+    PagePlatform platform;
+    ConcurrentAddressDict cad(&platform);
+    AddressDict ad(&platform);
+    uintptr_t base = PagePlatform::kBase;
+
+    auto both = [&](uintptr_t address, size_t nbytes) -> std::optional<uint32_t> {
+        auto id = cad.Make32bitAddress(address, nbytes);
+        EXPECT_EQ(id, ad.Make32bitAddress(address, nbytes));
+        if (id) {
+            EXPECT_EQ(cad.RecoverAddressValue(id.value(), nbytes),
+                      std::optional<uintptr_t>{address});
+        }
+        return id;
+    };
+
+    auto first = both(base + 100, 0);
+    ASSERT_NE(first, std::nullopt);
+
+    // A span past the end of the most recent range grows it in place.
+    EXPECT_EQ(both(base + 4000, 200), first.value() + 3900);
+    EXPECT_EQ(both(base + 4096 + 8, 0), first.value() + 4004);
+
+    // Behind another range, the span needs a range of its own. Looking it up
+    // again finds that range rather than reserving more ids.
+    auto other = both(base + 4 * 4096, 0);
+    ASSERT_NE(other, std::nullopt);
+    auto behind = both(base + 2 * 4096 - 8, 16);
+    ASSERT_NE(behind, std::nullopt);
+    EXPECT_EQ(both(base + 2 * 4096 - 8, 16), behind);
+    EXPECT_EQ(both(base + 100, 0), first);
+    EXPECT_EQ(both(base + 4 * 4096, 0), other);
+
+    // No ids were spent twice, so the next range still matches.
+    EXPECT_NE(both(base + 6 * 4096, 0), std::nullopt);
+}
@@ -12,4 +12,8 @@ except:
     sys.exit(1)
 
 builder = run.BuildParser(sourcePath = sys.path[0], api=API_VERSION)
+builder.options.add_argument('--enable-mmap-interpose', action='store_true', default=False,
+                             dest='mmap_interpose',
+                             help='Interpose mmap, munmap, mremap, brk and sbrk to feed '
+                                  'MmapTracker')
 builder.Configure()
@@ -0,0 +1,116 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "id_table.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+namespace am {
+
+IdPageTable::IdPageTable(uint32_t page_shift)
+  : page_shift_(page_shift)
+{
+    assert(page_shift_ < 32);
+
+    uint32_t page_bits = 32 - page_shift_;
+    leaf_bits_ = std::min(page_bits, kLeafBits);
+    leaf_mask_ = (uint32_t(1) << leaf_bits_) - 1;
+    leaves_.resize(size_t(1) << (page_bits - leaf_bits_));
+    leaf_counts_.resize(leaves_.size());
+}
+
+IdPageTable::~IdPageTable()
+{}
+
+void IdPageTable::Add(uint32_t index, uint32_t start, uint64_t end) {
+    Update(index, start, end, Mode::Add);
+}
+
+void IdPageTable::Set(uint32_t index, uint32_t start, uint64_t end) {
+    Update(index, start, end, Mode::Set);
+}
+
+void IdPageTable::Remove(uint32_t index, uint32_t start, uint64_t end) {
+    Update(index, start, end, Mode::Remove);
+}
+
+void IdPageTable::Update(uint32_t index, uint32_t start, uint64_t end, Mode mode) {
+    if (end <= start)
+        return;
+
+    uint64_t first_page = start >> page_shift_;
+    uint64_t last_page = (end - 1) >> page_shift_;
+    for (uint64_t page = first_page; page <= last_page; page++) {
+        size_t leaf_index = size_t(page >> leaf_bits_);
+        auto& leaf = leaves_[leaf_index];
+        if (!leaf) {
+            if (mode == Mode::Remove)
+                continue;
+            leaf.reset(new uint32_t[leaf_mask_ + 1]);
+            std::fill(leaf.get(), leaf.get() + leaf_mask_ + 1, kNone);
+            num_leaves_++;
+        }
+
+        uint32_t& entry = leaf[page & leaf_mask_];
+        uint32_t& count = leaf_counts_[leaf_index];
+        switch (mode) {
+            case Mode::Add:
+                if (entry == kNone) {
+                    entry = index + 1;
+                    count++;
+                }
+                break;
+            case Mode::Set:
+                if (entry == kNone)
+                    count++;
+                entry = index + 1;
+                break;
+            case Mode::Remove:
+                if (entry == index + 1) {
+                    entry = kNone;
+                    if (--count == 0) {
+                        leaf = nullptr;
+                        num_leaves_--;
+                    }
+                }
+                break;
+        }
+    }
+}
+
+void IdPageTable::Clear() {
+    for (auto& leaf : leaves_)
+        leaf = nullptr;
+    std::fill(leaf_counts_.begin(), leaf_counts_.end(), 0);
+    num_leaves_ = 0;
+}
+
+} // namespace am
@@ -0,0 +1,113 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+namespace am {
+
+// Maps each page of the 32-bit id space to the first range that overlaps it,
+// so that decoding an id is a shift and two loads instead of a binary search.
+// Since ranges are not page-aligned in id space, a page can overlap more than
+// one range; callers step forward from the returned index until they reach
+// the range containing the id.
+//
+// The table has two levels, and leaves are only allocated for pages that
+// have ids assigned, and freed once none do, so memory use is proportional to
+// the id space in use.
+class IdPageTable final {
+  public:
+    static constexpr uint32_t kNone = 0;
+    static constexpr uint32_t kLeafBits = 10;
+
+    explicit IdPageTable(uint32_t page_shift);
+    ~IdPageTable();
+
+    // Record range |index| as covering ids [start, end). Pages that already
+    // have an earlier range keep it.
+    void Add(uint32_t index, uint32_t start, uint64_t end);
+
+    // As above, but range |index| replaces whatever the pages held. This is
+    // for a range inserted among existing ones, on pages where it is known to
+    // be the first.
+    void Set(uint32_t index, uint32_t start, uint64_t end);
+
+    // Clear the pages overlapping [start, end) that hold range |index|.
+    void Remove(uint32_t index, uint32_t start, uint64_t end);
+
+    void Clear();
+
+    // Number of leaves allocated.
+    size_t num_leaves() const { return num_leaves_; }
+
+    // Returns the index of the first range overlapping |id|'s page, plus one,
+    // or kNone.
+    uint32_t Lookup(uint32_t id) const {
+        uint32_t page = id >> page_shift_;
+        const uint32_t* leaf = leaves_[page >> leaf_bits_].get();
+        if (!leaf)
+            return kNone;
+        return leaf[page & leaf_mask_];
+    }
+
+    // As above, with the page size known at compile time. It must match the
+    // table's.
+    template <uint32_t PageShift>
+    uint32_t Lookup(uint32_t id) const {
+        static constexpr uint32_t kPageBits = 32 - PageShift;
+        static constexpr uint32_t kBits = kPageBits < kLeafBits ? kPageBits : kLeafBits;
+        static constexpr uint32_t kMask = (uint32_t(1) << kBits) - 1;
+
+        uint32_t page = id >> PageShift;
+        const uint32_t* leaf = leaves_[page >> kBits].get();
+        if (!leaf)
+            return kNone;
+        return leaf[page & kMask];
+    }
+
+  private:
+    enum class Mode { Add, Set, Remove };
+    void Update(uint32_t index, uint32_t start, uint64_t end, Mode mode);
+
+  private:
+    uint32_t page_shift_;
+    uint32_t leaf_bits_;
+    uint32_t leaf_mask_;
+    std::vector<std::unique_ptr<uint32_t[]>> leaves_;
+    // Pages in use in each leaf.
+    std::vector<uint32_t> leaf_counts_;
+    size_t num_leaves_ = 0;
+};
+
+} // namespace am
@@ -0,0 +1,120 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "id_table.h"
+
+#include <gtest/gtest.h>
+
+using namespace am;
+
+TEST(IdPageTable, Empty) {
+    IdPageTable table(12);
+    EXPECT_EQ(table.Lookup(0), IdPageTable::kNone);
+    EXPECT_EQ(table.Lookup(0xffffffff), IdPageTable::kNone);
+}
+
+TEST(IdPageTable, Ranges) {
+    IdPageTable table(12);
+    table.Add(0, 4095, 4095 + 8192);
+    table.Add(1, 4095 + 8192, 4095 + 8192 + 100);
+    table.Add(2, 4095 + 8192 + 100, 0x100000000ull);
+
+    EXPECT_EQ(table.Lookup(0), 1);
+    EXPECT_EQ(table.Lookup(4095), 1);
+    EXPECT_EQ(table.Lookup(8192), 1);
+    EXPECT_EQ(table.Lookup(12287), 1);
+
+    // This page starts in range 1, so it points there even though most of
+    // its ids belong to range 2.
+    EXPECT_EQ(table.Lookup(12288), 2);
+    EXPECT_EQ(table.Lookup(16383), 2);
+
+    EXPECT_EQ(table.Lookup(16384), 3);
+    EXPECT_EQ(table.Lookup(0xffffffff), 3);
+
+    table.Clear();
+    EXPECT_EQ(table.Lookup(4095), IdPageTable::kNone);
+}
+
+TEST(IdPageTable, LargePages) {
+    IdPageTable table(24);
+    table.Add(0, 0, 1);
+    EXPECT_EQ(table.Lookup(0xffffff), 1);
+    EXPECT_EQ(table.Lookup(0x1000000), IdPageTable::kNone);
+}
+
+TEST(IdPageTable, SetAndRemove) {
+    IdPageTable table(12);
+    table.Add(0, 0, 4096 + 100);
+    table.Add(1, 3 * 4096, 4 * 4096);
+
+    // Range 2 is inserted between them, on a page where it comes first.
+    table.Set(2, 2 * 4096, 3 * 4096);
+    EXPECT_EQ(table.Lookup(4096), 1);
+    EXPECT_EQ(table.Lookup(2 * 4096), 3);
+    EXPECT_EQ(table.Lookup(3 * 4096), 2);
+
+    // Only pages holding the removed range are cleared.
+    table.Remove(0, 0, 4096 + 100);
+    EXPECT_EQ(table.Lookup(0), IdPageTable::kNone);
+    EXPECT_EQ(table.Lookup(4096), IdPageTable::kNone);
+    table.Remove(1, 2 * 4096, 4 * 4096);
+    EXPECT_EQ(table.Lookup(2 * 4096), 3);
+    EXPECT_EQ(table.Lookup(3 * 4096), IdPageTable::kNone);
+
+    // Nothing was ever added up here.
+    table.Remove(0, 0xf0000000, 0xf0001000);
+    EXPECT_EQ(table.Lookup(0xf0000000), IdPageTable::kNone);
+}
+
+TEST(IdPageTable, FreesEmptyLeaves) {
+    IdPageTable table(12);
+    EXPECT_EQ(table.num_leaves(), 0);
+
+    // 1024 pages per leaf: the first range spans two leaves.
+    table.Add(0, 1000 * 4096, 1100 * 4096);
+    table.Add(1, 5000 * 4096, 5001 * 4096);
+    EXPECT_EQ(table.num_leaves(), 3);
+
+    table.Remove(1, 5000 * 4096, 5001 * 4096);
+    EXPECT_EQ(table.num_leaves(), 2);
+    EXPECT_EQ(table.Lookup(5000 * 4096), IdPageTable::kNone);
+
+    // A leaf is kept while any of its pages is in use.
+    table.Set(2, 1050 * 4096, 1051 * 4096);
+    table.Remove(0, 1000 * 4096, 1100 * 4096);
+    EXPECT_EQ(table.num_leaves(), 1);
+    EXPECT_EQ(table.Lookup(1050 * 4096), 3);
+    table.Remove(2, 1050 * 4096, 1051 * 4096);
+    EXPECT_EQ(table.num_leaves(), 0);
+
+    table.Add(3, 0, 4096);
+    EXPECT_EQ(table.Lookup(0), 4);
+    EXPECT_EQ(table.num_leaves(), 1);
+}
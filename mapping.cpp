@@ -32,16 +32,40 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 
 namespace am {
 
-void SortAndCoalesceMaps(std::vector<Mapping>& maps) {
+void Mapping::Merge(const Mapping& next) {
+    assert(next.start <= end());
+
+    if (next.end() > end())
+        size = next.end() - start;
+    if ((prot | next.prot) & kProtUnknown)
+        prot = kProtUnknown;
+    else
+        prot &= next.prot;
+    if (path_id != next.path_id)
+        path_id = 0;
+}
+
+bool CanCoalesce(const Mapping& map, const Mapping& next, Coalesce coalesce) {
+    if (next.start != map.end())
+        return false;
+    return coalesce == Coalesce::Adjacent || map.SameAttributes(next);
+}
+
+void SortAndCoalesceMaps(std::vector<Mapping>& maps, Coalesce coalesce) {
     std::sort(maps.begin(), maps.end());
 
     size_t cursor = 0;
     for (size_t i = 1; i < maps.size(); i++) {
-        if (maps[i].start == maps[cursor].end()) {
-            maps[cursor].size += maps[i].size;
+        if (CanCoalesce(maps[cursor], maps[i], coalesce)) {
+            maps[cursor].Merge(maps[i]);
         } else {
             maps[++cursor] = maps[i];
         }
@@ -78,4 +102,46 @@ std::optional<size_t> FindAddressInMap(const std::vector<Mapping>& maps, void* a
     return {};
 }
 
+namespace {
+
+struct PathTable {
+    std::mutex lock;
+    // Indexed by id - 1. A deque never moves its elements, so the views in
+    // |ids| and the pointers from GetInternedPath stay valid.
+    std::deque<std::string> paths;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+PathTable& Paths() {
+    static PathTable sPaths;
+    return sPaths;
+}
+
+} // anonymous namespace
+
+uint32_t InternPath(const char* path, size_t length) {
+    if (!length)
+        return 0;
+
+    auto& table = Paths();
+    std::lock_guard<std::mutex> lock(table.lock);
+    if (auto it = table.ids.find(std::string_view(path, length)); it != table.ids.end())
+        return it->second;
+
+    const std::string& text = table.paths.emplace_back(path, length);
+    uint32_t id = uint32_t(table.paths.size());
+    table.ids.emplace(text, id);
+    return id;
+}
+
+const char* GetInternedPath(uint32_t path_id) {
+    if (!path_id)
+        return nullptr;
+
+    auto& table = Paths();
+    std::lock_guard<std::mutex> lock(table.lock);
+    assert(path_id <= table.paths.size());
+    return table.paths[path_id - 1].c_str();
+}
+
 } // namespace am
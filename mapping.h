@@ -37,9 +37,22 @@
 
 namespace am {
 
+// Bits for Mapping::prot. The first four have the same values as the
+// kernel's PROCMAP_QUERY_VMA_* flags.
+static constexpr uint8_t kProtRead = 0x1;
+static constexpr uint8_t kProtWrite = 0x2;
+static constexpr uint8_t kProtExec = 0x4;
+static constexpr uint8_t kProtShared = 0x8;
+// The platform did not report permissions. No other bits are set.
+static constexpr uint8_t kProtUnknown = 0x80;
+
 struct Mapping {
     uintptr_t start;
     size_t size;
+    // Backing file or pseudo-path such as [heap], from InternPath, or 0 if
+    // the mapping is anonymous or the platform did not report one.
+    uint32_t path_id = 0;
+    uint8_t prot = kProtUnknown;
 
     uintptr_t end() const { return start + size; }
 
@@ -50,13 +63,39 @@ struct Mapping {
         return address >= start && address < end();
     }
 
+    bool SameAttributes(const Mapping& other) const {
+        return prot == other.prot && path_id == other.path_id;
+    }
+
+    // Grow to cover |next|, which must start at or before end(). Attributes
+    // that differ are combined conservatively: only the permissions both
+    // have, and no path.
+    void Merge(const Mapping& next);
+
     bool operator <(const Mapping& other) const {
         return start < other.start;
     }
 };
 
-void SortAndCoalesceMaps(std::vector<Mapping>& map);
+// How to coalesce adjacent mappings: regardless of attributes, or only when
+// their permissions and paths match.
+enum class Coalesce {
+    Adjacent,
+    SameAttributes
+};
+
+bool CanCoalesce(const Mapping& map, const Mapping& next, Coalesce coalesce);
+
+void SortAndCoalesceMaps(std::vector<Mapping>& map, Coalesce coalesce = Coalesce::Adjacent);
 std::optional<size_t> FindAddressInSortedMap(const std::vector<Mapping>& maps, void* address);
 std::optional<size_t> FindAddressInMap(const std::vector<Mapping>& maps, void* address);
 
+// Return a process-wide id for |path|, the same for every call with the same
+// text. The empty path is 0. Ids are never reused.
+uint32_t InternPath(const char* path, size_t length);
+
+// Return the text for an id from InternPath, or nullptr for 0. The pointer
+// is valid for the life of the process.
+const char* GetInternedPath(uint32_t path_id);
+
 } // namespace am
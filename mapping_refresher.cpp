@@ -0,0 +1,250 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "mapping_refresher.h"
+
+#include <algorithm>
+
+#if !defined(_WIN32)
+# include <pthread.h>
+#endif
+
+namespace am {
+
+// Running refreshers, so the fork handlers can find them.
+static std::mutex sRegistryLock;
+static std::vector<MappingRefresher*> sRegistry;
+
+MappingRefresher::MappingRefresher(IPlatform* platform, std::chrono::milliseconds interval)
+  : platform_(platform),
+    interval_(interval)
+{
+    if (!platform_)
+        platform_ = IPlatform::GetDefault();
+
+#if !defined(_WIN32)
+    static std::once_flag sForkHandlers;
+    std::call_once(sForkHandlers, []() -> void {
+        pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+    });
+#endif
+}
+
+MappingRefresher::~MappingRefresher() {
+    Stop();
+}
+
+bool MappingRefresher::Start() {
+    if (running())
+        return true;
+    if (!Scan())
+        return false;
+
+    std::lock_guard<std::mutex> registry(sRegistryLock);
+    std::lock_guard<std::mutex> lock(lock_);
+    if (thread_)
+        return true;
+
+    stop_ = false;
+    wake_ = false;
+    thread_ = std::make_unique<std::thread>([this]() -> void {
+        ThreadMain();
+    });
+    sRegistry.emplace_back(this);
+    return true;
+}
+
+void MappingRefresher::Stop() {
+    std::unique_ptr<std::thread> thread;
+    {
+        std::lock_guard<std::mutex> registry(sRegistryLock);
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!thread_)
+            return;
+        stop_ = true;
+        thread = std::move(thread_);
+        sRegistry.erase(std::remove(sRegistry.begin(), sRegistry.end(), this), sRegistry.end());
+    }
+    cv_.notify_all();
+    thread->join();
+}
+
+bool MappingRefresher::running() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return !!thread_;
+}
+
+MappingRefresherStats MappingRefresher::stats() const {
+    MappingRefresherStats stats;
+    stats.snapshot_hits = snapshot_hits_.load(std::memory_order_relaxed);
+    stats.fallbacks = fallbacks_.load(std::memory_order_relaxed);
+    stats.scans = scans_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+int MappingRefresher::GetPageSize() {
+    return platform_->GetPageSize();
+}
+
+bool MappingRefresher::GetAddressMapping(void* address, Mapping* map) {
+    if (auto maps = snapshot()) {
+        if (auto it = FindAddressInSortedMap(*maps, address)) {
+            *map = (*maps)[it.value()];
+            snapshot_hits_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // Either the address is bad, or the snapshot is behind. Answer now, and
+    // have the thread catch up.
+    fallbacks_.fetch_add(1, std::memory_order_relaxed);
+    Wake();
+    return platform_->GetAddressMapping(address, map);
+}
+
+void MappingRefresher::InvalidateMappings() {
+    if (running())
+        Wake();
+    else
+        platform_->InvalidateMappings();
+}
+
+bool MappingRefresher::RefreshMappings() {
+    return Scan();
+}
+
+bool MappingRefresher::GetAllMappings(std::vector<Mapping>* maps) {
+    if (auto snapshot = this->snapshot()) {
+        *maps = *snapshot;
+        return true;
+    }
+    return platform_->GetAllMappings(maps);
+}
+
+void MappingRefresher::ThreadMain() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stop_) {
+        cv_.wait_for(lock, interval_, [this]() -> bool {
+            return stop_ || wake_;
+        });
+        if (stop_)
+            break;
+        wake_ = false;
+
+        lock.unlock();
+        Scan();
+        lock.lock();
+    }
+}
+
+bool MappingRefresher::Scan() {
+    std::lock_guard<std::mutex> scan(scan_lock_);
+
+    auto maps = std::make_shared<std::vector<Mapping>>();
+    platform_->InvalidateMappings();
+    if (!platform_->GetAllMappings(maps.get()))
+        return false;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    snapshot_ = std::move(maps);
+    scans_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void MappingRefresher::Wake() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!thread_ || wake_)
+            return;
+        wake_ = true;
+    }
+    cv_.notify_one();
+}
+
+auto MappingRefresher::snapshot() -> std::shared_ptr<const std::vector<Mapping>> {
+    std::lock_guard<std::mutex> lock(lock_);
+    return snapshot_;
+}
+
+// Refreshers can share a platform, whose locks must only be taken once.
+bool MappingRefresher::FirstWithPlatform(size_t index) {
+    for (size_t i = 0; i < index; i++) {
+        if (sRegistry[i]->platform_ == sRegistry[index]->platform_)
+            return false;
+    }
+    return true;
+}
+
+// Scans take the platform's locks under scan_lock_, so those go last.
+void MappingRefresher::PrepareFork() {
+    sRegistryLock.lock();
+    for (auto refresher : sRegistry) {
+        refresher->scan_lock_.lock();
+        refresher->lock_.lock();
+    }
+    for (size_t i = 0; i < sRegistry.size(); i++) {
+        if (FirstWithPlatform(i))
+            sRegistry[i]->platform_->LockForFork();
+    }
+}
+
+void MappingRefresher::ParentAfterFork() {
+    for (size_t i = sRegistry.size(); i-- > 0;) {
+        if (FirstWithPlatform(i))
+            sRegistry[i]->platform_->UnlockAfterFork();
+    }
+    for (auto iter = sRegistry.rbegin(); iter != sRegistry.rend(); iter++) {
+        (*iter)->lock_.unlock();
+        (*iter)->scan_lock_.unlock();
+    }
+    sRegistryLock.unlock();
+}
+
+void MappingRefresher::ChildAfterFork() {
+    for (size_t i = sRegistry.size(); i-- > 0;) {
+        if (FirstWithPlatform(i))
+            sRegistry[i]->platform_->UnlockAfterFork();
+    }
+    for (auto iter = sRegistry.rbegin(); iter != sRegistry.rend(); iter++) {
+        auto refresher = *iter;
+
+        // The thread was not copied into the child, so there is nothing to
+        // join, and destroying the std::thread would terminate.
+        refresher->thread_.release();
+        refresher->wake_ = false;
+        refresher->stop_ = false;
+
+        refresher->lock_.unlock();
+        refresher->scan_lock_.unlock();
+    }
+    sRegistry.clear();
+    sRegistryLock.unlock();
+}
+
+} // namespace am
@@ -0,0 +1,124 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mapping.h"
+#include "platform.h"
+
+namespace am {
+
+struct MappingRefresherStats {
+    // Lookups answered from the snapshot.
+    uint64_t snapshot_hits = 0;
+    // Lookups that missed the snapshot and queried the platform directly.
+    uint64_t fallbacks = 0;
+    // Snapshots taken.
+    uint64_t scans = 0;
+};
+
+// A platform that answers lookups from a snapshot of the address space,
+// which a background thread keeps up to date. The thread re-scans every
+// |interval|, and as soon as InvalidateMappings is called. Lookups that miss
+// the snapshot fall back to the underlying platform on the calling thread,
+// and wake the refresher.
+//
+// The underlying platform must support GetAllMappings.
+//
+// In a forked child the refresher thread does not exist. The child keeps the
+// last snapshot, and falls back to the underlying platform, until Start is
+// called again. Lookups fall back without any of the refresher's locks, so
+// the fork handlers also hold the underlying platform's, through
+// IPlatform::LockForFork.
+class MappingRefresher final : public IPlatform {
+  public:
+    explicit MappingRefresher(IPlatform* platform = nullptr,
+                              std::chrono::milliseconds interval = std::chrono::seconds(1));
+    ~MappingRefresher();
+
+    MappingRefresher(const MappingRefresher&) = delete;
+    MappingRefresher& operator =(const MappingRefresher&) = delete;
+
+    // Take a snapshot and start the refresher thread. Returns false if the
+    // underlying platform cannot enumerate its mappings.
+    bool Start();
+    void Stop();
+    bool running();
+
+    MappingRefresherStats stats() const;
+
+    int GetPageSize() override;
+    bool GetAddressMapping(void* address, Mapping* map) override;
+    void InvalidateMappings() override;
+    bool RefreshMappings() override;
+    bool GetAllMappings(std::vector<Mapping>* maps) override;
+
+  private:
+    void ThreadMain();
+    bool Scan();
+    void Wake();
+    std::shared_ptr<const std::vector<Mapping>> snapshot();
+
+    static bool FirstWithPlatform(size_t index);
+    static void PrepareFork();
+    static void ParentAfterFork();
+    static void ChildAfterFork();
+
+  private:
+    IPlatform* platform_;
+    std::chrono::milliseconds interval_;
+
+    // Held for a whole scan, so that fork() cannot happen in the middle of
+    // one, with the underlying platform's locks held.
+    std::mutex scan_lock_;
+
+    // Protects everything below.
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::shared_ptr<const std::vector<Mapping>> snapshot_;
+    std::unique_ptr<std::thread> thread_;
+    bool wake_ = false;
+    bool stop_ = false;
+
+    std::atomic<uint64_t> snapshot_hits_{0};
+    std::atomic<uint64_t> fallbacks_{0};
+    std::atomic<uint64_t> scans_{0};
+};
+
+} // namespace am
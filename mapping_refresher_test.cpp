@@ -0,0 +1,216 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "mapping_refresher.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#if !defined(_WIN32)
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+#include "addrz.h"
+#if defined(__linux__)
+# include "platform_linux.h"
+#endif
+
+using namespace am;
+
+namespace {
+
+class ListPlatform final : public IPlatform {
+  public:
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        std::lock_guard<std::mutex> lock(lock_);
+        lookups_++;
+        auto it = FindAddressInMap(maps_, address);
+        if (!it)
+            return false;
+        *map = maps_[it.value()];
+        return true;
+    }
+
+    bool GetAllMappings(std::vector<Mapping>* maps) override {
+        std::lock_guard<std::mutex> lock(lock_);
+        *maps = maps_;
+        SortAndCoalesceMaps(*maps);
+        return true;
+    }
+
+    void AddMapping(uintptr_t start, size_t size) {
+        std::lock_guard<std::mutex> lock(lock_);
+        maps_.emplace_back(Mapping{start, size});
+    }
+
+    size_t lookups() {
+        std::lock_guard<std::mutex> lock(lock_);
+        return lookups_;
+    }
+
+  private:
+    std::mutex lock_;
+    std::vector<Mapping> maps_;
+    size_t lookups_ = 0;
+};
+
+// Wait for the refresher thread to take at least |scans| snapshots.
+bool WaitForScans(MappingRefresher* refresher, uint64_t scans) {
+    for (size_t i = 0; i < 500; i++) {
+        if (refresher->stats().scans >= scans)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+TEST(MappingRefresher, ServesSnapshot) {
+    ListPlatform platform;
+    platform.AddMapping(65536, 4096);
+    platform.AddMapping(65536 * 2, 4096);
+
+    MappingRefresher refresher(&platform, std::chrono::hours(1));
+    ASSERT_TRUE(refresher.Start());
+    EXPECT_TRUE(refresher.running());
+    EXPECT_EQ(refresher.stats().scans, 1);
+
+    AddressDict ad(&refresher);
+    for (size_t i = 0; i < 10; i++) {
+        EXPECT_NE(ad.Make32bitAddress(65536 + i), std::nullopt);
+        EXPECT_NE(ad.Make32bitAddress(65536 * 2 + i), std::nullopt);
+    }
+    EXPECT_EQ(platform.lookups(), 0);
+    EXPECT_EQ(refresher.stats().snapshot_hits, 2);
+
+    // A new mapping is answered by the platform, and wakes the thread.
+    platform.AddMapping(65536 * 3, 4096);
+    EXPECT_NE(ad.Make32bitAddress(65536 * 3), std::nullopt);
+    EXPECT_EQ(refresher.stats().fallbacks, 1);
+    EXPECT_TRUE(WaitForScans(&refresher, 2));
+
+    platform.AddMapping(65536 * 4, 4096);
+    refresher.InvalidateMappings();
+    EXPECT_TRUE(WaitForScans(&refresher, 3));
+
+    size_t lookups = platform.lookups();
+    EXPECT_NE(ad.Make32bitAddress(65536 * 4), std::nullopt);
+    EXPECT_EQ(platform.lookups(), lookups);
+
+    refresher.Stop();
+    EXPECT_FALSE(refresher.running());
+    refresher.Stop();
+}
+
+TEST(MappingRefresher, Periodic) {
+    ListPlatform platform;
+    platform.AddMapping(65536, 4096);
+
+    MappingRefresher refresher(&platform, std::chrono::milliseconds(1));
+    ASSERT_TRUE(refresher.Start());
+    EXPECT_TRUE(WaitForScans(&refresher, 5));
+}
+
+#if !defined(_WIN32)
+TEST(MappingRefresher, Fork) {
+    ListPlatform platform;
+    platform.AddMapping(65536, 4096);
+
+    MappingRefresher refresher(&platform, std::chrono::milliseconds(1));
+    ASSERT_TRUE(refresher.Start());
+
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+        // The thread is gone, but the snapshot is still usable, and the
+        // refresher can be restarted.
+        Mapping map;
+        bool ok = !refresher.running() &&
+                  refresher.GetAddressMapping(reinterpret_cast<void*>(65536), &map) &&
+                  refresher.Start() &&
+                  WaitForScans(&refresher, refresher.stats().scans + 2);
+        refresher.Stop();
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+    EXPECT_TRUE(refresher.running());
+}
+#endif
+
+#if defined(__linux__)
+TEST(MappingRefresher, ForkDuringFallback) {
+    // Every miss re-reads /proc/self/maps with the platform's lock held.
+    LinuxPlatform platform(LinuxPlatform::Mode::Snapshot);
+    MappingRefresher refresher(&platform, std::chrono::seconds(60));
+    ASSERT_TRUE(refresher.Start());
+
+    std::atomic<bool> done{false};
+    std::thread misses([&]() -> void {
+        while (!done) {
+            Mapping map;
+            refresher.GetAddressMapping(reinterpret_cast<void*>(4096), &map);
+        }
+    });
+
+    while (refresher.stats().fallbacks < 10)
+        std::this_thread::yield();
+
+    // The child must not inherit the platform's lock held by that thread.
+    for (size_t i = 0; i < 300; i++) {
+        pid_t pid = fork();
+        ASSERT_NE(pid, -1);
+        if (pid == 0) {
+            alarm(10);
+            Mapping map;
+            _exit(platform.GetAddressMapping(&map, &map) ? 0 : 1);
+        }
+
+        int status;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(WEXITSTATUS(status), 0);
+    }
+
+    done = true;
+    misses.join();
+}
+#endif
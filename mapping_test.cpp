@@ -51,6 +51,47 @@ TEST(mapping, SortAndCoalesce) {
     EXPECT_EQ(maps[2].size, 10);
 }
 
+TEST(mapping, CoalesceSameAttributes) {
+    uint32_t lib = InternPath("/lib.so", 7);
+    std::vector<Mapping> maps = {
+        {0x1000, 0x1000, lib, kProtRead | kProtExec},
+        {0x2000, 0x1000, lib, kProtRead},
+        {0x3000, 0x1000, lib, kProtRead},
+        {0x4000, 0x1000, 0, kProtRead},
+    };
+
+    std::vector<Mapping> same = maps;
+    SortAndCoalesceMaps(same, Coalesce::SameAttributes);
+    ASSERT_EQ(same.size(), 3);
+    EXPECT_EQ(same[1].start, 0x2000);
+    EXPECT_EQ(same[1].size, 0x2000);
+    EXPECT_EQ(same[1].path_id, lib);
+    EXPECT_EQ(same[1].prot, kProtRead);
+
+    // Merging keeps only what every piece has in common.
+    SortAndCoalesceMaps(maps);
+    ASSERT_EQ(maps.size(), 1);
+    EXPECT_EQ(maps[0].size, 0x4000);
+    EXPECT_EQ(maps[0].path_id, 0);
+    EXPECT_EQ(maps[0].prot, kProtRead);
+
+    Mapping unknown{0x5000, 0x1000};
+    maps[0].Merge(unknown);
+    EXPECT_EQ(maps[0].size, 0x5000);
+    EXPECT_EQ(maps[0].prot, kProtUnknown);
+}
+
+TEST(mapping, InternPath) {
+    uint32_t a = InternPath("/usr/lib/libc.so.6", 18);
+    uint32_t b = InternPath("/usr/lib/libc.so.6 trailing", 18);
+    EXPECT_NE(a, 0);
+    EXPECT_EQ(a, b);
+    EXPECT_NE(InternPath("[heap]", 6), a);
+    EXPECT_EQ(InternPath("", 0), 0);
+    EXPECT_STREQ(GetInternedPath(a), "/usr/lib/libc.so.6");
+    EXPECT_EQ(GetInternedPath(0), nullptr);
+}
+
 TEST(mapping, FindSorted) {
     std::vector<Mapping> maps = {
         {90000, 10},
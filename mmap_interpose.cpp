@@ -0,0 +1,254 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Interposes mmap, munmap, mremap, brk and sbrk to feed MmapTracker. Only
+// built with ADDRZ_MMAP_INTERPOSE, since defining these symbols replaces them
+// for the whole process.
+//
+// No lock is held across the real calls. Instead, memory stops being tracked
+// before the call that unmaps it, so a mapping another thread then makes in
+// its place is always recorded afterward. Unmap callbacks run once the call
+// has returned.
+
+#include "mmap_tracker.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace am {
+
+namespace {
+
+std::atomic<MmapTracker*> sTracker{nullptr};
+
+struct Event {
+    enum Kind { Map, Unmapping, Unmapped, Remapped, Brk } kind;
+    void* address;
+    size_t size;
+    void* new_address;
+    size_t new_size;
+};
+
+// Applying an event can allocate, and the allocator can map memory. Events
+// raised while one is being applied are queued and applied afterward, in
+// order, rather than re-entering the tracker.
+static constexpr size_t kMaxPendingEvents = 32;
+
+thread_local bool tApplying = false;
+thread_local size_t tNumPending = 0;
+thread_local Event tPending[kMaxPendingEvents];
+
+void Apply(MmapTracker* tracker, const Event& event) {
+    switch (event.kind) {
+        case Event::Map:
+            tracker->NotifyMap(event.address, event.size);
+            break;
+        case Event::Unmapping:
+            tracker->NotifyUnmapping(event.address, event.size);
+            break;
+        case Event::Unmapped:
+            tracker->NotifyUnmapped(event.address, event.size);
+            break;
+        case Event::Remapped:
+            tracker->NotifyRemapped(event.address, event.size, event.new_address,
+                                    event.new_size);
+            break;
+        case Event::Brk:
+            tracker->NotifyBrk(event.address, event.new_address);
+            break;
+    }
+}
+
+void Record(const Event& event) {
+    MmapTracker* tracker = sTracker.load(std::memory_order_acquire);
+    if (!tracker)
+        return;
+
+    if (tApplying) {
+        if (tNumPending < kMaxPendingEvents)
+            tPending[tNumPending++] = event;
+        else
+            tracker->NoteDroppedEvent();
+        return;
+    }
+
+    tApplying = true;
+    Apply(tracker, event);
+    for (size_t i = 0; i < tNumPending; i++)
+        Apply(tracker, tPending[i]);
+    tNumPending = 0;
+    tApplying = false;
+}
+
+// The whole pages given back by moving the break down from |old_end| to
+// |new_end|.
+Event BrkRelease(Event::Kind kind, void* old_end, void* new_end) {
+    uintptr_t page_mask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+    uintptr_t start = (reinterpret_cast<uintptr_t>(new_end) + page_mask) & ~page_mask;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(old_end) + page_mask) & ~page_mask;
+    return Event{kind, reinterpret_cast<void*>(start), end - start, nullptr, 0};
+}
+
+// The tracker whose lock the fork handlers hold.
+MmapTracker* sForkTracker = nullptr;
+
+// The real functions. glibc's own allocations do not go through these
+// symbols, so looking them up cannot recurse into the wrappers.
+template <typename T>
+T Next(std::atomic<T>& cache, const char* name) {
+    T fn = cache.load(std::memory_order_relaxed);
+    if (!fn) {
+        fn = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+        cache.store(fn, std::memory_order_relaxed);
+    }
+    return fn;
+}
+
+using MmapFn = void* (*)(void*, size_t, int, int, int, off_t);
+using MunmapFn = int (*)(void*, size_t);
+using MremapFn = void* (*)(void*, size_t, size_t, int, ...);
+using BrkFn = int (*)(void*);
+using SbrkFn = void* (*)(intptr_t);
+
+std::atomic<MmapFn> sMmap{nullptr};
+std::atomic<MunmapFn> sMunmap{nullptr};
+std::atomic<MremapFn> sMremap{nullptr};
+std::atomic<BrkFn> sBrk{nullptr};
+std::atomic<SbrkFn> sSbrk{nullptr};
+
+} // anonymous namespace
+
+bool MmapTracker::Install(MmapTracker* tracker) {
+    static std::once_flag sForkHandlers;
+    std::call_once(sForkHandlers, []() -> void {
+        pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+    });
+
+    sTracker.store(tracker, std::memory_order_release);
+    return true;
+}
+
+// A fork while another thread is recording an event would leave the lock
+// held in the child, and the child's next mmap would block on it forever.
+void MmapTracker::PrepareFork() {
+    sForkTracker = sTracker.load(std::memory_order_acquire);
+    if (sForkTracker)
+        sForkTracker->lock_.lock();
+}
+
+void MmapTracker::ParentAfterFork() {
+    if (sForkTracker)
+        sForkTracker->lock_.unlock();
+}
+
+void MmapTracker::ChildAfterFork() {
+    if (sForkTracker)
+        sForkTracker->lock_.unlock();
+}
+
+} // namespace am
+
+using namespace am;
+
+extern "C" {
+
+void* mmap(void* address, size_t size, int prot, int flags, int fd, off_t offset) {
+    void* result = Next(sMmap, "mmap")(address, size, prot, flags, fd, offset);
+    if (result != MAP_FAILED)
+        Record(Event{Event::Map, result, size, nullptr, 0});
+    return result;
+}
+
+int munmap(void* address, size_t size) {
+    Record(Event{Event::Unmapping, address, size, nullptr, 0});
+    int result = Next(sMunmap, "munmap")(address, size);
+    Record(Event{result == 0 ? Event::Unmapped : Event::Map, address, size, nullptr, 0});
+    return result;
+}
+
+void* mremap(void* old_address, size_t old_size, size_t new_size, int flags, ...) {
+    void* fixed_address = nullptr;
+    if (flags & MREMAP_FIXED) {
+        va_list ap;
+        va_start(ap, flags);
+        fixed_address = va_arg(ap, void*);
+        va_end(ap);
+    }
+
+    Record(Event{Event::Unmapping, old_address, old_size, nullptr, 0});
+    void* result = Next(sMremap, "mremap")(old_address, old_size, new_size, flags,
+                                           fixed_address);
+    if (result != MAP_FAILED)
+        Record(Event{Event::Remapped, old_address, old_size, result, new_size});
+    else
+        Record(Event{Event::Map, old_address, old_size, nullptr, 0});
+    return result;
+}
+
+int brk(void* end) {
+    void* old_end = Next(sSbrk, "sbrk")(0);
+    if (reinterpret_cast<uintptr_t>(end) >= reinterpret_cast<uintptr_t>(old_end)) {
+        int result = Next(sBrk, "brk")(end);
+        if (result == 0)
+            Record(Event{Event::Brk, old_end, 0, end, 0});
+        return result;
+    }
+
+    Record(BrkRelease(Event::Unmapping, old_end, end));
+    int result = Next(sBrk, "brk")(end);
+    Record(BrkRelease(result == 0 ? Event::Unmapped : Event::Map, old_end, end));
+    return result;
+}
+
+void* sbrk(intptr_t increment) {
+    if (increment >= 0) {
+        void* old_end = Next(sSbrk, "sbrk")(increment);
+        if (old_end != reinterpret_cast<void*>(-1) && increment) {
+            void* new_end = reinterpret_cast<char*>(old_end) + increment;
+            Record(Event{Event::Brk, old_end, 0, new_end, 0});
+        }
+        return old_end;
+    }
+
+    void* old_end = Next(sSbrk, "sbrk")(0);
+    void* new_end = reinterpret_cast<char*>(old_end) + increment;
+    Record(BrkRelease(Event::Unmapping, old_end, new_end));
+    void* result = Next(sSbrk, "sbrk")(increment);
+    bool ok = result != reinterpret_cast<void*>(-1);
+    Record(BrkRelease(ok ? Event::Unmapped : Event::Map, old_end, new_end));
+    return result;
+}
+
+} // extern "C"
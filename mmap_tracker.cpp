@@ -0,0 +1,289 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "mmap_tracker.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <amtl/am-bits.h>
+
+namespace am {
+
+MmapTracker::MmapTracker(IPlatform* platform, bool strict)
+  : platform_(platform),
+    strict_(strict)
+{
+    if (!platform_)
+        platform_ = IPlatform::GetDefault();
+
+    int page_size = platform_->GetPageSize();
+    assert(ke::IsPowerOfTwo(page_size));
+    page_mask_ = uintptr_t(page_size) - 1;
+}
+
+bool MmapTracker::Seed() {
+    std::vector<Mapping> snapshot;
+    platform_->InvalidateMappings();
+    if (!platform_->GetAllMappings(&snapshot))
+        return false;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    maps_.clear();
+    for (const auto& map : snapshot)
+        AddRegion(map.start, map.end());
+    return true;
+}
+
+void MmapTracker::NotifyMap(void* address, size_t size) {
+    uintptr_t start = PageAlignDown(reinterpret_cast<uintptr_t>(address));
+    uintptr_t end = PageAlignUp(reinterpret_cast<uintptr_t>(address) + size);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    AddRegion(start, end);
+    events_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MmapTracker::NotifyUnmap(void* address, size_t size) {
+    NotifyUnmapping(address, size);
+    NotifyUnmapped(address, size);
+}
+
+void MmapTracker::NotifyUnmapping(void* address, size_t size) {
+    uintptr_t start = PageAlignDown(reinterpret_cast<uintptr_t>(address));
+    uintptr_t end = PageAlignUp(reinterpret_cast<uintptr_t>(address) + size);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    RemoveRegion(start, end);
+    events_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MmapTracker::NotifyUnmapped(void* address, size_t size) {
+    uintptr_t start = PageAlignDown(reinterpret_cast<uintptr_t>(address));
+    uintptr_t end = PageAlignUp(reinterpret_cast<uintptr_t>(address) + size);
+    Unmapped(start, end);
+}
+
+void MmapTracker::NotifyRemap(void* old_address, size_t old_size, void* new_address,
+                              size_t new_size)
+{
+    uintptr_t old_start = PageAlignDown(reinterpret_cast<uintptr_t>(old_address));
+    uintptr_t old_end = PageAlignUp(reinterpret_cast<uintptr_t>(old_address) + old_size);
+    uintptr_t new_start = PageAlignDown(reinterpret_cast<uintptr_t>(new_address));
+    uintptr_t new_end = PageAlignUp(reinterpret_cast<uintptr_t>(new_address) + new_size);
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        RemoveRegion(old_start, old_end);
+        AddRegion(new_start, new_end);
+        events_.fetch_add(1, std::memory_order_relaxed);
+    }
+    RemappedAway(old_start, old_end, new_start, new_end);
+}
+
+void MmapTracker::NotifyRemapped(void* old_address, size_t old_size, void* new_address,
+                                 size_t new_size)
+{
+    uintptr_t old_start = PageAlignDown(reinterpret_cast<uintptr_t>(old_address));
+    uintptr_t old_end = PageAlignUp(reinterpret_cast<uintptr_t>(old_address) + old_size);
+    uintptr_t new_start = PageAlignDown(reinterpret_cast<uintptr_t>(new_address));
+    uintptr_t new_end = PageAlignUp(reinterpret_cast<uintptr_t>(new_address) + new_size);
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        AddRegion(new_start, new_end);
+        events_.fetch_add(1, std::memory_order_relaxed);
+    }
+    RemappedAway(old_start, old_end, new_start, new_end);
+}
+
+void MmapTracker::NotifyBrk(void* old_end, void* new_end) {
+    uintptr_t old_value = PageAlignUp(reinterpret_cast<uintptr_t>(old_end));
+    uintptr_t new_value = PageAlignUp(reinterpret_cast<uintptr_t>(new_end));
+    if (new_value > old_value) {
+        std::lock_guard<std::mutex> lock(lock_);
+        AddRegion(old_value, new_value);
+        events_.fetch_add(1, std::memory_order_relaxed);
+    } else if (new_value < old_value) {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            RemoveRegion(new_value, old_value);
+            events_.fetch_add(1, std::memory_order_relaxed);
+        }
+        Unmapped(new_value, old_value);
+    }
+}
+
+void MmapTracker::SetUnmapCallback(UnmapCallback callback, void* data) {
+    std::lock_guard<std::mutex> lock(lock_);
+    unmap_callback_ = callback;
+    unmap_data_ = data;
+}
+
+void MmapTracker::NoteDroppedEvent() {
+    dropped_events_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MmapTrackerStats MmapTracker::stats() const {
+    MmapTrackerStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.fallbacks = fallbacks_.load(std::memory_order_relaxed);
+    stats.events = events_.load(std::memory_order_relaxed);
+    stats.dropped_events = dropped_events_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+int MmapTracker::GetPageSize() {
+    return int(page_mask_ + 1);
+}
+
+bool MmapTracker::GetAddressMapping(void* address, Mapping* map) {
+    uintptr_t value = reinterpret_cast<uintptr_t>(address);
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto it = maps_.upper_bound(value);
+        if (it != maps_.begin()) {
+            --it;
+            if (value < it->second) {
+                map->start = it->first;
+                map->size = it->second - it->first;
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    if (strict_)
+        return false;
+    fallbacks_.fetch_add(1, std::memory_order_relaxed);
+    return platform_->GetAddressMapping(address, map);
+}
+
+bool MmapTracker::RefreshMappings() {
+    return Seed();
+}
+
+bool MmapTracker::GetAllMappings(std::vector<Mapping>* maps) {
+    std::lock_guard<std::mutex> lock(lock_);
+    maps->clear();
+    maps->reserve(maps_.size());
+    for (const auto& [start, end] : maps_)
+        maps->emplace_back(Mapping{start, end - start});
+    return true;
+}
+
+// Add [start, end), merging it with any mapping it overlaps or touches.
+void MmapTracker::AddRegion(uintptr_t start, uintptr_t end) {
+    if (end <= start)
+        return;
+
+    auto it = maps_.lower_bound(start);
+    if (it != maps_.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            maps_.erase(prev);
+        }
+    }
+    while (it != maps_.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = maps_.erase(it);
+    }
+    maps_.emplace_hint(it, start, end);
+}
+
+// Remove [start, end), splitting any mapping it lands inside of.
+void MmapTracker::RemoveRegion(uintptr_t start, uintptr_t end) {
+    if (end <= start)
+        return;
+
+    auto it = maps_.lower_bound(start);
+    if (it != maps_.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second > start) {
+            uintptr_t prev_end = prev->second;
+            prev->second = start;
+            if (prev_end > end) {
+                maps_.emplace_hint(it, end, prev_end);
+                return;
+            }
+        }
+    }
+    while (it != maps_.end() && it->first < end) {
+        if (it->second > end) {
+            uintptr_t tail_end = it->second;
+            it = maps_.erase(it);
+            maps_.emplace_hint(it, end, tail_end);
+            break;
+        }
+        it = maps_.erase(it);
+    }
+}
+
+void MmapTracker::Unmapped(uintptr_t start, uintptr_t end) {
+    UnmapCallback callback;
+    void* data;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        callback = unmap_callback_;
+        data = unmap_data_;
+    }
+    if (callback && end > start)
+        callback(data, start, end - start);
+}
+
+// Whatever the new mapping does not cover is gone.
+void MmapTracker::RemappedAway(uintptr_t old_start, uintptr_t old_end, uintptr_t new_start,
+                               uintptr_t new_end)
+{
+    if (new_start > old_start)
+        Unmapped(old_start, std::min(old_end, new_start));
+    if (new_end < old_end)
+        Unmapped(std::max(old_start, new_end), old_end);
+}
+
+uintptr_t MmapTracker::PageAlignDown(uintptr_t address) const {
+    return address & ~page_mask_;
+}
+
+// Saturates instead of wrapping at the top of the address space.
+uintptr_t MmapTracker::PageAlignUp(uintptr_t address) const {
+    if (address > std::numeric_limits<uintptr_t>::max() - page_mask_)
+        return std::numeric_limits<uintptr_t>::max() & ~page_mask_;
+    return (address + page_mask_) & ~page_mask_;
+}
+
+#if !defined(ADDRZ_MMAP_INTERPOSE)
+bool MmapTracker::Install(MmapTracker* tracker) {
+    return false;
+}
+#endif
+
+} // namespace am
@@ -0,0 +1,141 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "mapping.h"
+#include "platform.h"
+
+namespace am {
+
+struct MmapTrackerStats {
+    // Lookups answered from the tracked mappings.
+    uint64_t hits = 0;
+    // Lookups that missed and were passed to the underlying platform.
+    uint64_t fallbacks = 0;
+    // Map, unmap, remap and brk notifications applied.
+    uint64_t events = 0;
+    // Notifications lost because the interposer could not queue them.
+    uint64_t dropped_events = 0;
+};
+
+// A platform that follows the address space by being told about changes to
+// it, rather than reading /proc. It is seeded from an underlying platform,
+// then kept current by the Notify calls, which can come from the process's
+// own mmap wrappers or, with Install, from interposed mmap, munmap, mremap,
+// brk and sbrk.
+//
+// Interposition only sees calls made through those symbols. On glibc, malloc
+// and the dynamic loader map memory internally, so by default a lookup that
+// misses the tracked mappings is passed to the underlying platform. In
+// |strict| mode, a miss fails instead, and nothing reads /proc after seeding.
+//
+// Tracked mappings are coalesced like SortAndCoalesceMaps.
+class MmapTracker final : public IPlatform {
+  public:
+    explicit MmapTracker(IPlatform* platform = nullptr, bool strict = false);
+
+    // Replace the tracked mappings with the underlying platform's. Returns
+    // false if it cannot enumerate them.
+    bool Seed();
+
+    void NotifyMap(void* address, size_t size);
+    void NotifyUnmap(void* address, size_t size);
+    void NotifyRemap(void* old_address, size_t old_size, void* new_address, size_t new_size);
+    void NotifyBrk(void* old_end, void* new_end);
+
+    // The calls above report changes after they happen. If another thread
+    // can map the same addresses in the meantime, its mapping may be
+    // reported first and then lost. Wrappers that race like this report
+    // NotifyUnmapping before the munmap or mremap call, then NotifyUnmapped
+    // or NotifyRemapped once it succeeds, or NotifyMap if it fails.
+    void NotifyUnmapping(void* address, size_t size);
+    void NotifyUnmapped(void* address, size_t size);
+    void NotifyRemapped(void* old_address, size_t old_size, void* new_address, size_t new_size);
+
+    // Called after memory is unmapped, on the unmapping thread and without
+    // the tracker's lock held. This can drive AddressDict::ReleaseRanges;
+    // the callback must provide any locking the dictionary needs.
+    using UnmapCallback = void (*)(void* data, uintptr_t start, size_t size);
+    void SetUnmapCallback(UnmapCallback callback, void* data);
+
+    // Feed |tracker| from interposed mmap, munmap, mremap, brk and sbrk, or
+    // stop if it is nullptr. Interposition must be enabled at build time
+    // (ADDRZ_MMAP_INTERPOSE); otherwise this returns false. No lock is held
+    // across the real calls, and unmap callbacks run after them.
+    static bool Install(MmapTracker* tracker);
+
+    // Count a notification the interposer had to drop.
+    void NoteDroppedEvent();
+
+    MmapTrackerStats stats() const;
+
+    int GetPageSize() override;
+    bool GetAddressMapping(void* address, Mapping* map) override;
+    bool RefreshMappings() override;
+    bool GetAllMappings(std::vector<Mapping>* maps) override;
+
+  private:
+    void AddRegion(uintptr_t start, uintptr_t end);
+    void RemoveRegion(uintptr_t start, uintptr_t end);
+    void Unmapped(uintptr_t start, uintptr_t end);
+    void RemappedAway(uintptr_t old_start, uintptr_t old_end, uintptr_t new_start,
+                      uintptr_t new_end);
+
+    static void PrepareFork();
+    static void ParentAfterFork();
+    static void ChildAfterFork();
+    uintptr_t PageAlignDown(uintptr_t address) const;
+    uintptr_t PageAlignUp(uintptr_t address) const;
+
+  private:
+    IPlatform* platform_;
+    bool strict_;
+    uintptr_t page_mask_;
+
+    mutable std::mutex lock_;
+    // Start -> end of each mapping. Disjoint and never adjacent.
+    std::map<uintptr_t, uintptr_t> maps_;
+    UnmapCallback unmap_callback_ = nullptr;
+    void* unmap_data_ = nullptr;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> fallbacks_{0};
+    std::atomic<uint64_t> events_{0};
+    std::atomic<uint64_t> dropped_events_{0};
+};
+
+} // namespace am
@@ -0,0 +1,354 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "mmap_tracker.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#if defined(ADDRZ_MMAP_INTERPOSE)
+# include <sys/mman.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+#include "addrz.h"
+
+using namespace am;
+
+namespace {
+
+class SeedPlatform final : public IPlatform {
+  public:
+    int GetPageSize() override { return 4096; }
+
+    bool GetAddressMapping(void* address, Mapping* map) override {
+        lookups_++;
+        auto it = FindAddressInMap(maps_, address);
+        if (!it)
+            return false;
+        *map = maps_[it.value()];
+        return true;
+    }
+
+    bool GetAllMappings(std::vector<Mapping>* maps) override {
+        *maps = maps_;
+        SortAndCoalesceMaps(*maps);
+        return true;
+    }
+
+    void AddMapping(uintptr_t start, size_t size) {
+        maps_.emplace_back(Mapping{start, size});
+    }
+
+    size_t lookups() const { return lookups_; }
+
+  private:
+    std::vector<Mapping> maps_;
+    size_t lookups_ = 0;
+};
+
+void* Ptr(uintptr_t value) {
+    return reinterpret_cast<void*>(value);
+}
+
+using Spans = std::vector<std::pair<uintptr_t, size_t>>;
+
+Spans AllMappings(MmapTracker* tracker) {
+    std::vector<Mapping> maps;
+    tracker->GetAllMappings(&maps);
+
+    Spans spans;
+    for (const auto& map : maps)
+        spans.emplace_back(map.start, map.size);
+    return spans;
+}
+
+} // anonymous namespace
+
+TEST(MmapTracker, IntervalSet) {
+    SeedPlatform platform;
+    platform.AddMapping(65536, 8192);
+    platform.AddMapping(65536 + 8192, 4096);
+
+    MmapTracker tracker(&platform, true);
+    ASSERT_TRUE(tracker.Seed());
+    ASSERT_EQ(AllMappings(&tracker), (Spans{{65536, 12288}}));
+
+    // Punch a hole, then fill part of it back in.
+    tracker.NotifyUnmap(Ptr(65536 + 4096), 4096);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536, 4096}, {65536 + 8192, 4096}}));
+    tracker.NotifyMap(Ptr(65536 + 4096), 100);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536, 12288}}));
+
+    // Unmapping across several mappings.
+    tracker.NotifyMap(Ptr(131072), 4096);
+    tracker.NotifyMap(Ptr(196608), 4096);
+    tracker.NotifyMap(Ptr(262144), 4096);
+    tracker.NotifyUnmap(Ptr(65536 + 8192), 196608 - 65536 - 8192 + 2048);
+    tracker.NotifyUnmap(Ptr(262144), 4096);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536, 8192}}));
+
+    // Moving and growing.
+    tracker.NotifyRemap(Ptr(65536), 8192, Ptr(262144), 16384);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{262144, 16384}}));
+
+    tracker.NotifyBrk(Ptr(262144 + 16384 - 10), Ptr(262144 + 20000));
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{262144, 20480}}));
+    tracker.NotifyBrk(Ptr(262144 + 20000), Ptr(262144 + 100));
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{262144, 4096}}));
+    EXPECT_EQ(tracker.stats().events, 10);
+}
+
+TEST(MmapTracker, Lookups) {
+    SeedPlatform platform;
+    platform.AddMapping(65536, 8192);
+    platform.AddMapping(131072, 4096);
+
+    MmapTracker tracker(&platform);
+    ASSERT_TRUE(tracker.Seed());
+
+    Mapping map;
+    ASSERT_TRUE(tracker.GetAddressMapping(Ptr(65536 + 5000), &map));
+    EXPECT_EQ(map.start, 65536);
+    EXPECT_EQ(map.size, 8192);
+    EXPECT_EQ(platform.lookups(), 0);
+
+    // Unmapped memory is gone, even though the seed platform still has it.
+    tracker.NotifyUnmap(Ptr(131072), 4096);
+    MmapTracker strict(&platform, true);
+    ASSERT_TRUE(strict.Seed());
+    strict.NotifyUnmap(Ptr(131072), 4096);
+    EXPECT_FALSE(strict.GetAddressMapping(Ptr(131072), &map));
+    EXPECT_EQ(platform.lookups(), 0);
+
+    // Without strict, misses fall back.
+    EXPECT_TRUE(tracker.GetAddressMapping(Ptr(131072), &map));
+    EXPECT_EQ(platform.lookups(), 1);
+    EXPECT_EQ(tracker.stats().fallbacks, 1);
+    EXPECT_EQ(tracker.stats().hits, 1);
+}
+
+TEST(MmapTracker, RetiresRanges) {
+    SeedPlatform platform;
+    platform.AddMapping(65536, 8192);
+    platform.AddMapping(131072, 4096);
+
+    MmapTracker tracker(&platform, true);
+    ASSERT_TRUE(tracker.Seed());
+
+    AddressDict ad(&tracker);
+    tracker.SetUnmapCallback([](void* data, uintptr_t start, size_t size) -> void {
+        static_cast<AddressDict*>(data)->ReleaseRanges(start, size);
+    }, &ad);
+
+    auto id = ad.Make32bitAddress(65536 + 12);
+    ASSERT_NE(id, std::nullopt);
+    auto id2 = ad.Make32bitAddress(131072);
+    ASSERT_NE(id2, std::nullopt);
+
+    tracker.NotifyUnmap(Ptr(65536 + 4096), 4096);
+    EXPECT_EQ(ad.num_ranges(), 1);
+    EXPECT_EQ(ad.RecoverAddress(id.value()), std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(id2.value()), 131072);
+
+    // The part still mapped gets a new range.
+    auto id3 = ad.Make32bitAddress(65536 + 12);
+    ASSERT_NE(id3, std::nullopt);
+    EXPECT_EQ(ad.RecoverAddressValue(id3.value(), 4096 - 12), 65536 + 12);
+    EXPECT_EQ(ad.RecoverAddress(id3.value(), 4096), std::nullopt);
+}
+
+TEST(MmapTracker, UnmapInTwoSteps) {
+    SeedPlatform platform;
+    platform.AddMapping(65536, 4 * 4096);
+
+    MmapTracker tracker(&platform, true);
+    ASSERT_TRUE(tracker.Seed());
+
+    Spans unmapped;
+    tracker.SetUnmapCallback([](void* data, uintptr_t start, size_t size) -> void {
+        static_cast<Spans*>(data)->emplace_back(start, size);
+    }, &unmapped);
+
+    // The region stops being tracked first, and is reported afterward.
+    tracker.NotifyUnmapping(Ptr(65536), 4096);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536 + 4096, 3 * 4096}}));
+    EXPECT_TRUE(unmapped.empty());
+    tracker.NotifyUnmapped(Ptr(65536), 4096);
+    EXPECT_EQ(unmapped, (Spans{{65536, 4096}}));
+
+    // A failed call puts it back.
+    tracker.NotifyUnmapping(Ptr(65536 + 4096), 4096);
+    tracker.NotifyMap(Ptr(65536 + 4096), 4096);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536 + 4096, 3 * 4096}}));
+
+    // A remap reports whatever it no longer covers.
+    unmapped.clear();
+    tracker.NotifyUnmapping(Ptr(65536 + 4096), 3 * 4096);
+    tracker.NotifyRemapped(Ptr(65536 + 4096), 3 * 4096, Ptr(65536 + 4096), 4096);
+    EXPECT_EQ(AllMappings(&tracker), (Spans{{65536 + 4096, 4096}}));
+    EXPECT_EQ(unmapped, (Spans{{65536 + 2 * 4096, 2 * 4096}}));
+}
+
+#if defined(ADDRZ_MMAP_INTERPOSE)
+TEST(MmapTracker, Interposed) {
+    MmapTracker tracker(nullptr, true);
+    ASSERT_TRUE(tracker.Seed());
+    ASSERT_TRUE(MmapTracker::Install(&tracker));
+
+    size_t size = 16 * 4096;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(p, MAP_FAILED);
+
+    Mapping map;
+    EXPECT_TRUE(tracker.GetAddressMapping(p, &map));
+    EXPECT_TRUE(map.owns(reinterpret_cast<uintptr_t>(p) + size - 1));
+
+    munmap(p, size);
+    EXPECT_FALSE(tracker.GetAddressMapping(p, &map));
+    MmapTracker::Install(nullptr);
+}
+
+TEST(MmapTracker, InterposedRace) {
+    MmapTracker tracker(nullptr, true);
+    ASSERT_TRUE(tracker.Seed());
+    ASSERT_TRUE(MmapTracker::Install(&tracker));
+
+    size_t size = 4 * 4096;
+    void* target = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    ASSERT_NE(target, MAP_FAILED);
+    munmap(target, size);
+
+    // Both threads keep mapping |target| and unmapping it again. Whichever
+    // holds it must always find it in the tracker, even while the other is
+    // unmapping its own copy.
+    std::atomic<size_t> missing{0};
+    auto churn = [&]() -> void {
+        for (size_t i = 0; i < 20000; i++) {
+            void* p = mmap(target, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+            if (p == MAP_FAILED)
+                continue;
+            Mapping map;
+            if (p == target && !tracker.GetAddressMapping(p, &map))
+                missing++;
+            munmap(p, size);
+        }
+    };
+    std::thread a(churn);
+    std::thread b(churn);
+    a.join();
+    b.join();
+
+    EXPECT_EQ(missing, 0);
+    MmapTracker::Install(nullptr);
+}
+
+TEST(MmapTracker, InterposedCallbackLocks) {
+    MmapTracker tracker(nullptr, true);
+    ASSERT_TRUE(tracker.Seed());
+    ASSERT_TRUE(MmapTracker::Install(&tracker));
+
+    // The callback takes a lock that another thread holds while it maps
+    // memory. Neither may wait on the other.
+    std::mutex lock;
+    tracker.SetUnmapCallback([](void* data, uintptr_t start, size_t size) -> void {
+        std::lock_guard<std::mutex> guard(*static_cast<std::mutex*>(data));
+    }, &lock);
+
+    size_t size = 4096;
+    auto unmapper = [&]() -> void {
+        for (size_t i = 0; i < 20000; i++) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED)
+                munmap(p, size);
+        }
+    };
+    auto mapper = [&]() -> void {
+        for (size_t i = 0; i < 20000; i++) {
+            void* p;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            }
+            if (p != MAP_FAILED)
+                munmap(p, size);
+        }
+    };
+    std::thread a(unmapper);
+    std::thread b(mapper);
+    a.join();
+    b.join();
+
+    tracker.SetUnmapCallback(nullptr, nullptr);
+    MmapTracker::Install(nullptr);
+}
+
+TEST(MmapTracker, InterposedFork) {
+    MmapTracker tracker(nullptr, true);
+    ASSERT_TRUE(tracker.Seed());
+    ASSERT_TRUE(MmapTracker::Install(&tracker));
+
+    // Fork while another thread keeps recording events. The child must
+    // still be able to map memory.
+    std::atomic<bool> done{false};
+    std::thread churn([&]() -> void {
+        while (!done) {
+            void* p = mmap(nullptr, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED)
+                munmap(p, 4096);
+        }
+    });
+
+    for (size_t i = 0; i < 50; i++) {
+        pid_t pid = fork();
+        ASSERT_NE(pid, -1);
+        if (pid == 0) {
+            alarm(10);
+            void* p = mmap(nullptr, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            _exit(p != MAP_FAILED && munmap(p, 4096) == 0 ? 0 : 1);
+        }
+
+        int status;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(WEXITSTATUS(status), 0);
+    }
+
+    done = true;
+    churn.join();
+    MmapTracker::Install(nullptr);
+}
+#endif
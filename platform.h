@@ -29,6 +29,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "mapping.h"
 
 namespace am {
@@ -39,6 +41,27 @@ class IPlatform {
 
     virtual int GetPageSize() = 0;
     virtual bool GetAddressMapping(void* address, Mapping* map) = 0;
+
+    // Platforms may cache a view of the address space between lookups. These
+    // are hints that the address space has changed: Invalidate discards the
+    // cached view so the next lookup re-queries, and Refresh re-queries
+    // immediately.
+    virtual void InvalidateMappings() {}
+    virtual bool RefreshMappings() { return true; }
+
+    // Fill |maps| with every mapping in the address space, sorted and
+    // coalesced, from a single view of it. This is optional: platforms that
+    // cannot enumerate return false, and callers fall back to
+    // GetAddressMapping.
+    virtual bool GetAllMappings(std::vector<Mapping>* maps) { return false; }
+
+    // Called around fork() by wrappers that query this platform from other
+    // threads, after taking their own locks, so that the child does not
+    // inherit a lock held mid-query. Platforms that lock internally take
+    // those locks here, and release them in UnlockAfterFork, which runs in
+    // both the parent and the child.
+    virtual void LockForFork() {}
+    virtual void UnlockAfterFork() {}
 };
 
 } // namespace am
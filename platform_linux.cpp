@@ -27,33 +27,262 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
-#include "platform.h"
+#include "platform_linux.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
-#include "proc_maps.h"
+#include <atomic>
 
 namespace am {
 
-class LinuxPlatform final : public IPlatform {
-  public:
-    int GetPageSize() override {
-        return getpagesize();
+// Counts forks, so that a query fd can tell it was opened in the parent
+// without a getpid() on every lookup.
+static std::atomic<uint64_t> sForkGeneration{0};
+
+static void CountFork() {
+    sForkGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+// From <linux/fs.h>. It is duplicated here so that we can build against
+// headers older than the running kernel.
+struct ProcmapQuery {
+    uint64_t size;
+    uint64_t query_flags;
+    uint64_t query_addr;
+    uint64_t vma_start;
+    uint64_t vma_end;
+    uint64_t vma_flags;
+    uint64_t vma_page_size;
+    uint64_t vma_offset;
+    uint64_t inode;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t vma_name_size;
+    uint32_t build_id_size;
+    uint64_t vma_name_addr;
+    uint64_t build_id_addr;
+};
+static constexpr unsigned long kProcmapQuery = _IOWR('f', 17, ProcmapQuery);
+
+// The PROCMAP_QUERY_VMA_* flags, which Mapping::prot mirrors.
+static constexpr uint64_t kVmaFlagsMask = 0xf;
+
+LinuxPlatform::LinuxPlatform(Mode mode, Coalesce coalesce)
+  : mode_(mode),
+    coalesce_(coalesce),
+    use_procmap_query_(mode == Mode::Auto)
+{
+    static std::once_flag sForkHandler;
+    std::call_once(sForkHandler, []() -> void {
+        pthread_atfork(nullptr, nullptr, CountFork);
+    });
+}
+
+LinuxPlatform::~LinuxPlatform() {
+    if (query_fd_ >= 0)
+        close(query_fd_);
+}
+
+int LinuxPlatform::GetPageSize() {
+    return getpagesize();
+}
+
+bool LinuxPlatform::GetAddressMapping(void* address, Mapping* map) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (use_procmap_query_) {
+        auto result = QueryMapping(reinterpret_cast<uintptr_t>(address), map);
+        if (result != QueryResult::Unsupported)
+            return result == QueryResult::Found;
     }
-    bool GetAddressMapping(void* address, Mapping* map) override {
-        std::vector<Mapping> maps;
-        if (!ReadProcMaps(&maps))
-            return false;
 
-        SortAndCoalesceMaps(maps);
-        auto it = FindAddressInSortedMap(maps, address);
-        if (!it)
-            return false;
+    if (mode_ == Mode::Stream)
+        return reader_.FindMapping(reinterpret_cast<uintptr_t>(address), map, coalesce_);
 
-        *map = maps[*it];
+    if (snapshot_valid_ && FindInSnapshot(address, map))
         return true;
+    if (!RefreshLocked())
+        return false;
+    return FindInSnapshot(address, map);
+}
+
+void LinuxPlatform::InvalidateMappings() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshot_valid_ = false;
+}
+
+bool LinuxPlatform::RefreshMappings() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return RefreshLocked();
+}
+
+bool LinuxPlatform::GetAllMappings(std::vector<Mapping>* maps) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (mode_ == Mode::Stream) {
+        maps->clear();
+        return ReadCoalesced(maps);
     }
-};
+
+    if (!RefreshLocked())
+        return false;
+    *maps = snapshot_;
+    return true;
+}
+
+void LinuxPlatform::LockForFork() {
+    mutex_.lock();
+}
+
+void LinuxPlatform::UnlockAfterFork() {
+    mutex_.unlock();
+}
+
+bool LinuxPlatform::UsingProcmapQuery() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (use_procmap_query_ && query_fd_ < 0)
+        OpenQueryFd();
+    return use_procmap_query_;
+}
+
+bool LinuxPlatform::OpenQueryFd() {
+    // The fd is bound to the address space of the process that opened it, so
+    // it must be re-opened in a forked child.
+    uint64_t generation = sForkGeneration.load(std::memory_order_relaxed);
+    if (query_fd_ >= 0 && query_generation_ == generation)
+        return true;
+
+    if (query_fd_ >= 0)
+        close(query_fd_);
+    query_fd_ = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    query_generation_ = generation;
+    if (query_fd_ < 0) {
+        // Fall back for good, rather than retrying the open on every lookup.
+        use_procmap_query_ = false;
+        return false;
+    }
+
+    // Probe with an address that is always mapped, to find out whether the
+    // kernel knows about the ioctl at all.
+    Mapping probe;
+    if (QueryVma(reinterpret_cast<uintptr_t>(&probe), &probe) == QueryResult::Unsupported) {
+        use_procmap_query_ = false;
+        close(query_fd_);
+        query_fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+auto LinuxPlatform::QueryVma(uintptr_t address, Mapping* vma) -> QueryResult {
+    if (!query_name_)
+        query_name_.reset(new char[PATH_MAX]);
+
+    ProcmapQuery q = {};
+    q.size = sizeof(q);
+    q.query_addr = address;
+    q.vma_name_addr = reinterpret_cast<uintptr_t>(query_name_.get());
+    q.vma_name_size = PATH_MAX;
+    if (ioctl(query_fd_, kProcmapQuery, &q) != 0) {
+        if (errno == ENOENT)
+            return QueryResult::NotFound;
+        if (errno != ENAMETOOLONG)
+            return QueryResult::Unsupported;
+
+        // Go without the path.
+        q.vma_name_addr = 0;
+        q.vma_name_size = 0;
+        if (ioctl(query_fd_, kProcmapQuery, &q) != 0)
+            return errno == ENOENT ? QueryResult::NotFound : QueryResult::Unsupported;
+    }
+    vma->start = q.vma_start;
+    vma->size = q.vma_end - q.vma_start;
+    vma->prot = uint8_t(q.vma_flags & kVmaFlagsMask);
+
+    // The size includes the terminator.
+    vma->path_id = q.vma_name_size > 1 ? InternPath(query_name_.get(), q.vma_name_size - 1) : 0;
+    return QueryResult::Found;
+}
+
+auto LinuxPlatform::QueryMapping(uintptr_t address, Mapping* map) -> QueryResult {
+    if (!OpenQueryFd())
+        return QueryResult::Unsupported;
+
+    Mapping run;
+    auto result = QueryVma(address, &run);
+    if (result != QueryResult::Found)
+        return result;
+
+    // Coalesce with adjacent VMAs in both directions.
+    Mapping prev;
+    while (run.start && QueryVma(run.start - 1, &prev) == QueryResult::Found &&
+           CanCoalesce(prev, run, coalesce_))
+    {
+        prev.Merge(run);
+        run = prev;
+    }
+
+    Mapping next;
+    while (run.end() && QueryVma(run.end(), &next) == QueryResult::Found &&
+           CanCoalesce(run, next, coalesce_))
+    {
+        run.Merge(next);
+    }
+
+    *map = run;
+    return QueryResult::Found;
+}
+
+bool LinuxPlatform::ReadCoalesced(std::vector<Mapping>* maps) {
+    // The kernel emits mappings in ascending order, so they can be coalesced
+    // as they are read. Sorting is only a fallback in case that changes.
+    bool sorted = true;
+    Coalesce coalesce = coalesce_;
+    bool ok = reader_.ForEach([maps, coalesce, &sorted](const Mapping& map) -> bool {
+        if (!maps->empty()) {
+            Mapping& last = maps->back();
+            if (CanCoalesce(last, map, coalesce)) {
+                last.Merge(map);
+                return true;
+            }
+            if (map.start < last.end())
+                sorted = false;
+        }
+        maps->emplace_back(map);
+        return true;
+    });
+    if (!ok)
+        return false;
+
+    if (!sorted)
+        SortAndCoalesceMaps(*maps, coalesce_);
+    return true;
+}
+
+bool LinuxPlatform::RefreshLocked() {
+    // clear() keeps the capacity, so steady-state refreshes do not need to
+    // grow the vector again.
+    snapshot_.clear();
+    snapshot_valid_ = false;
+    if (!ReadCoalesced(&snapshot_))
+        return false;
+
+    snapshot_valid_ = true;
+    return true;
+}
+
+bool LinuxPlatform::FindInSnapshot(void* address, Mapping* map) {
+    auto it = FindAddressInSortedMap(snapshot_, address);
+    if (!it)
+        return false;
+
+    *map = snapshot_[*it];
+    return true;
+}
 
 IPlatform* IPlatform::GetDefault() {
     static LinuxPlatform sPlatform;
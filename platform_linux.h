@@ -0,0 +1,118 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "platform.h"
+#include "proc_maps.h"
+
+namespace am {
+
+// Address space queries backed by /proc/self/maps. There are three ways to
+// answer a lookup:
+//
+// Query: On Linux 6.11 and newer, the PROCMAP_QUERY ioctl asks the kernel for
+// the VMA covering an address instead of dumping the whole table. Neighbouring
+// VMAs are queried as well so that the result is coalesced the same way
+// SortAndCoalesceMaps would coalesce it.
+//
+// Snapshot: The text is parsed into a sorted, coalesced snapshot and lookups
+// are served from it, only re-reading when a lookup misses. A burst of new
+// addresses therefore costs a single parse. The snapshot can be stale in the
+// other direction too: a mapping that has since been unmapped will still hit.
+// Callers that know the address space has shrunk should call
+// InvalidateMappings().
+//
+// Stream: Nothing is cached. Each lookup scans the text in address order and
+// stops just past the target, so low addresses only read a prefix.
+//
+// Mode::Auto uses Query where the kernel supports it, and Snapshot otherwise.
+//
+// Mappings carry permissions and paths. By default, adjacent mappings are
+// coalesced regardless of them; Coalesce::SameAttributes stops at every
+// change, which AddressDict permission policies need to be precise.
+class LinuxPlatform final : public IPlatform {
+  public:
+    enum class Mode {
+        Auto,
+        Snapshot,
+        Stream
+    };
+
+    explicit LinuxPlatform(Mode mode = Mode::Auto, Coalesce coalesce = Coalesce::Adjacent);
+    ~LinuxPlatform();
+
+    int GetPageSize() override;
+    bool GetAddressMapping(void* address, Mapping* map) override;
+    void InvalidateMappings() override;
+    bool RefreshMappings() override;
+    bool GetAllMappings(std::vector<Mapping>* maps) override;
+    void LockForFork() override;
+    void UnlockAfterFork() override;
+
+    // Returns true if lookups are being answered by PROCMAP_QUERY.
+    bool UsingProcmapQuery();
+
+  private:
+    enum class QueryResult {
+        Found,
+        NotFound,
+        Unsupported
+    };
+
+    QueryResult QueryMapping(uintptr_t address, Mapping* map);
+    QueryResult QueryVma(uintptr_t address, Mapping* vma);
+    bool OpenQueryFd();
+
+    bool ReadCoalesced(std::vector<Mapping>* maps);
+    bool RefreshLocked();
+    bool FindInSnapshot(void* address, Mapping* map);
+
+  private:
+    std::mutex mutex_;
+    Mode mode_;
+    Coalesce coalesce_;
+    bool use_procmap_query_;
+    int query_fd_ = -1;
+    // The fork generation query_fd_ was opened in.
+    uint64_t query_generation_ = 0;
+    std::unique_ptr<char[]> query_name_;
+
+    ProcMapsReader reader_;
+    std::vector<Mapping> snapshot_;
+    bool snapshot_valid_ = false;
+};
+
+} // namespace am
@@ -29,6 +29,17 @@
 
 #include "platform.h"
 
+#include <memory>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+# include <sys/resource.h>
+# include <sys/wait.h>
+# include <unistd.h>
+
+# include "platform_linux.h"
+#endif
+
 #include <gtest/gtest.h>
 
 using namespace am;
@@ -53,3 +64,124 @@ TEST_F(PlatformTest, GetAddressMapping) {
     EXPECT_NE(map.start, 0);
     EXPECT_NE(map.size, 0);
 }
+
+TEST_F(PlatformTest, NewMappingAfterLookup) {
+    Mapping map;
+    ASSERT_TRUE(platform_->GetAddressMapping(platform_, &map));
+
+    // Large enough that the allocator must create a new mapping, which the
+    // platform has not seen yet.
+    static constexpr size_t kSize = 64 * 1024 * 1024;
+    std::unique_ptr<char[]> buffer(new char[kSize]);
+    ASSERT_TRUE(platform_->GetAddressMapping(buffer.get(), &map));
+    EXPECT_TRUE(map.owns(buffer.get()));
+    EXPECT_TRUE(map.owns(buffer.get() + kSize - 1));
+}
+
+TEST_F(PlatformTest, InvalidateMappings) {
+    platform_->InvalidateMappings();
+
+    Mapping map;
+    ASSERT_TRUE(platform_->GetAddressMapping(platform_, &map));
+    EXPECT_TRUE(map.owns(platform_));
+
+    ASSERT_TRUE(platform_->RefreshMappings());
+    ASSERT_TRUE(platform_->GetAddressMapping(platform_, &map));
+    EXPECT_TRUE(map.owns(platform_));
+}
+
+#if defined(__linux__)
+TEST(LinuxPlatform, ModesAgree) {
+    LinuxPlatform snapshot(LinuxPlatform::Mode::Snapshot);
+    LinuxPlatform stream(LinuxPlatform::Mode::Stream);
+    LinuxPlatform query(LinuxPlatform::Mode::Auto);
+    EXPECT_FALSE(snapshot.UsingProcmapQuery());
+    EXPECT_FALSE(stream.UsingProcmapQuery());
+
+    static constexpr size_t kSize = 64 * 1024 * 1024;
+    std::unique_ptr<char[]> heap(new char[kSize]);
+    int stack_var = 0;
+
+    void* addresses[] = {
+        &snapshot,
+        &stack_var,
+        heap.get(),
+        heap.get() + kSize - 1,
+        reinterpret_cast<void*>(&IPlatform::GetDefault),
+    };
+    for (void* address : addresses) {
+        Mapping a, b, c;
+        ASSERT_TRUE(snapshot.GetAddressMapping(address, &a));
+        ASSERT_TRUE(stream.GetAddressMapping(address, &b));
+        ASSERT_TRUE(query.GetAddressMapping(address, &c));
+        EXPECT_EQ(a.start, b.start);
+        EXPECT_EQ(a.size, b.size);
+        EXPECT_EQ(a.start, c.start);
+        EXPECT_EQ(a.size, c.size);
+    }
+
+    Mapping map;
+    EXPECT_FALSE(snapshot.GetAddressMapping(nullptr, &map));
+    EXPECT_FALSE(stream.GetAddressMapping(nullptr, &map));
+    EXPECT_FALSE(query.GetAddressMapping(nullptr, &map));
+}
+
+TEST(LinuxPlatform, SameAttributes) {
+    LinuxPlatform snapshot(LinuxPlatform::Mode::Snapshot, Coalesce::SameAttributes);
+    LinuxPlatform stream(LinuxPlatform::Mode::Stream, Coalesce::SameAttributes);
+    LinuxPlatform query(LinuxPlatform::Mode::Auto, Coalesce::SameAttributes);
+
+    int stack_var = 0;
+    void* text = reinterpret_cast<void*>(&IPlatform::GetDefault);
+    for (IPlatform* platform : {static_cast<IPlatform*>(&snapshot),
+                                static_cast<IPlatform*>(&stream),
+                                static_cast<IPlatform*>(&query)}) {
+        Mapping map;
+        ASSERT_TRUE(platform->GetAddressMapping(text, &map));
+        EXPECT_EQ(map.prot & (kProtRead | kProtWrite | kProtExec), kProtRead | kProtExec);
+        EXPECT_NE(map.path_id, 0);
+
+        ASSERT_TRUE(platform->GetAddressMapping(&stack_var, &map));
+        EXPECT_EQ(map.prot & (kProtRead | kProtWrite | kProtExec), kProtRead | kProtWrite);
+    }
+}
+
+// Runs |body| in a forked child, and returns whether it returned true.
+template <typename Func>
+static bool InChild(Func body) {
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(body() ? 0 : 1);
+
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+TEST(LinuxPlatform, QueryAfterFork) {
+    LinuxPlatform query(LinuxPlatform::Mode::Auto);
+    if (!query.UsingProcmapQuery())
+        return;
+
+    // The child's lookups must see its own address space, not the parent's.
+    EXPECT_TRUE(InChild([&query]() -> bool {
+        void* p = mmap(nullptr, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        Mapping map;
+        return p != MAP_FAILED && query.GetAddressMapping(p, &map) && map.owns(p);
+    }));
+}
+
+TEST(LinuxPlatform, QueryOpenFails) {
+    // Once the fd cannot be opened, stop trying.
+    EXPECT_TRUE(InChild([]() -> bool {
+        LinuxPlatform query(LinuxPlatform::Mode::Auto);
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+            return false;
+        limit.rlim_cur = 0;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            return false;
+        return !query.UsingProcmapQuery();
+    }));
+}
+#endif
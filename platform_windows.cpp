@@ -38,6 +38,28 @@
 
 namespace am {
 
+static uint8_t ProtFromRegion(const MEMORY_BASIC_INFORMATION& mbi) {
+    if (mbi.State != MEM_COMMIT || (mbi.Protect & (PAGE_GUARD | PAGE_NOACCESS)))
+        return 0;
+
+    switch (mbi.Protect & 0xff) {
+        case PAGE_READONLY:
+            return kProtRead;
+        case PAGE_READWRITE:
+        case PAGE_WRITECOPY:
+            return kProtRead | kProtWrite;
+        case PAGE_EXECUTE:
+            return kProtExec;
+        case PAGE_EXECUTE_READ:
+            return kProtRead | kProtExec;
+        case PAGE_EXECUTE_READWRITE:
+        case PAGE_EXECUTE_WRITECOPY:
+            return kProtRead | kProtWrite | kProtExec;
+        default:
+            return kProtUnknown;
+    }
+}
+
 class WindowsPlatform final : public IPlatform {
   public:
     int GetPageSize() override {
@@ -56,8 +78,34 @@ class WindowsPlatform final : public IPlatform {
         uintptr_t base_address = reinterpret_cast<uintptr_t>(mbi.BaseAddress);
         uintptr_t alloc_base = reinterpret_cast<uintptr_t>(mbi.AllocationBase);
 
+        // This spans every region of the allocation up to the address, and
+        // they can have different protections.
         map->start = alloc_base;
         map->size = (base_address + mbi.RegionSize) - alloc_base;
+        map->path_id = 0;
+        map->prot = kProtUnknown;
+        return true;
+    }
+    bool GetAllMappings(std::vector<Mapping>* maps) override {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+
+        maps->clear();
+        uintptr_t address = reinterpret_cast<uintptr_t>(si.lpMinimumApplicationAddress);
+        uintptr_t max_address = reinterpret_cast<uintptr_t>(si.lpMaximumApplicationAddress);
+        while (address < max_address) {
+            MEMORY_BASIC_INFORMATION mbi;
+            if (VirtualQuery(reinterpret_cast<void*>(address), &mbi, sizeof(mbi)) == 0)
+                break;
+
+            uintptr_t base_address = reinterpret_cast<uintptr_t>(mbi.BaseAddress);
+            if (mbi.State != MEM_FREE)
+                maps->emplace_back(
+                    Mapping{base_address, mbi.RegionSize, 0, ProtFromRegion(mbi)});
+            address = base_address + mbi.RegionSize;
+        }
+        if (!maps->empty())
+            SortAndCoalesceMaps(*maps);
         return true;
     }
 };
@@ -0,0 +1,227 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "pointer_cage.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <limits>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <sys/mman.h>
+#endif
+
+#include <amtl/am-bits.h>
+#include "platform.h"
+
+namespace am {
+
+PointerCage::PointerCage(uint64_t size)
+  : size_(size)
+{
+    // Offsets must fit in 32 bits.
+    assert(size_ && size_ <= (uint64_t(1) << 32));
+}
+
+PointerCage::~PointerCage() {
+    if (!base_)
+        return;
+#if defined(_WIN32)
+    VirtualFree(reinterpret_cast<void*>(base_), 0, MEM_RELEASE);
+#else
+    munmap(reinterpret_cast<void*>(base_), size_t(size_));
+#endif
+}
+
+bool PointerCage::Reserve() {
+    assert(!base_);
+    if (size_ > std::numeric_limits<size_t>::max())
+        return false;
+
+    page_size_ = IPlatform::GetDefault()->GetPageSize();
+    assert(ke::IsPowerOfTwo(page_size_));
+    assert(kCommitGranularity % page_size_ == 0);
+
+#if defined(_WIN32)
+    void* base = VirtualAlloc(nullptr, size_t(size_), MEM_RESERVE, PAGE_NOACCESS);
+    if (!base)
+        return false;
+#else
+    void* base = mmap(nullptr, size_t(size_), PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+#endif
+
+    // The first page stays inaccessible, as well as unused.
+    base_ = reinterpret_cast<uintptr_t>(base);
+    bump_ = base_ + page_size_;
+    committed_end_ = bump_;
+    return true;
+}
+
+size_t PointerCage::SizeClass(size_t size) {
+    size_t index = 0;
+    while ((kMinSmallSize << index) < size)
+        index++;
+    assert(index < kNumSizeClasses);
+    return index;
+}
+
+void* PointerCage::Allocate(size_t size) {
+    if (!base_)
+        return nullptr;
+
+    if (size <= kMaxSmallSize) {
+        size_t index = SizeClass(size);
+        size_t class_size = kMinSmallSize << index;
+        void* ptr = free_lists_[index];
+        if (ptr)
+            free_lists_[index] = free_lists_[index]->next;
+        else
+            ptr = Bump(class_size, kMinSmallSize);
+        if (ptr)
+            stats_.allocated += class_size;
+        return ptr;
+    }
+
+    size = (size + page_size_ - 1) & ~(page_size_ - 1);
+    if (size > size_)
+        return nullptr;
+
+    void* ptr;
+    auto it = free_large_.lower_bound(size);
+    if (it != free_large_.end()) {
+        size_t block_size = it->first;
+        uintptr_t start = it->second;
+        RemoveFreeLarge(start, block_size);
+        if (block_size > size)
+            AddFreeLarge(start + size, block_size - size);
+        ptr = reinterpret_cast<void*>(start);
+    } else {
+        ptr = Bump(size, page_size_);
+    }
+    if (ptr)
+        stats_.allocated += size;
+    return ptr;
+}
+
+void PointerCage::Free(void* ptr, size_t size) {
+    if (!ptr)
+        return;
+    assert(owns(ptr));
+
+    if (size <= kMaxSmallSize) {
+        size_t index = SizeClass(size);
+        auto block = static_cast<FreeBlock*>(ptr);
+        block->next = free_lists_[index];
+        free_lists_[index] = block;
+        stats_.allocated -= kMinSmallSize << index;
+        return;
+    }
+
+    size = (size + page_size_ - 1) & ~(page_size_ - 1);
+    stats_.allocated -= size;
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+    auto next = free_large_starts_.lower_bound(start);
+    if (next != free_large_starts_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == start) {
+            start = prev->first;
+            size += prev->second;
+            RemoveFreeLarge(prev->first, prev->second);
+        }
+    }
+    next = free_large_starts_.lower_bound(start + size);
+    if (next != free_large_starts_.end() && next->first == start + size) {
+        size += next->second;
+        RemoveFreeLarge(next->first, next->second);
+    }
+
+    // A block that reaches the bump pointer goes back to it.
+    if (start + size == bump_)
+        bump_ = start;
+    else
+        AddFreeLarge(start, size);
+}
+
+void PointerCage::AddFreeLarge(uintptr_t start, size_t size) {
+    free_large_.emplace(size, start);
+    free_large_starts_.emplace(start, size);
+}
+
+void PointerCage::RemoveFreeLarge(uintptr_t start, size_t size) {
+    auto [first, last] = free_large_.equal_range(size);
+    auto it = std::find_if(first, last, [start](const auto& entry) -> bool {
+        return entry.second == start;
+    });
+    assert(it != last);
+    free_large_.erase(it);
+    free_large_starts_.erase(start);
+}
+
+void* PointerCage::Bump(size_t size, size_t align) {
+    uintptr_t start = (bump_ + align - 1) & ~uintptr_t(align - 1);
+    uint64_t end = uint64_t(start) + size;
+    if (end > uint64_t(base_) + size_)
+        return nullptr;
+    if (end > committed_end_ && !Commit(uintptr_t(end)))
+        return nullptr;
+
+    bump_ = uintptr_t(end);
+    return reinterpret_cast<void*>(start);
+}
+
+// Make memory up to |end| accessible, a granule at a time.
+bool PointerCage::Commit(uintptr_t end) {
+    uint64_t limit = uint64_t(base_) + size_;
+    uint64_t mask = uint64_t(kCommitGranularity - 1);
+    uint64_t new_end = (uint64_t(end) + mask) & ~mask;
+    new_end = std::min(new_end, limit);
+
+    void* start = reinterpret_cast<void*>(committed_end_);
+    size_t length = size_t(new_end - committed_end_);
+#if defined(_WIN32)
+    if (!VirtualAlloc(start, length, MEM_COMMIT, PAGE_READWRITE))
+        return false;
+#else
+    if (mprotect(start, length, PROT_READ | PROT_WRITE) != 0)
+        return false;
+#endif
+
+    committed_end_ = uintptr_t(new_end);
+    stats_.committed += length;
+    return true;
+}
+
+} // namespace am
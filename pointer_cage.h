@@ -0,0 +1,140 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+
+namespace am {
+
+struct PointerCageStats {
+    // Bytes handed out by Allocate and not yet freed, after rounding up to
+    // the size class.
+    size_t allocated = 0;
+    // Bytes made accessible so far. Memory is committed as the allocator
+    // reaches it and never returned.
+    size_t committed = 0;
+};
+
+// A reserved region of address space with its own allocator, for objects
+// whose pointers should compress without a lookup: a pointer in the cage
+// compresses to its offset from the base, a subtract, and decompresses with
+// an add. Offsets fit in 32 bits as long as the cage is at most 4GiB.
+//
+// The region is reserved inaccessible up front, and committed in
+// kCommitGranularity steps as the allocator bumps into it. The first page is
+// never handed out, so offset 0 can stand for nullptr.
+//
+// Allocations up to kMaxSmallSize come from power-of-two size classes, each
+// with a free list. Larger ones are whole pages, reused best-fit after they
+// are freed. Freed pages merge with free neighbours, and with the unused end
+// of the cage. The cage is not thread-safe.
+//
+// To have an AddressDict compress cage pointers the same way, attach the
+// cage with AddressDict::AttachCage.
+class PointerCage final {
+  public:
+    // Half the 32-bit id space, so a default cage attaches to a default
+    // AddressDict and leaves it room for other memory.
+    static constexpr uint64_t kDefaultSize = uint64_t(2) << 30;
+    static constexpr size_t kMinSmallSize = 16;
+    static constexpr size_t kMaxSmallSize = 2048;
+    static constexpr size_t kCommitGranularity = 64 * 1024;
+
+    explicit PointerCage(uint64_t size = kDefaultSize);
+    ~PointerCage();
+
+    PointerCage(const PointerCage&) = delete;
+    PointerCage& operator =(const PointerCage&) = delete;
+
+    // Reserve the address space. Returns false if it is not available, for
+    // example a 4GiB cage in a 32-bit process.
+    bool Reserve();
+    bool reserved() const { return base_ != 0; }
+
+    // Allocate |size| bytes, aligned to kMinSmallSize, or to the page size
+    // above kMaxSmallSize. Returns nullptr once the cage is full.
+    void* Allocate(size_t size);
+
+    // Free memory from Allocate. |size| must be the size it was allocated
+    // with.
+    void Free(void* ptr, size_t size);
+
+    bool owns(const void* ptr) const {
+        return reserved() && reinterpret_cast<uintptr_t>(ptr) - base_ < size_;
+    }
+
+    // |ptr| must be in the cage, or nullptr.
+    uint32_t Compress(const void* ptr) const {
+        if (!ptr)
+            return 0;
+        return uint32_t(reinterpret_cast<uintptr_t>(ptr) - base_);
+    }
+    void* Decompress(uint32_t offset) const {
+        if (!offset)
+            return nullptr;
+        return reinterpret_cast<void*>(base_ + offset);
+    }
+
+    uintptr_t base() const { return base_; }
+    uint64_t size() const { return size_; }
+
+    PointerCageStats stats() const { return stats_; }
+
+  private:
+    static constexpr size_t kNumSizeClasses = 8;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static size_t SizeClass(size_t size);
+    void AddFreeLarge(uintptr_t start, size_t size);
+    void RemoveFreeLarge(uintptr_t start, size_t size);
+    void* Bump(size_t size, size_t align);
+    bool Commit(uintptr_t end);
+
+  private:
+    uint64_t size_;
+    uintptr_t base_ = 0;
+    size_t page_size_ = 0;
+    // Next unused byte, and the end of committed memory.
+    uintptr_t bump_ = 0;
+    uintptr_t committed_end_ = 0;
+    FreeBlock* free_lists_[kNumSizeClasses] = {};
+    // Freed large blocks, by size for best fit and by start for merging.
+    std::multimap<size_t, uintptr_t> free_large_;
+    std::map<uintptr_t, size_t> free_large_starts_;
+    PointerCageStats stats_;
+};
+
+} // namespace am
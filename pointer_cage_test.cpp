@@ -0,0 +1,142 @@
+// vim: set sts=8 ts=4 sw=4 tw=99 et:
+//
+// Copyright (C) 2024, David Anderson and AlliedModders LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//  * Neither the name of AlliedModders LLC nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "pointer_cage.h"
+
+#include <string.h>
+
+#include <set>
+#include <vector>
+
+#if defined(__linux__)
+# include "platform_linux.h"
+#endif
+
+#include <gtest/gtest.h>
+
+using namespace am;
+
+TEST(PointerCage, Allocate) {
+    PointerCage cage(64 * 1024 * 1024);
+    EXPECT_EQ(cage.Allocate(16), nullptr);
+    ASSERT_TRUE(cage.Reserve());
+
+    std::set<void*> seen;
+    for (size_t size : {1, 16, 17, 100, 2048, 2049, 10000, 1024 * 1024}) {
+        void* ptr = cage.Allocate(size);
+        ASSERT_NE(ptr, nullptr) << size;
+        EXPECT_TRUE(cage.owns(ptr));
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % PointerCage::kMinSmallSize, 0);
+        EXPECT_NE(cage.Compress(ptr), 0);
+        EXPECT_EQ(cage.Decompress(cage.Compress(ptr)), ptr);
+        memset(ptr, 0xcd, size);
+        EXPECT_TRUE(seen.emplace(ptr).second);
+    }
+    EXPECT_GE(cage.stats().committed, cage.stats().allocated);
+
+    int local = 0;
+    EXPECT_FALSE(cage.owns(&local));
+    EXPECT_EQ(cage.Compress(nullptr), 0);
+    EXPECT_EQ(cage.Decompress(0), nullptr);
+}
+
+TEST(PointerCage, Reuse) {
+    PointerCage cage(16 * 1024 * 1024);
+    ASSERT_TRUE(cage.Reserve());
+
+    void* small = cage.Allocate(40);
+    void* large = cage.Allocate(3 * 4096);
+    ASSERT_NE(small, nullptr);
+    ASSERT_NE(large, nullptr);
+    size_t allocated = cage.stats().allocated;
+
+    cage.Free(small, 40);
+    cage.Free(large, 3 * 4096);
+    EXPECT_EQ(cage.stats().allocated, 0);
+
+    // Same size class, and best fit from the freed pages.
+    EXPECT_EQ(cage.Allocate(64), small);
+    EXPECT_EQ(cage.Allocate(4096), large);
+    void* rest = cage.Allocate(2 * 4096);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(rest), reinterpret_cast<uintptr_t>(large) + 4096);
+    EXPECT_EQ(cage.stats().allocated, allocated);
+}
+
+TEST(PointerCage, Full) {
+    static constexpr size_t kSize = 1024 * 1024;
+    PointerCage cage(kSize);
+    ASSERT_TRUE(cage.Reserve());
+
+    size_t count = 0;
+    while (cage.Allocate(2048))
+        count++;
+    EXPECT_GT(count, kSize / 2048 - 4);
+    EXPECT_LT(count, kSize / 2048);
+    EXPECT_EQ(cage.Allocate(kSize), nullptr);
+    EXPECT_EQ(cage.stats().committed, kSize - 4096);
+}
+
+TEST(PointerCage, MergesFreedPages) {
+    PointerCage cage(16 * 1024 * 1024);
+    ASSERT_TRUE(cage.Reserve());
+
+    char* a = static_cast<char*>(cage.Allocate(2 * 4096));
+    char* b = static_cast<char*>(cage.Allocate(3 * 4096));
+    char* c = static_cast<char*>(cage.Allocate(4096));
+    void* small = cage.Allocate(16);
+    ASSERT_EQ(b, a + 2 * 4096);
+    ASSERT_EQ(c, b + 3 * 4096);
+    ASSERT_NE(small, nullptr);
+
+    // Freed in any order, neighbours come back as one block.
+    cage.Free(a, 2 * 4096);
+    cage.Free(c, 4096);
+    cage.Free(b, 3 * 4096);
+    EXPECT_EQ(cage.Allocate(6 * 4096), a);
+
+    // Pages freed at the end of the cage go back to the bump pointer.
+    char* d = static_cast<char*>(cage.Allocate(4 * 4096));
+    cage.Free(d, 4 * 4096);
+    EXPECT_EQ(cage.Allocate(8 * 4096), d);
+}
+
+#if defined(__linux__)
+TEST(PointerCage, FirstPageInaccessible) {
+    PointerCage cage(16 * 1024 * 1024);
+    ASSERT_TRUE(cage.Reserve());
+    ASSERT_NE(cage.Allocate(16), nullptr);
+
+    LinuxPlatform platform(LinuxPlatform::Mode::Stream, Coalesce::SameAttributes);
+    Mapping map;
+    ASSERT_TRUE(platform.GetAddressMapping(reinterpret_cast<void*>(cage.base()), &map));
+    EXPECT_EQ(map.prot & (kProtRead | kProtWrite), 0);
+    ASSERT_TRUE(platform.GetAddressMapping(reinterpret_cast<void*>(cage.base() + 4096), &map));
+    EXPECT_EQ(map.prot & (kProtRead | kProtWrite), kProtRead | kProtWrite);
+}
+#endif
@@ -29,33 +29,299 @@
 
 #include "proc_maps.h"
 
-#include <inttypes.h>
-#include <stdio.h>
-
-#include <fstream>
-#include <string>
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 
 namespace am {
 
-bool ReadProcMaps(std::vector<Mapping>* out) {
-    std::ifstream in("/proc/self/maps", std::ios::binary);
-    if (!in.is_open())
+// Decode a run of hex digits, advancing |p| past them.
+static inline bool ParseHex(const char*& p, const char* end, uintptr_t* out) {
+    const char* start = p;
+    uintptr_t value = 0;
+    for (; p < end; p++) {
+        unsigned c = static_cast<unsigned char>(*p);
+        unsigned digit = c - '0';
+        if (digit > 9) {
+            digit = (c | 0x20) - 'a';
+            if (digit > 5)
+                break;
+            digit += 10;
+        }
+        value = (value << 4) | digit;
+    }
+    *out = value;
+    return p != start;
+}
+
+static inline void SkipSpaces(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+}
+
+static inline void SkipField(const char*& p, const char* end) {
+    SkipSpaces(p, end);
+    while (p < end && *p != ' ' && *p != '\t')
+        p++;
+}
+
+// Decode "rwxp" style permissions. Anything else leaves them unknown.
+static inline uint8_t ParsePerms(const char*& p, const char* end) {
+    SkipSpaces(p, end);
+    if (end - p < 4)
+        return kProtUnknown;
+
+    uint8_t prot = 0;
+    if (p[0] == 'r')
+        prot |= kProtRead;
+    else if (p[0] != '-')
+        return kProtUnknown;
+    if (p[1] == 'w')
+        prot |= kProtWrite;
+    else if (p[1] != '-')
+        return kProtUnknown;
+    if (p[2] == 'x')
+        prot |= kProtExec;
+    else if (p[2] != '-')
+        return kProtUnknown;
+    if (p[3] == 's')
+        prot |= kProtShared;
+    else if (p[3] != 'p')
+        return kProtUnknown;
+    p += 4;
+    return prot;
+}
+
+// Lines look like:
+//   7f0e3a400000-7f0e3a422000 r--p 00000000 08:01 1234 /usr/lib/libc.so.6
+//
+// The range is required. Permissions and the path are decoded if present;
+// the offset, device and inode are skipped. If the line was cut short by
+// the buffer, its path is incomplete and is not recorded.
+static inline bool ParseLine(const char* p, const char* end, bool truncated,
+                             ProcMapsReader::PathCache* paths, Mapping* m)
+{
+    uintptr_t start, last;
+    if (!ParseHex(p, end, &start) || p == end || *p != '-')
+        return false;
+    p++;
+    if (!ParseHex(p, end, &last) || last < start)
         return false;
-    return ReadProcMaps(in, out);
+    m->start = start;
+    m->size = last - start;
+    m->path_id = 0;
+    m->prot = ParsePerms(p, end);
+    if (m->prot == kProtUnknown || truncated)
+        return true;
+
+    for (int i = 0; i < 3; i++)
+        SkipField(p, end);
+    SkipSpaces(p, end);
+
+    // Consecutive lines usually belong to the same file.
+    size_t length = end - p;
+    if (!length)
+        return true;
+    if (paths->id && paths->text.size() == length && !memcmp(paths->text.data(), p, length)) {
+        m->path_id = paths->id;
+        return true;
+    }
+    m->path_id = InternPath(p, length);
+    paths->text.assign(p, length);
+    paths->id = m->path_id;
+    return true;
 }
 
-bool ReadProcMaps(std::istream& in, std::vector<Mapping>* out) {
-    std::string line;
-    while (std::getline(in, line)) {
+// Run the parser over chunks returned by |read_chunk|, which has the same
+// contract as read(2), handing each mapping to |visitor|. Lines that span
+// chunk boundaries are carried over to the front of the buffer. A line longer
+// than the buffer (which can only happen with a very long path) is parsed
+// from its prefix and the rest is skipped.
+template <typename ReadChunk, typename Visitor>
+static bool ParseChunks(char* buffer, ProcMapsReader::PathCache* paths, ReadChunk read_chunk,
+                        Visitor visitor)
+{
+    size_t len = 0;
+    bool skipping = false;
+
+    // Returns false if the line is malformed or the visitor is done, which
+    // ends parsing.
+    auto emit = [&](const char* p, const char* end, bool truncated) -> bool {
+        if (skipping) {
+            skipping = false;
+            return true;
+        }
         Mapping m;
-        uintptr_t end;
-        int rv = sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR, &m.start, &end);
-        if (rv != 2)
-            break;
-        m.size = end - m.start;
-        out->emplace_back(m);
+        if (!ParseLine(p, end, truncated, paths, &m))
+            return false;
+        return visitor(m);
+    };
+
+    while (true) {
+        ptrdiff_t n = read_chunk(buffer + len, ProcMapsReader::kBufferSize - len);
+        if (n < 0)
+            return false;
+        len += n;
+
+        const char* p = buffer;
+        const char* end = buffer + len;
+        while (const void* nl = memchr(p, '\n', end - p)) {
+            if (!emit(p, static_cast<const char*>(nl), false))
+                return true;
+            p = static_cast<const char*>(nl) + 1;
+        }
+
+        if (n == 0) {
+            // Last line, without a trailing newline.
+            if (p < end)
+                emit(p, end, false);
+            return true;
+        }
+
+        if (p == buffer && len == ProcMapsReader::kBufferSize) {
+            if (!emit(p, end, true))
+                return true;
+            skipping = true;
+            p = end;
+        }
+
+        len = end - p;
+        if (len)
+            memmove(buffer, p, len);
     }
-    return true;
+}
+
+ProcMapsReader::ProcMapsReader()
+{}
+
+ProcMapsReader::~ProcMapsReader()
+{}
+
+char* ProcMapsReader::buffer() {
+    if (!buffer_)
+        buffer_.reset(new char[kBufferSize]);
+    return buffer_.get();
+}
+
+bool ProcMapsReader::Read(std::vector<Mapping>* out) {
+    return Read("/proc/self/maps", out);
+}
+
+bool ProcMapsReader::Read(const char* path, std::vector<Mapping>* out) {
+    return ForEach(path, [out](const Mapping& map) -> bool {
+        out->emplace_back(map);
+        return true;
+    });
+}
+
+bool ProcMapsReader::Read(std::istream& in, std::vector<Mapping>* out) {
+    return ForEach(in, [out](const Mapping& map) -> bool {
+        out->emplace_back(map);
+        return true;
+    });
+}
+
+// Coalesce runs of adjacent mappings as they stream by, and stop once the
+// run containing |address| has ended.
+class MappingFinder {
+  public:
+    MappingFinder(uintptr_t address, Coalesce coalesce)
+      : address_(address),
+        coalesce_(coalesce)
+    {}
+
+    bool operator ()(const Mapping& map) {
+        if (run_.size && CanCoalesce(run_, map, coalesce_)) {
+            run_.Merge(map);
+            return true;
+        }
+        if (run_.size && run_.owns(address_)) {
+            found_ = true;
+            return false;
+        }
+        if (map.start > address_)
+            return false;
+        run_ = map;
+        return true;
+    }
+
+    bool Finish(bool ok, Mapping* map) {
+        if (!ok)
+            return false;
+        if (!found_ && (!run_.size || !run_.owns(address_)))
+            return false;
+        *map = run_;
+        return true;
+    }
+
+  private:
+    uintptr_t address_;
+    Coalesce coalesce_;
+    Mapping run_ = {};
+    bool found_ = false;
+};
+
+bool ProcMapsReader::FindMapping(uintptr_t address, Mapping* map, Coalesce coalesce) {
+    MappingFinder finder(address, coalesce);
+    return finder.Finish(ForEach(finder), map);
+}
+
+bool ProcMapsReader::FindMapping(std::istream& in, uintptr_t address, Mapping* map,
+                                 Coalesce coalesce)
+{
+    MappingFinder finder(address, coalesce);
+    return finder.Finish(ForEach(in, finder), map);
+}
+
+bool ProcMapsReader::Visit(const char* path, Visitor visitor, void* data) {
+#ifdef _WIN32
+    return false;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    auto read_chunk = [fd](char* dest, size_t size) -> ptrdiff_t {
+        while (true) {
+            ssize_t n = read(fd, dest, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            return n;
+        }
+    };
+    auto visit = [=](const Mapping& map) -> bool {
+        return visitor(data, map);
+    };
+    bool ok = ParseChunks(buffer(), &paths_, read_chunk, visit);
+    close(fd);
+    return ok;
+#endif
+}
+
+bool ProcMapsReader::Visit(std::istream& in, Visitor visitor, void* data) {
+    auto read_chunk = [&in](char* dest, size_t size) -> ptrdiff_t {
+        in.read(dest, size);
+        if (in.bad())
+            return -1;
+        return in.gcount();
+    };
+    auto visit = [=](const Mapping& map) -> bool {
+        return visitor(data, map);
+    };
+    return ParseChunks(buffer(), &paths_, read_chunk, visit);
+}
+
+bool ReadProcMaps(std::vector<Mapping>* out) {
+    ProcMapsReader reader;
+    return reader.Read(out);
+}
+
+bool ReadProcMaps(std::istream& in, std::vector<Mapping>* out) {
+    ProcMapsReader reader;
+    return reader.Read(in, out);
 }
 
 } // namespace am
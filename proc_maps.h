@@ -30,12 +30,84 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "mapping.h"
 
 namespace am {
 
+// Parser for /proc/<pid>/maps. The file is read in large chunks into a buffer
+// owned by the reader, and the address range, permissions and path of each
+// line are decoded. Paths are interned (see InternPath). The buffer is reused
+// across calls and mappings are appended to |out|, so once the caller's
+// vector has grown to fit, and every path has been seen once, reading
+// allocates nothing.
+class ProcMapsReader final {
+  public:
+    static constexpr size_t kBufferSize = 64 * 1024;
+
+    ProcMapsReader();
+    ~ProcMapsReader();
+
+    bool Read(std::vector<Mapping>* out);
+    bool Read(const char* path, std::vector<Mapping>* out);
+    bool Read(std::istream& in, std::vector<Mapping>* out);
+
+    // Stream mappings to |func| in file order, which for the kernel is
+    // ascending address order. Nothing is collected. Returning false from
+    // |func| stops reading.
+    template <typename Func>
+    bool ForEach(Func&& func) {
+        return ForEach("/proc/self/maps", std::forward<Func>(func));
+    }
+    template <typename Func>
+    bool ForEach(const char* path, Func&& func) {
+        using FuncType = std::remove_reference_t<Func>;
+        return Visit(path, &Thunk<FuncType>, &func);
+    }
+    template <typename Func>
+    bool ForEach(std::istream& in, Func&& func) {
+        using FuncType = std::remove_reference_t<Func>;
+        return Visit(in, &Thunk<FuncType>, &func);
+    }
+
+    // Find the mapping containing |address|, coalesced with any adjacent
+    // mappings, without sorting or collecting the file. Reading stops at the
+    // first gap after the address, so lookups of low addresses only read a
+    // prefix of the file.
+    bool FindMapping(uintptr_t address, Mapping* map,
+                     Coalesce coalesce = Coalesce::Adjacent);
+    bool FindMapping(std::istream& in, uintptr_t address, Mapping* map,
+                     Coalesce coalesce = Coalesce::Adjacent);
+
+    // The most recently interned path, to skip the intern table while
+    // consecutive lines name the same file.
+    struct PathCache {
+        std::string text;
+        uint32_t id = 0;
+    };
+
+  private:
+    using Visitor = bool (*)(void* data, const Mapping& map);
+
+    template <typename Func>
+    static bool Thunk(void* data, const Mapping& map) {
+        return (*static_cast<Func*>(data))(map);
+    }
+
+    bool Visit(const char* path, Visitor visitor, void* data);
+    bool Visit(std::istream& in, Visitor visitor, void* data);
+
+    char* buffer();
+
+  private:
+    std::unique_ptr<char[]> buffer_;
+    PathCache paths_;
+};
+
 bool ReadProcMaps(std::istream& in, std::vector<Mapping>* out);
 bool ReadProcMaps(std::vector<Mapping>* out);
 
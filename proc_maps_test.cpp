@@ -29,6 +29,9 @@
 
 #include "proc_maps.h"
 
+#include <sstream>
+#include <string>
+
 #include <gtest/gtest.h>
 
 using namespace am;
@@ -40,3 +43,158 @@ TEST(proc_maps, ReadProcMaps) {
     ASSERT_FALSE(maps.empty());
 }
 #endif
+
+TEST(proc_maps, ParseStream) {
+    std::istringstream in(
+        "00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon\n"
+        "00e03000-00e24000 rw-p 00000000 00:00 0           [heap]\n"
+        "7fff1a3b4000-7fff1a3d5000 rw-p 00000000 00:00 0   [stack]\n"
+        "FFFFF000-FFFFFFFF r--p 00000000 00:00 0\n");
+    std::vector<Mapping> maps;
+    ASSERT_TRUE(ReadProcMaps(in, &maps));
+    ASSERT_EQ(maps.size(), 4);
+    EXPECT_EQ(maps[0].start, 0x400000);
+    EXPECT_EQ(maps[0].size, 0x52000);
+    EXPECT_EQ(maps[1].start, 0xe03000);
+    EXPECT_EQ(maps[1].size, 0x21000);
+    if (sizeof(uintptr_t) == 8) {
+        EXPECT_EQ(maps[2].start, static_cast<uintptr_t>(0x7fff1a3b4000));
+        EXPECT_EQ(maps[2].size, 0x21000);
+    }
+    EXPECT_EQ(maps[3].start, 0xfffff000);
+    EXPECT_EQ(maps[3].size, 0xfff);
+}
+
+TEST(proc_maps, ParseAttributes) {
+    std::istringstream in(
+        "1000-2000 r-xp 00000000 08:02 173521      /usr/lib/with space.so\n"
+        "3000-4000 rw-s 00000000 00:01 12 /dev/zero (deleted)\n"
+        "5000-6000 ---p 00000000 00:00 0\n"
+        "7000-8000 r--p 00000000 08:02 173521      /usr/lib/with space.so\n");
+    std::vector<Mapping> maps;
+    ASSERT_TRUE(ReadProcMaps(in, &maps));
+    ASSERT_EQ(maps.size(), 4);
+    EXPECT_EQ(maps[0].prot, kProtRead | kProtExec);
+    EXPECT_STREQ(GetInternedPath(maps[0].path_id), "/usr/lib/with space.so");
+    EXPECT_EQ(maps[1].prot, kProtRead | kProtWrite | kProtShared);
+    EXPECT_STREQ(GetInternedPath(maps[1].path_id), "/dev/zero (deleted)");
+    EXPECT_EQ(maps[2].prot, 0);
+    EXPECT_EQ(maps[2].path_id, 0);
+    EXPECT_EQ(maps[3].prot, kProtRead);
+    EXPECT_EQ(maps[3].path_id, maps[0].path_id);
+}
+
+TEST(proc_maps, StopsAtMalformedLine) {
+    std::istringstream in(
+        "1000-2000 r-xp 00000000 08:02 1\n"
+        "garbage\n"
+        "3000-4000 r-xp 00000000 08:02 1\n");
+    std::vector<Mapping> maps;
+    ASSERT_TRUE(ReadProcMaps(in, &maps));
+    ASSERT_EQ(maps.size(), 1);
+    EXPECT_EQ(maps[0].start, 0x1000);
+}
+
+TEST(proc_maps, LinesSpanChunks) {
+    // Enough lines that some must straddle a buffer boundary, plus one line
+    // longer than the whole buffer.
+    std::string text;
+    for (uintptr_t i = 0; i < 4000; i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "%zx-%zx rw-p 00000000 00:00 0   /some/path\n",
+                 size_t(i * 0x2000), size_t(i * 0x2000 + 0x1000));
+        text += line;
+        if (i == 2000) {
+            text += "deadb000-deadb800 r--p 00000000 00:00 0 /";
+            text += std::string(ProcMapsReader::kBufferSize * 2, 'x');
+            text += "\n";
+        }
+    }
+    text += "ffff0000-ffff1000 r--p 00000000 00:00 0";
+    ASSERT_GT(text.size(), ProcMapsReader::kBufferSize * 3);
+
+    std::istringstream in(text);
+    std::vector<Mapping> maps;
+    ProcMapsReader reader;
+    ASSERT_TRUE(reader.Read(in, &maps));
+    ASSERT_EQ(maps.size(), 4002);
+    for (size_t i = 0; i <= 2000; i++) {
+        EXPECT_EQ(maps[i].start, i * 0x2000);
+        EXPECT_EQ(maps[i].size, 0x1000);
+    }
+    EXPECT_EQ(maps[2001].start, 0xdeadb000);
+    EXPECT_EQ(maps[2001].size, 0x800);
+    for (size_t i = 2001; i < 4000; i++) {
+        EXPECT_EQ(maps[i + 1].start, i * 0x2000);
+        EXPECT_EQ(maps[i + 1].size, 0x1000);
+    }
+    EXPECT_EQ(maps[4001].start, 0xffff0000);
+    EXPECT_EQ(maps[4001].size, 0x1000);
+}
+
+TEST(proc_maps, FindMapping) {
+    static const char kText[] =
+        "1000-2000 r-xp 00000000 08:02 1 /lib.so\n"
+        "2000-3000 r--p 00000000 08:02 1 /lib.so\n"
+        "3000-4000 rw-p 00000000 08:02 1 /lib.so\n"
+        "8000-9000 rw-p 00000000 00:00 0\n"
+        "a000-b000 rw-p 00000000 00:00 0\n";
+
+    ProcMapsReader reader;
+    Mapping map;
+    {
+        std::istringstream in(kText);
+        ASSERT_TRUE(reader.FindMapping(in, 0x2800, &map));
+        EXPECT_EQ(map.start, 0x1000);
+        EXPECT_EQ(map.size, 0x3000);
+        EXPECT_EQ(map.prot, kProtRead);
+        EXPECT_STREQ(GetInternedPath(map.path_id), "/lib.so");
+    }
+    {
+        std::istringstream in(kText);
+        ASSERT_TRUE(reader.FindMapping(in, 0x2800, &map, Coalesce::SameAttributes));
+        EXPECT_EQ(map.start, 0x2000);
+        EXPECT_EQ(map.size, 0x1000);
+        EXPECT_EQ(map.prot, kProtRead);
+    }
+    {
+        std::istringstream in(kText);
+        ASSERT_TRUE(reader.FindMapping(in, 0xafff, &map));
+        EXPECT_EQ(map.start, 0xa000);
+        EXPECT_EQ(map.size, 0x1000);
+    }
+    {
+        std::istringstream in(kText);
+        EXPECT_FALSE(reader.FindMapping(in, 0x4000, &map));
+    }
+    {
+        std::istringstream in(kText);
+        EXPECT_FALSE(reader.FindMapping(in, 0xb000, &map));
+    }
+}
+
+TEST(proc_maps, FindMappingStopsEarly) {
+    std::string text;
+    for (uintptr_t i = 0; i < 8000; i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "%zx-%zx rw-p 00000000 00:00 0\n",
+                 size_t(i * 0x2000), size_t(i * 0x2000 + 0x1000));
+        text += line;
+    }
+    ASSERT_GT(text.size(), ProcMapsReader::kBufferSize * 2);
+
+    std::istringstream in(text);
+    ProcMapsReader reader;
+    Mapping map;
+    ASSERT_TRUE(reader.FindMapping(in, 0x2010, &map));
+    EXPECT_EQ(map.start, 0x2000);
+    EXPECT_EQ(map.size, 0x1000);
+    EXPECT_FALSE(in.eof());
+
+    size_t count = 0;
+    std::istringstream in2(text);
+    ASSERT_TRUE(reader.ForEach(in2, [&count](const Mapping& map) -> bool {
+        return ++count < 10;
+    }));
+    EXPECT_EQ(count, 10);
+}